@@ -1,26 +1,130 @@
+// getline / fdopen / strdup を -std=c11 でも使う
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "calc.h"
 
 #if defined(TARGET_SYSTEM_LINUX)
 #define ASM_GLOBAL_MAIN "main"
 #define ASM_EXTERN_PRINTF "printf"
 #define ASM_EXTERN_EXIT "exit"
+#define ASM_EXTERN_READ "read"
+#define ASM_EXTERN_WRITE "write"
+#define ASM_EXTERN_CALLOC "calloc"
+#define ASM_EXTERN_REALLOC "realloc"
+#define ASM_EXTERN_GETENV "getenv"
+#define ASM_EXTERN_ATOI "atoi"
+#define ASM_EXTERN_SYSCONF "sysconf"
+#define ASM_EXTERN_PTHREAD_CREATE "pthread_create"
+#define ASM_EXTERN_PTHREAD_JOIN "pthread_join"
+#define ASM_EXTERN_PTHREAD_ATTR_INIT "pthread_attr_init"
+#define ASM_EXTERN_PTHREAD_ATTR_SETSTACKSIZE "pthread_attr_setstacksize"
+#define ASM_EXTERN_PTHREAD_KEY_CREATE "pthread_key_create"
+#define ASM_EXTERN_PTHREAD_GETSPECIFIC "pthread_getspecific"
+#define ASM_EXTERN_PTHREAD_SETSPECIFIC "pthread_setspecific"
+#define ASM_EXTERN_SCHED_YIELD "sched_yield"
+#define ASM_EXTERN_OPEN "open"
+#define ASM_EXTERN_LSEEK "lseek"
+#define ASM_EXTERN_MMAP "mmap"
+#define ASM_EXTERN_FTRUNCATE "ftruncate"
+#define ASM_EXTERN_FOPEN "fopen"
+#define ASM_EXTERN_FPRINTF "fprintf"
+#define ASM_EXTERN_FCLOSE "fclose"
+#define ASM_OPEN_CREATE_FLAGS "0x242"  // O_RDWR | O_CREAT | O_TRUNC
+#define ASM_SC_NPROCESSORS_ONLN "84"
+// --freestanding で使うシステムコール番号とエントリポイント
+#define ASM_SYS_WRITE "1"
+#define ASM_SYS_EXIT_GROUP "231"
+#define ASM_FREESTANDING_ENTRY "_start"
 #define ASM_CSTRING_SECTION ".section .rodata"
+#define ASM_CONST_SECTION ".section .rodata"
 #define ASM_DATA_SECTION ".section .data"
+// --profile-use で一度も呼ばれなかった関数を置く
+#define ASM_COLD_TEXT_SECTION ".section .text.unlikely,\"ax\",@progbits"
 #elif defined(TARGET_SYSTEM_MAC) || defined(__APPLE__)
 #define ASM_GLOBAL_MAIN "_main"
 #define ASM_EXTERN_PRINTF "_printf"
 #define ASM_EXTERN_EXIT "_exit"
+#define ASM_EXTERN_READ "_read"
+#define ASM_EXTERN_WRITE "_write"
+#define ASM_EXTERN_CALLOC "_calloc"
+#define ASM_EXTERN_REALLOC "_realloc"
+#define ASM_EXTERN_GETENV "_getenv"
+#define ASM_EXTERN_ATOI "_atoi"
+#define ASM_EXTERN_SYSCONF "_sysconf"
+#define ASM_EXTERN_PTHREAD_CREATE "_pthread_create"
+#define ASM_EXTERN_PTHREAD_JOIN "_pthread_join"
+#define ASM_EXTERN_PTHREAD_ATTR_INIT "_pthread_attr_init"
+#define ASM_EXTERN_PTHREAD_ATTR_SETSTACKSIZE "_pthread_attr_setstacksize"
+#define ASM_EXTERN_PTHREAD_KEY_CREATE "_pthread_key_create"
+#define ASM_EXTERN_PTHREAD_GETSPECIFIC "_pthread_getspecific"
+#define ASM_EXTERN_PTHREAD_SETSPECIFIC "_pthread_setspecific"
+#define ASM_EXTERN_SCHED_YIELD "_sched_yield"
+#define ASM_EXTERN_OPEN "_open"
+#define ASM_EXTERN_LSEEK "_lseek"
+#define ASM_EXTERN_MMAP "_mmap"
+#define ASM_EXTERN_FTRUNCATE "_ftruncate"
+#define ASM_EXTERN_FOPEN "_fopen"
+#define ASM_EXTERN_FPRINTF "_fprintf"
+#define ASM_EXTERN_FCLOSE "_fclose"
+#define ASM_OPEN_CREATE_FLAGS "0x602"  // O_RDWR | O_CREAT | O_TRUNC
+#define ASM_SC_NPROCESSORS_ONLN "58"
+// --freestanding は静的リンクできる Linux でだけ使う
+#define ASM_SYS_WRITE "0x2000004"
+#define ASM_SYS_EXIT_GROUP "0x2000001"
+#define ASM_FREESTANDING_ENTRY "start"
 #define ASM_CSTRING_SECTION ".section __TEXT,__cstring"
+#define ASM_CONST_SECTION ".section __TEXT,__const"
 #define ASM_DATA_SECTION ".section __DATA,__data"
+#define ASM_COLD_TEXT_SECTION ".section __TEXT,__text_cold,regular,pure_instructions"
 #else
 #define ASM_GLOBAL_MAIN "_main"
 #define ASM_EXTERN_PRINTF "_printf"
 #define ASM_EXTERN_EXIT "_exit"
+#define ASM_EXTERN_READ "_read"
+#define ASM_EXTERN_WRITE "_write"
+#define ASM_EXTERN_CALLOC "_calloc"
+#define ASM_EXTERN_REALLOC "_realloc"
+#define ASM_EXTERN_GETENV "_getenv"
+#define ASM_EXTERN_ATOI "_atoi"
+#define ASM_EXTERN_SYSCONF "_sysconf"
+#define ASM_EXTERN_PTHREAD_CREATE "_pthread_create"
+#define ASM_EXTERN_PTHREAD_JOIN "_pthread_join"
+#define ASM_EXTERN_PTHREAD_ATTR_INIT "_pthread_attr_init"
+#define ASM_EXTERN_PTHREAD_ATTR_SETSTACKSIZE "_pthread_attr_setstacksize"
+#define ASM_EXTERN_PTHREAD_KEY_CREATE "_pthread_key_create"
+#define ASM_EXTERN_PTHREAD_GETSPECIFIC "_pthread_getspecific"
+#define ASM_EXTERN_PTHREAD_SETSPECIFIC "_pthread_setspecific"
+#define ASM_EXTERN_SCHED_YIELD "_sched_yield"
+#define ASM_EXTERN_OPEN "_open"
+#define ASM_EXTERN_LSEEK "_lseek"
+#define ASM_EXTERN_MMAP "_mmap"
+#define ASM_EXTERN_FTRUNCATE "_ftruncate"
+#define ASM_EXTERN_FOPEN "_fopen"
+#define ASM_EXTERN_FPRINTF "_fprintf"
+#define ASM_EXTERN_FCLOSE "_fclose"
+#define ASM_OPEN_CREATE_FLAGS "0x602"  // O_RDWR | O_CREAT | O_TRUNC
+#define ASM_SC_NPROCESSORS_ONLN "58"
+// --freestanding は静的リンクできる Linux でだけ使う
+#define ASM_SYS_WRITE "0x2000004"
+#define ASM_SYS_EXIT_GROUP "0x2000001"
+#define ASM_FREESTANDING_ENTRY "start"
 #define ASM_CSTRING_SECTION ".section __TEXT,__cstring"
+#define ASM_CONST_SECTION ".section __TEXT,__const"
 #define ASM_DATA_SECTION ".section __DATA,__data"
+#define ASM_COLD_TEXT_SECTION ".section __TEXT,__text_cold,regular,pure_instructions"
 #endif
 #define ASM_TEXT_SECTION ".text"
 
@@ -47,41 +151,465 @@ typedef enum {
 
 // 変数・関数名最大文字数
 #define MAX_IDENTIFIER_LEN 32
-// 最大変数・関数数
+// 最大変数数
 #define MAX_VAR_FUNC 128
-// 最大関数定義部分
-#define MAX_FUNCTION_CODE_LENGTH (1024 * 1024)
+// 最大関数数
+#define MAX_FUNC 16384
+// --input で読むとき、1 度に読み進める最上位の文のおおよその文字数
+#define INPUT_WINDOW 65536
+// finalize_functions を並列にするときに 1 スレッドあたり最低限受け持つ関数の数
+#define FUNCS_PER_THREAD 64
 // 最大引数数
 #define MAX_ARGUMENTS 16
+// fork-join のタスクの見出しのバイト数 (関数, 引数数, 状態, 結果, 深さ, 退避領域)
+#define FJ_TASK_HEADER 48
+// 定数の引数での呼び出しをコンパイル時に評価するとき、1 回のコンパイルで実行する IR 命令の数の上限
+// (あきらめる呼び出しもここまでは実行するので、数 ms で使い切る大きさにする)
+#define EVAL_STEP_LIMIT 200000
+// 同じく、呼び出しの深さの上限
+#define EVAL_DEPTH_LIMIT 1000
+// 引数の一部を定数にした関数の複製の、1 回のコンパイルで作る IR 命令の数の上限
+#define CLONE_INST_LIMIT 16384
+// 複製の呼び出しにするとき、定数の引数を除いて前に詰め直す命令の数の上限
+// (深い入れ子の引数を段ごとに動かすと入れ子の深さの 2 乗かかる)
+#define SPECIALIZE_MOVE_LIMIT 4096
+// 関数の先頭の引数を渡すレジスタの数と、そのレジスタ
+// (mul32・div32 と fork-join の実行時ライブラリが呼び出し元に残すもの)
+#define ARG_REGISTER_COUNT 6
+#define ARG_REGISTER_1 "%ebx"
+#define ARG_REGISTER_2 "%r12d"
+#define ARG_REGISTER_3 "%r13d"
+#define ARG_REGISTER_4 "%r14d"
+#define ARG_REGISTER_5 "%r15d"
+#define ARG_REGISTER_6 "%r10d"
+// 関数を呼ぶ間、呼び出し元の累積を置くレジスタ。関数と fork-join の実行時ライブラリは
+// 呼び出し元に残し、mul32・div32 は使わない
+#define ACC_SAVE_REGISTER "%ecx"
+
+/**
+ * parser が生成する中間表現 (IR) の命令種別。
+ *
+ * 命令は生成していたアセンブリと 1 対 1 に対応する。項は %eax、累積は %edx、
+ * メモリは %r11d に置かれる前提で、lower_scalar がそのままのアセンブリに、
+ * lower_vector が SIMD レーン単位のアセンブリに変換する。
+ */
+typedef enum {
+  IR_TERM_CLEAR,   // 項を 0 にする
+  IR_ACC_CLEAR,    // 累積を 0 にする
+  IR_DIGIT,        // 項に 1 桁追加する (a: 基数, b: 桁の値)
+  IR_APPLY,        // 項を累積に適用する (a: 演算子, b: 符号)
+  IR_MEM_CLEAR,    // 累積とメモリを 0 にする
+  IR_MEM_RECALL,   // メモリを累積に読む
+  IR_MEM_ADD,      // 累積をメモリに加算する
+  IR_MEM_SUB,      // 累積をメモリから減算する
+  IR_NEST_BEGIN,   // 入れ子開始 (a: 入れ子レベル, b: 1 なら累積を退避しない)
+  IR_NEST_END,     // 入れ子終了 (b: 1 なら累積を退避していない)
+  IR_LOAD_VAR,     // 変数を項に読む (a: 変数番号)
+  IR_STORE_VAR,    // 累積を変数に書く (a: 変数番号)
+  IR_LOAD_ARG,     // 引数を項に読む (a: 引数番号, b: 定義中の関数の引数数)
+  IR_LOAD_COLUMN,  // バッチ入力の列を項に読む (a: 列番号)
+  IR_CALL_BEGIN,   // 関数呼び出し開始 (a: 関数番号, b: 引数数)
+  IR_ARG_BEGIN,    // 引数の評価開始 (a: 引数番号)
+  IR_PUSH_ARG,     // 評価した引数を渡す (a: 引数番号, b: 1 ならスタックに積む)
+  IR_CALL,         // 関数呼び出し (a: 関数番号, b: 引数数)
+  IR_IF_TEST,      // $if の条件判定 (a: ラベル番号, b: 1 なら節を入れ替えてある)
+  IR_IF_ELSE,      // $if の else 節開始 (a: ラベル番号)
+  IR_IF_END,       // $if の終了 (a: ラベル番号)
+  IR_ERROR,        // E を出力して終了する
+  IR_STEP,         // ビルトイン step 関数の本体
+  IR_SPAWN,        // IR_CALL の代わりに呼び出しをタスクとして積む (a: 関数番号, b: 引数数)
+  IR_JOIN,         // 積んだタスクを待って結果を項に読む (a: タスクの引数数)
+  IR_JOIN_END,     // タスクをスタックから下ろし、後の兄弟の結果を項に戻す (a: タスクの引数数)
+  IR_SAVE_VALUE,   // 項を退避領域に書く (a: 退避領域の番号)
+  IR_LOAD_VALUE,   // 退避領域の値を項に読む (a: 退避領域の番号)
+  IR_TERM_CONST,   // 項に定数を読む (a: 値)
+  IR_ACC_CONST,    // 累積に定数を読む (a: 値)
+  IR_APPLY_CONST,  // 定数の項を累積に適用する (a: 演算子, b: 符号を適用した値)
+  IR_MEM_CONST,    // メモリに定数を読む (a: 値)
+} IrOp;
+
+typedef struct {
+  IrOp op;
+  int a;
+  int b;
+} IrInst;
+
+typedef struct {
+  IrInst* insts;
+  size_t count;
+  size_t capacity;
+} IrBuffer;
 
 typedef struct {
   char name[MAX_IDENTIFIER_LEN + 1];
   int arg_count;
-  char code[MAX_FUNCTION_CODE_LENGTH];
-  size_t code_length;
+  IrBuffer ir;
+  unsigned arg_clobbers;  // 呼ぶと値が変わる引数レジスタ (ビット k - 1 が第 k 引数)
+  unsigned effects;       // 呼ぶと読み書きする状態 (EFFECT_* の和)
+  int value_slots;        // 共通部分式の値を退避する領域の数 (フレームの %rbp の下に置く)
+  bool cold;              // --profile-use で一度も呼ばれなかった関数 (特殊化せず、離れた節に置く)
+  int profile_base;       // --profile-generate で本体のカウンタの始め (最初は呼ばれた回数)
 } FunctionInfo;
 
-char variable_names[MAX_VAR_FUNC][MAX_IDENTIFIER_LEN + 1];
-int variable_count = 0;
+// 命令や関数の呼び出しが読み書きする状態 (FunctionInfo.effects のビット)
+enum {
+  EFFECT_READ_VAR = 1,
+  EFFECT_WRITE_VAR = 2,
+  EFFECT_READ_MEMORY = 4,
+  EFFECT_WRITE_MEMORY = 8,
+  EFFECT_ALL = 15,
+};
+
+/**
+ * 呼び出し 1 つの引数の渡し方 (plan_calls が IR_CALL_BEGIN の順に求める)。
+ */
+typedef struct {
+  bool spawn;        // IR_SPAWN でタスクにする (累積と引数をすべて積む)
+  unsigned stacked;  // 積んでから呼び出しの直前にレジスタに読む引数 (ビット k - 1 が第 k 引数)
+  int words;         // スタックに積む引数の数
+} CallPlan;
+
+/**
+ * lower_scalar が追う、引数を評価中の呼び出し 1 つ。
+ */
+typedef struct {
+  const CallPlan* plan;
+  int pad;            // 整列のため詰めたバイト数 (0 か 8)
+  bool acc_register;  // 呼び出し元の累積を積まずに ACC_SAVE_REGISTER に置いた
+} OpenCall;
+
+/**
+ * lower_scalar が追う、本体の始め (16 バイト境界) から積んだバイト数と、
+ * 引数を評価中の呼び出し (入れ子の順)。
+ * --profile-generate では次に使うカウンタと、変換中の $if のカウンタも追う。
+ */
+typedef struct {
+  int depth;
+  const CallPlan* plans;  // 変換する IR の呼び出しの渡し方
+  size_t plan_next;
+  OpenCall* calls;
+  size_t call_count;
+  size_t call_capacity;
+  bool acc_held;  // ACC_SAVE_REGISTER を外側の呼び出しが使っている
+  int profile_next;
+  int* profile_ifs;
+  size_t profile_if_count;
+  size_t profile_if_capacity;
+} StackState;
+
+/**
+ * fold_constants が追う、項 (%eax) か累積 (%edx) の値。
+ */
+typedef struct {
+  bool known;   // コンパイル時に値がわかっている
+  bool held;    // レジスタに値が入っている (わかっていない値は常に入っている)
+  int value;
+  bool sourced;  // 引数か変数を読んだそのままの値
+  IrInst source;
+  int epoch;  // source が変数なら、読んだときの書き込みの回数
+} FoldValue;
+
+/**
+ * fold_constants が追う変数の値。
+ */
+typedef struct {
+  bool known;
+  int value;
+} FoldVar;
+
+/**
+ * 引数の一部を定数にした関数の複製 (specialize_function が作る)。
+ */
+typedef struct {
+  int function;  // 複製元の関数番号
+  int clone;     // 複製の関数番号
+  bool constant[MAX_ARGUMENTS];
+  int values[MAX_ARGUMENTS];
+} CloneInfo;
+
+/**
+ * --profile-generate で実行回数を数える箇所 (プロファイルの 1 行になる)。
+ */
+typedef struct {
+  char kind;    // 'f': 関数が呼ばれた回数、'i': $if の各節を通った回数、'c': 呼び出した回数
+  int owner;    // 箇所のある関数番号 (最上位の文なら -1、'f' なら関数自身)
+  int ordinal;  // 持ち主の中での $if・呼び出しの通し番号
+  int callee;   // 'c': 呼び出す関数番号
+  int slot;     // L_prof_counts のカウンタの番号 ('i' は then 節と else 節の 2 つ)
+} ProfileSite;
+
+/**
+ * --profile-use で読み込んだプロファイルの 1 行。
+ */
+typedef struct {
+  char kind;
+  char owner[MAX_IDENTIFIER_LEN + 1];  // 関数名 (最上位の文なら "-")
+  int ordinal;
+  long counts[2];  // 'i' は then 節と else 節、ほかは counts[0] だけ
+} ProfileEntry;
+
+/**
+ * 子の入れ子の段が終わったときに、入れ子を始めた段が続ける処理。
+ */
+typedef enum {
+  RESUME_PAREN,     // ( ... ) の後、式の解析を続ける
+  RESUME_IF_COND,   // $if の条件の後、then 節を始める
+  RESUME_IF_THEN,   // then 節の後、else 節を始める
+  RESUME_IF_ELSE,   // else 節の後、$if を終える
+  RESUME_CALL_ARG,  // 関数呼び出しの引数の後、次の引数か呼び出しに進む
+} Resume;
+
+/**
+ * parser の入れ子 1 段分の状態 (再帰していたときの parser のローカル変数)。
+ */
+typedef struct {
+  Sign sign;
+  Op last_op;
+  int nest_level;
+  Resume resume;
+  int id;   // RESUME_IF_THEN/ELSE: $if の番号、RESUME_CALL_ARG: 呼び出す関数番号
+  int arg;  // RESUME_CALL_ARG: 解析中の引数番号 (0 始まり)
+} ParseFrame;
+
+typedef struct {
+  ParseFrame* frames;
+  int depth;
+  int capacity;
+} ParseStack;
+
+/**
+ * 字句の種類。parse_step は字句の先頭の文字から token_kinds で引いて分岐する。
+ */
+typedef enum {
+  TK_INVALID,  // 電卓式に現れない文字
+  TK_END,      // 入力 (window) の終わり
+  TK_DIGIT,
+  TK_IDENTIFIER,
+  TK_OPERATOR,
+  TK_SPACE,
+  TK_SIGN_INVERSION,
+  TK_DEF_FUNC,   // !
+  TK_CALL_FUNC,  // @
+  TK_ARG,        // #
+  TK_DOLLAR,     // $if
+  TK_EQUAL,
+  TK_SEMICOLON,
+  TK_CLOSE_BRACE,
+  TK_OPEN_PAREN,
+  TK_CLOSE_PAREN,
+  TK_COMMA,
+  TK_MEM_CLEAR,
+  TK_MEM_RECALL,
+  TK_MEM_ADD,
+  TK_MEM_SUB,
+} TokenKind;
+
+static const unsigned char token_kinds[256] = {
+    ['\0'] = TK_END,
+    ['0' ... '9'] = TK_DIGIT,
+    ['a' ... 'z'] = TK_IDENTIFIER,
+    ['_'] = TK_IDENTIFIER,
+    [PLUS] = TK_OPERATOR,
+    [MINUS] = TK_OPERATOR,
+    [MUL] = TK_OPERATOR,
+    [DIV] = TK_OPERATOR,
+    [MOD] = TK_OPERATOR,
+    [' '] = TK_SPACE,
+    ['S'] = TK_SIGN_INVERSION,
+    ['!'] = TK_DEF_FUNC,
+    ['@'] = TK_CALL_FUNC,
+    ['#'] = TK_ARG,
+    ['$'] = TK_DOLLAR,
+    ['='] = TK_EQUAL,
+    [';'] = TK_SEMICOLON,
+    ['}'] = TK_CLOSE_BRACE,
+    ['('] = TK_OPEN_PAREN,
+    [')'] = TK_CLOSE_PAREN,
+    [','] = TK_COMMA,
+    ['C'] = TK_MEM_CLEAR,
+    ['R'] = TK_MEM_RECALL,
+    ['P'] = TK_MEM_ADD,
+    ['M'] = TK_MEM_SUB,
+};
+
+// 文字の分類 (char_classes の値のビット)
+enum {
+  CC_DIGIT = 1,
+  CC_HEX_LETTER = 2,  // 数値の桁として読む a-f
+  CC_IDENTIFIER = 4,
+  CC_OPERATOR = 8,
+  CC_SIGN_INVERSION = 16,
+  CC_SPACE = 32,
+};
+
+static const unsigned char char_classes[256] = {
+    ['0' ... '9'] = CC_DIGIT,
+    ['a' ... 'f'] = CC_HEX_LETTER | CC_IDENTIFIER,
+    ['g' ... 'z'] = CC_IDENTIFIER,
+    ['_'] = CC_IDENTIFIER,
+    [PLUS] = CC_OPERATOR,
+    [MINUS] = CC_OPERATOR,
+    [MUL] = CC_OPERATOR,
+    [DIV] = CC_OPERATOR,
+    [MOD] = CC_OPERATOR,
+    ['S'] = CC_SIGN_INVERSION,
+    [' '] = CC_SPACE,
+};
+
+// parser に渡す文字列は、終端の \0 の後にもこのバイト数だけ読める領域を持つ
+// (scan_spaces などが 8 バイトずつまとめて読むため)
+#define LEX_PADDING 8
+
+/**
+ * バッチモードの SIMD カーネルを生成する命令セット。
+ */
+typedef struct {
+  const char* name;  // ラベル・関数名の接尾辞
+  const char* reg;   // ベクタレジスタ名の接頭辞
+  int lanes;         // 1 反復で処理する行数
+  int bytes;         // ベクタ 1 本のバイト数
+  bool vex;          // VEX 3 オペランド形式で出力するか
+} VecIsa;
+
+// SIMD 版で各値を置くベクタレジスタ番号
+enum {
+  VR_TERM = 0,    // 項 (%eax に相当)
+  VR_ACC = 1,     // 累積 (%edx に相当)
+  VR_MEM = 2,     // メモリ (%r11d に相当)
+  VR_ERR = 3,     // エラーになったレーン
+  VR_ACTIVE = 4,  // 現在実行中のレーン
+  VR_ARG0 = 5,    // vmul32/vdiv32 の入出力
+  VR_ARG1 = 6,
+  VR_ARG2 = 7,
+  VR_TMP0 = 8,    // 作業用
+  VR_TMP1 = 9,
+  VR_TMP2 = 10,
+  VR_TMP3 = 11,
+  VR_SUM0 = 12,  // 集計モードの和 (64 ビットずつ、下半分と上半分のレーン)
+  VR_SUM1 = 13,
+  VR_MIN = 14,   // 集計モードの最小値・最大値
+  VR_MAX = 15,
+};
+
+/**
+ * コンパイラの状態。calc_context_new で作り、calc_compile の間は
+ * スレッドごとの ctx が指す (別々の状態なら複数のスレッドで同時にコンパイルできる)。
+ */
+struct CalcContext {
+  char variable_names[MAX_VAR_FUNC][MAX_IDENTIFIER_LEN + 1];
+  int variable_count;
+
+  int is_haste;  // 1: 即時出力モード、0: 遅延出力モード
+  int is_prelude;  // 1: 前置きの関数定義を読み込み中 (関数の外で生成した IR は捨てる)
+  int is_batch;  // 1: バッチ評価モード (最上位の式を SIMD カーネルにする)
+  int is_aggregate;  // 1: バッチ評価の結果を行ごとに出さず、集計だけを出す
+  int is_filter;  // 1: 結果が 0 でない入力行だけを出す、2: その行番号だけを出す
+  int is_freestanding;  // 1: libc を使わず _start とシステムコールで完結させる
+  int is_keep_frames;  // 1: プロファイラ向けに、呼び出しのない関数と補助ルーチンにもフレームを作る
+  char* profile_generate;  // NULL でなければ、実行回数を数えて終了時にこのファイルへ書き出す
+  int is_profile_use;  // 1: 読み込んだプロファイルで $if の節の並びと特殊化を決める
+
+  FunctionInfo functions[MAX_FUNC];
+  int function_count;
+  FunctionInfo* current_function;
+
+  // 最上位の式から生成した IR (バッチモードでは式全体、そうでなければ変換前の文 1 つ)
+  IrBuffer main_ir;
+  // 最上位の式を即時変換するときのスタックの状態
+  StackState main_stack;
+  // 最上位の式の共通部分式の値を退避する領域の数 (文ごとに 0 から使い直す)
+  int main_value_slots;
+  // 変換し終えた最上位の文の後の項・累積・メモリ・変数 (fold_constants が次の文に引き継ぐ)
+  FoldValue main_term;
+  FoldValue main_acc;
+  FoldValue main_memory;
+  FoldVar main_vars[MAX_VAR_FUNC];
+  // 関数の定義が出揃ったか (最後の文と関数本体では呼び出しをコンパイル時に評価できる)
+  bool functions_final;
+  // コンパイル時の評価に使える残りの IR 命令の数
+  long eval_steps;
+  // 作った関数の複製と、その命令数の合計
+  CloneInfo* clones;
+  size_t clone_count;
+  size_t clone_capacity;
+  size_t clone_insts;
 
-int is_haste = 1;  // 1: 即時出力モード、0: 遅延出力モード
+  int if_counter;
 
-FunctionInfo functions[MAX_VAR_FUNC];
-int function_count = 0;
-FunctionInfo* current_function = NULL;
+  // --profile-use で読み込んだ回数 (種類・持ち主・番号の順に並べ、同じ箇所は足してある)
+  ProfileEntry* profile;
+  size_t profile_count;
+  bool profile_error;  // プロファイルを読めなかった
+  // --profile-generate で数える箇所と、使ったカウンタの数
+  ProfileSite* profile_sites;
+  size_t profile_site_count;
+  size_t profile_site_capacity;
+  int profile_slots;
+  // 最上位の文の $if と呼び出しに振った番号 (文をまたいで続ける)
+  int profile_main_ifs;
+  int profile_main_calls;
+
+  // タスク並列化した呼び出し箇所の数 (0 なら fork-join の実行時ライブラリを出力しない)
+  int fork_join_sites;
+
+  // 前置きを読み込んだ直後の関数表 (calc_compile のたびにここへ戻す)
+  FunctionInfo* prelude;
+  int prelude_count;
+  // 前置きの $if が使ったラベル番号の数 (calc_compile はその次から振る)
+  int prelude_if_count;
+
+  // アセンブリの出力先
+  CalcSink sink;
+  void* sink_user;
+
+  // calc_compile_file で読んでいる入力 (NULL なら電卓式全体が文字列で渡されている)
+  FILE* input;
+  // 読み込み済みの、最上位の ; で終わる文の並び (parser はここを読む)
+  char* window;
+  size_t window_size;
+  size_t window_capacity;
+  // 読み込み済みの部分の括弧の深さ
+  int input_depth;
+};
+
+// このスレッドでコンパイル中の状態
+static _Thread_local CalcContext* ctx;
+
+/**
+ * 出力を溜めておく伸長可能なバッファ。
+ */
+typedef struct {
+  char* data;
+  size_t size;
+  size_t capacity;
+} TextBuffer;
 
-int if_counter = 0;
+// NULL でなければ出力を sink に渡さずここに溜める (finalize_functions のワーカー用)
+static _Thread_local TextBuffer* capture;
 
 void error_exit(char** p);
 
+void emit(IrOp op, int a, int b);
+void lower_scalar(const IrInst* inst, StackState* st);
+static void fold_constants(IrBuffer* ir, bool in_function, bool cold);
+static void fold_materialize(IrBuffer* out, FoldValue* v, IrOp op);
+static int share_values(IrBuffer* ir, bool in_function);
+static bool profile_load(CalcContext* c, const char* path);
+static int record_profile_sites(const IrBuffer* ir, int owner, int* ifs, int* calls);
+static void layout_ifs(IrBuffer* ir, const char* owner, int* ifs);
+static void assign_arg_registers(IrBuffer* ir, bool callees_known);
+static CallPlan* plan_calls(const IrBuffer* ir);
 void initialize();
 void input_number(char** p);
 int input_variable(char** p);
 void start_def_func(char** p);
-void start_call_func(char** p, int nest_level);
+void start_call_func(char** p, ParseStack* stack);
 void apply_last_op(Op last_op, Sign sign);
 void set_variable(char** p);
 void finalize();
+void finalize_batch();
+void parallelize_calls();
+void finalize_fork_join();
 bool is_digit(char c);
 bool is_operator(char c);
 bool is_sign_inversion(char c);
@@ -90,63 +618,193 @@ bool is_memory_recall(char c);
 bool is_memory_add(char c);
 bool is_memory_sub(char c);
 bool is_identifier_char(char c);
+size_t scan_spaces(const char* s);
+size_t scan_number_digits(const char* s);
 char peek(char** p);
 void ignore_consecutive_operators(char** p);
 void ignore_all_sign_inversions(char** p);
 void reset_formula(Op* last_op, Sign* sign);
-int nesting(char** p, int nest_level, int is_misaligned);
-void finish_nesting(int is_misaligned);
+void nesting(ParseStack* stack, int nest_level);
+void finish_nesting();
+static void push_frame(ParseStack* stack, int nest_level);
+static bool parse_step(char** p, ParseStack* stack, ParseFrame* frame);
+static bool resume_frame(char** p, ParseStack* stack, ParseFrame* frame);
+static bool next_call_arg(char** p, ParseStack* stack, ParseFrame* frame);
 void def_builtin_func();
 void def_default_func();
+void clear_func_code(FunctionInfo* f);
+int compile(char* input);
+bool read_statements();
+bool refill_input(char** p);
+int run_server(const char* socket_path, CalcContext* c, char* const* options, int option_count);
+
+/**
+ * @brief バッファの末尾に少なくとも size バイトの空きを確保する。
+ */
+static void text_reserve(TextBuffer* buf, size_t size) {
+  if (buf->capacity - buf->size >= size) {
+    return;
+  }
+  size_t capacity = buf->capacity ? buf->capacity : 4096;
+  while (capacity - buf->size < size) {
+    capacity *= 2;
+  }
+  char* data = realloc(buf->data, capacity);
+  if (!data) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  buf->data = data;
+  buf->capacity = capacity;
+}
 
 /**
- * @brief フォーマット付き出力をグローバル変数 is_haste に応じて遅延させる関数。
+ * @brief フォーマット付きでアセンブリを出力する。
  * @param fmt フォーマット文字列。
- * @return 本来書きたかった文字数。
+ * @return 書き出した文字数。
  *
- * 可変長引数は通常の printf と同じ取り扱いで受け取り、必要に応じて
- * FunctionInfo に書き出す。
+ * 可変長引数は通常の printf と同じ取り扱いで受け取る。遅延出力は IR
+ * の段階で行うため、ここでは常にコンテキストの出力先 (sink) に書き出す
+ * (capture が設定されていればそこに溜める)。出力はほとんどが 1 命令分なので、
+ * まずスタック上のバッファに整形する。
  */
 int mprintf(const char* fmt, ...) {
   va_list ap;
-  va_start(ap, fmt);
-
-  if (is_haste) {
-    // ふつうに mprintf
-    int ret = vprintf(fmt, ap);
-    va_end(ap);
-    return ret;
-  } else {
-    if (!current_function) {
+  if (capture) {
+    // 溜める場合はバッファの末尾に直接整形する
+    for (;;) {
+      size_t room = capture->capacity - capture->size;
+      va_start(ap, fmt);
+      int ret = vsnprintf(capture->data + capture->size, room, fmt, ap);
       va_end(ap);
-      return 0;
+      if (ret < 0) {
+        return ret;
+      }
+      if ((size_t)ret < room) {
+        capture->size += ret;
+        return ret;
+      }
+      text_reserve(capture, ret + 1);
     }
-    FunctionInfo* t = current_function;
-    size_t capacity = sizeof(t->code);
-    if (t->code_length >= capacity) {
-      // もうこれ以上は入らない
-      va_end(ap);
-      return 0;
+  }
+  char small[512];
+  va_start(ap, fmt);
+  int ret = vsnprintf(small, sizeof(small), fmt, ap);
+  va_end(ap);
+  if (ret < 0) {
+    return ret;
+  }
+  if ((size_t)ret < sizeof(small)) {
+    ctx->sink(ctx->sink_user, small, ret);
+    return ret;
+  }
+  char* large = malloc(ret + 1);
+  va_start(ap, fmt);
+  vsnprintf(large, ret + 1, fmt, ap);
+  va_end(ap);
+  ctx->sink(ctx->sink_user, large, ret);
+  free(large);
+  return ret;
+}
+
+/**
+ * @brief IR 命令をバッファの末尾に追加する。
+ * @param buf 追加先のバッファ。
+ * @param op 命令種別。
+ * @param a 第 1 オペランド。
+ * @param b 第 2 オペランド。
+ */
+void ir_append(IrBuffer* buf, IrOp op, int a, int b) {
+  if (buf->count == buf->capacity) {
+    size_t capacity = buf->capacity ? buf->capacity * 2 : 64;
+    IrInst* insts = realloc(buf->insts, capacity * sizeof(IrInst));
+    if (!insts) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
     }
+    buf->insts = insts;
+    buf->capacity = capacity;
+  }
+  buf->insts[buf->count++] = (IrInst){op, a, b};
+}
 
-    size_t remaining = capacity - t->code_length;
-    char* dest = t->code + t->code_length;
+/**
+ * @brief IR 命令をバッファの途中に挿入する。
+ * @param buf 挿入先のバッファ。
+ * @param pos 挿入する位置。以降の命令は 1 つ後ろにずれる。
+ */
+void ir_insert(IrBuffer* buf, size_t pos, IrOp op, int a, int b) {
+  ir_append(buf, op, a, b);
+  memmove(&buf->insts[pos + 1], &buf->insts[pos], (buf->count - 1 - pos) * sizeof(IrInst));
+  buf->insts[pos] = (IrInst){op, a, b};
+}
 
-    int written = vsnprintf(dest, remaining, fmt, ap);
-    va_end(ap);
+/**
+ * @brief IR 命令をバッファから取り除く。
+ * @param buf 対象のバッファ。
+ * @param pos 取り除く位置。
+ */
+void ir_remove(IrBuffer* buf, size_t pos) {
+  memmove(&buf->insts[pos], &buf->insts[pos + 1], (buf->count - 1 - pos) * sizeof(IrInst));
+  buf->count--;
+}
 
-    if (written < 0) {
-      // フォーマットエラー
-      return written;
-    }
+/**
+ * @brief 溜めておいた最上位の文 1 つ分の IR をスカラー版のアセンブリに変換する。
+ * @param last 最後の文か (結果を出力するので累積をレジスタに読んでおく)。
+ *
+ * 共通部分式は文の中でだけまとめるので、; ごとと finalize の最初に呼ぶ。
+ * プロファイルの $if・呼び出しの番号は、変換する直前の IR で文をまたいで振る。
+ */
+static void flush_statement(bool last) {
+  fold_constants(&ctx->main_ir, false, false);
+  if (last) {
+    fold_materialize(&ctx->main_ir, &ctx->main_acc, IR_ACC_CONST);
+  }
+  int slots = share_values(&ctx->main_ir, false);
+  if (slots > ctx->main_value_slots) {
+    ctx->main_value_slots = slots;
+  }
+  if (ctx->profile_generate) {
+    ctx->main_stack.profile_next = record_profile_sites(&ctx->main_ir, -1, &ctx->profile_main_ifs,
+                                                        &ctx->profile_main_calls);
+  } else if (ctx->is_profile_use) {
+    layout_ifs(&ctx->main_ir, "-", &ctx->profile_main_ifs);
+  }
+  // 関数の定義はまだ変わりうるので、呼び出しは引数レジスタをすべて上書きするとみなす
+  assign_arg_registers(&ctx->main_ir, false);
+  CallPlan* plans = plan_calls(&ctx->main_ir);
+  ctx->main_stack.plans = plans;
+  ctx->main_stack.plan_next = 0;
+  for (size_t i = 0; i < ctx->main_ir.count; i++) {
+    lower_scalar(&ctx->main_ir.insts[i], &ctx->main_stack);
+  }
+  ctx->main_stack.plans = NULL;
+  free(plans);
+  ctx->main_ir.count = 0;
+}
 
-    if ((size_t)written >= remaining) {
-      // バッファが足りない
-      t->code_length = capacity - 1;
-    } else {
-      t->code_length += (size_t)written;
+/**
+ * @brief IR 命令を 1 つ生成する。
+ * @param op 命令種別。
+ * @param a 第 1 オペランド。
+ * @param b 第 2 オペランド。
+ *
+ * 即時出力モードでは最上位の文を main_ir に溜め、; で文が終わるたびに
+ * スカラー版のアセンブリに変換する。遅延出力モード (と前置きの読み込み中) では
+ * current_function に蓄積する。バッチモードの最上位の式は SIMD カーネルに
+ * まとめて変換するため、最後まで main_ir に蓄積する。
+ */
+void emit(IrOp op, int a, int b) {
+  if (!ctx->is_haste || ctx->is_prelude) {
+    if (ctx->current_function) {
+      ir_append(&ctx->current_function->ir, op, a, b);
     }
-    return written;
+    return;
+  }
+  ir_append(&ctx->main_ir, op, a, b);
+  if (op == IR_ACC_CLEAR && !ctx->is_batch) {
+    flush_statement(false);
   }
 }
 
@@ -157,7 +815,14 @@ int mprintf(const char* fmt, ...) {
  */
 static void emit_lines(const char* const* lines, size_t count) {
   for (size_t i = 0; i < count; ++i) {
-    fputs(lines[i], stdout);
+    size_t size = strlen(lines[i]);
+    if (capture) {
+      text_reserve(capture, size);
+      memcpy(capture->data + capture->size, lines[i], size);
+      capture->size += size;
+    } else {
+      ctx->sink(ctx->sink_user, lines[i], size);
+    }
   }
 }
 
@@ -166,205 +831,294 @@ static void emit_lines(const char* const* lines, size_t count) {
  * 電卓式を解析し、演算・メモリ操作に対応するアセンブリを生成する。
  * @param p 入力文字列ポインタへのポインタ。
  * @param nest_level 現在の入れ子レベル。
- * @param is_misaligned 現在のスタックが 16 バイト境界からずれていたかどうか。
  * @return 成功時0、入力が不正な場合は1などのエラーコード。
+ *
+ * 括弧・$if の節・関数呼び出しの引数の入れ子は C の再帰ではなく ParseStack
+ * に積んで解析するので、入れ子の深さはヒープの大きさだけで制限される。
+ * 入れ子を始めた段は子の段が終わると resume_frame で続きを処理する。
+ */
+int parser(char** p, int nest_level) {
+  ParseStack stack = {NULL, 0, 0};
+  push_frame(&stack, nest_level);
+  bool returning = false;
+  while (stack.depth > 0) {
+    ParseFrame* frame = &stack.frames[stack.depth - 1];
+    bool running = returning ? resume_frame(p, &stack, frame) : parse_step(p, &stack, frame);
+    returning = !running;
+    if (returning) {
+      stack.depth--;
+    }
+  }
+  free(stack.frames);
+  return 0;
+}
+
+/**
+ * @brief 入れ子の段を 1 つ積む。
+ * @param stack 解析中の段のスタック。
+ * @param nest_level 積む段の入れ子の深さ。
+ *
+ * 積むとスタックが伸びて段へのポインタが変わることがあるので、呼び出し元は
+ * 積んだ後に元の段を触らない。
  */
-int parser(char** p, int nest_level, int is_misaligned) {
-  Sign sign = S_PLUS;
-  Op last_op = PLUS;
-  while (**p) {
-    if (is_digit(**p)) {
+static void push_frame(ParseStack* stack, int nest_level) {
+  if (stack->depth == stack->capacity) {
+    int capacity = stack->capacity ? stack->capacity * 2 : 64;
+    ParseFrame* frames = realloc(stack->frames, capacity * sizeof(ParseFrame));
+    if (!frames) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    stack->frames = frames;
+    stack->capacity = capacity;
+  }
+  stack->frames[stack->depth++] = (ParseFrame){S_PLUS, PLUS, nest_level, RESUME_PAREN, 0, 0};
+}
+
+/**
+ * @brief 段の中で 1 字句分を解析する。
+ * @param p 入力文字列ポインタへのポインタ。
+ * @param stack 解析中の段のスタック。
+ * @param frame 解析する段 (スタックの一番上)。
+ * @return 段の解析を続けるなら true、段が終わったなら false。
+ */
+static bool parse_step(char** p, ParseStack* stack, ParseFrame* frame) {
+  TokenKind kind = token_kinds[(unsigned char)**p];
+  if (kind == TK_END) {
+    if (!(frame->nest_level == 0 && refill_input(p))) {
+      apply_last_op(frame->last_op, frame->sign);
+      return false;
+    }
+    kind = token_kinds[(unsigned char)**p];
+  }
+  switch (kind) {
+    case TK_DIGIT:
       // 数字を構成する
       input_number(p);
-    } else if (**p == '!') {
+      break;
+    case TK_DEF_FUNC:
       (*p)++;
       start_def_func(p);
       if (!peek(p)) {
-        return 0;
+        return false;
       }
-    } else if (**p == '@') {
+      break;
+    case TK_CALL_FUNC:
       (*p)++;
-      start_call_func(p, nest_level);
-    } else if (**p == '-' && peek(p) == '>') {
-      (*p) += 2;
-      apply_last_op(last_op, sign);
-      set_variable(p);
-    } else if (is_operator(**p)) {
+      start_call_func(p, stack);
+      break;
+    case TK_OPERATOR:
+      if (**p == '-' && peek(p) == '>') {
+        (*p) += 2;
+        apply_last_op(frame->last_op, frame->sign);
+        set_variable(p);
+        break;
+      }
       // 演算子を適用する
       // 最後の演算子以外を読み飛ばす
-      while (peek(p) && (is_operator(peek(p)) || is_sign_inversion(peek(p)) || peek(p) == ' ')) {
+      while (char_classes[(unsigned char)peek(p)] & (CC_OPERATOR | CC_SIGN_INVERSION | CC_SPACE)) {
         (*p)++;
       }
       // 現在の項を適用する
-      apply_last_op(last_op, sign);
-      reset_formula(&last_op, &sign);
+      apply_last_op(frame->last_op, frame->sign);
+      reset_formula(&frame->last_op, &frame->sign);
       // 次の演算子を設定する（enum に文字リテラルを割り当てたので直接代入）
-      last_op = (Op) * *p;
+      frame->last_op = (Op) * *p;
       (*p)++;
-    } else if (**p == ' ') {
+      break;
+    case TK_SPACE:
       // 空白を読み飛ばす（仕様上はありえない）
-      (*p)++;
-    } else if (is_sign_inversion(**p)) {
+      *p += scan_spaces(*p);
+      break;
+    case TK_SIGN_INVERSION:
       // 符号反転トークンを適用する
-      sign = (sign == S_PLUS) ? S_MINUS : S_PLUS;
+      frame->sign = (frame->sign == S_PLUS) ? S_MINUS : S_PLUS;
       (*p)++;
-    } else if (**p == '=') {
+      break;
+    case TK_EQUAL:
       // 現在の項を適用する
-      apply_last_op(last_op, sign);
+      apply_last_op(frame->last_op, frame->sign);
       // 変数定義の場合
       // 計算結果を出力して終了する
-      return 0;
-    } else if (**p == ';') {
+      return false;
+    case TK_SEMICOLON:
       // 式の区切り
       // 現在の項を適用する
-      apply_last_op(last_op, sign);
+      apply_last_op(frame->last_op, frame->sign);
       // 計算結果をリセット
-      mprintf("xorl %%edx, %%edx\n");
-      reset_formula(&last_op, &sign);
+      emit(IR_ACC_CLEAR, 0, 0);
+      reset_formula(&frame->last_op, &frame->sign);
       (*p)++;
-    } else if (**p == '}') {
-      if (nest_level > 0) {
+      break;
+    case TK_CLOSE_BRACE:
+      if (frame->nest_level > 0) {
         // 入れ子終了 (for _if blocks)
         (*p)++;
-        apply_last_op(last_op, sign);
-        finish_nesting(is_misaligned);
-        return 0;
+        apply_last_op(frame->last_op, frame->sign);
+        finish_nesting();
+        return false;
       }
       // 関数定義終了
       // 現在の項を適用する
-      apply_last_op(last_op, sign);
-      reset_formula(&last_op, &sign);
+      apply_last_op(frame->last_op, frame->sign);
+      reset_formula(&frame->last_op, &frame->sign);
       // 関数定義リセット
-      is_haste = 1;
-      current_function = NULL;
+      ctx->is_haste = 1;
+      ctx->current_function = NULL;
       (*p)++;
-    } else if (**p == '$' && strncmp(*p, "$if", 3) == 0) {
+      break;
+    case TK_DOLLAR:
+      if (strncmp(*p, "$if", 3) != 0) {
+        error_exit(p);
+        return false;
+      }
       (*p) += 3;
-      while (**p == ' ') (*p)++;
+      *p += scan_spaces(*p);
       if (**p != '(') {
         error_exit(p);
-        return 0;
+        return false;
       }
       (*p)++;  // consume (
 
-      // Condition
-      if (nesting(p, nest_level, 0) != 0) return 0;
-
-      int id = if_counter++;
-
-      mprintf("cmpl $0, %%eax\n");
-      mprintf("je .L_else_%d\n", id);
-
-      while (**p == ' ') (*p)++;
-      if (**p != '{') {
-        error_exit(p);
-        return 0;
-      }
-      (*p)++;  // consume {
-
-      // Then block
-      if (nesting(p, nest_level, 0) != 0) return 0;
-
-      mprintf("jmp .L_end_%d\n", id);
-      mprintf(".L_else_%d:\n", id);
-
-      while (**p == ' ') (*p)++;
-      if (**p != '{') {
-        error_exit(p);
-        return 0;
-      }
-      (*p)++;  // consume {
-
-      // Else block
-      if (nesting(p, nest_level, 0) != 0) return 0;
-
-      mprintf(".L_end_%d:\n", id);
-    } else if (is_memory_clear(**p)) {
+      // Condition (続きは resume_frame の RESUME_IF_COND)
+      frame->resume = RESUME_IF_COND;
+      nesting(stack, frame->nest_level);
+      break;
+    case TK_MEM_CLEAR:
       // メモリをクリアする
-      mprintf("xorl %%edx, %%edx\n");
-      mprintf("movl %%edx,  %%r11d\n");
-      /* also keep memory register initialized in prologue; r11 used as memory
-       */
-      reset_formula(&last_op, &sign);
+      emit(IR_MEM_CLEAR, 0, 0);
+      reset_formula(&frame->last_op, &frame->sign);
       (*p)++;
-    } else if (is_memory_recall(**p)) {
+      break;
+    case TK_MEM_RECALL:
       // メモリを呼び出す
-      mprintf("movl %%r11d, %%edx\n");
+      emit(IR_MEM_RECALL, 0, 0);
       if (!peek(p)) {
-        return 0;
+        return false;
       }
-      reset_formula(&last_op, &sign);
+      reset_formula(&frame->last_op, &frame->sign);
       (*p)++;
-    } else if (is_memory_add(**p)) {
+      break;
+    case TK_MEM_ADD:
       // 現在の項を計算する
-      apply_last_op(last_op, sign);
-      // メモリから取り出す
-      mprintf("movl %%r11d, %%eax\n");
-      // 加算してメモリに戻す
-      mprintf("addl %%edx, %%eax\n");
-      mprintf("jo L_overflow\n");
-      mprintf("movl %%eax, %%r11d\n");
-      // 計算結果はクリアする
-      mprintf("xorl %%edx, %%edx\n");
-      reset_formula(&last_op, &sign);
+      apply_last_op(frame->last_op, frame->sign);
+      // メモリに加算し、計算結果はクリアする
+      emit(IR_MEM_ADD, 0, 0);
+      reset_formula(&frame->last_op, &frame->sign);
       (*p)++;
-    } else if (is_memory_sub(**p)) {
+      break;
+    case TK_MEM_SUB:
       // 現在の項を計算する
-      apply_last_op(last_op, sign);
-      // メモリから取り出す
-      mprintf("movl %%r11d, %%eax\n");
-      // 減算してメモリに戻す
-      mprintf("subl %%edx, %%eax\n");
-      mprintf("jo L_overflow\n");
-      mprintf("movl %%eax, %%r11d\n");
-      // 計算結果はクリアする
-      mprintf("xorl %%edx, %%edx\n");
-      reset_formula(&last_op, &sign);
+      apply_last_op(frame->last_op, frame->sign);
+      // メモリから減算し、計算結果はクリアする
+      emit(IR_MEM_SUB, 0, 0);
+      reset_formula(&frame->last_op, &frame->sign);
       (*p)++;
-    } else if (**p == '(') {
+      break;
+    case TK_OPEN_PAREN:
       // 入れ子開始
       (*p)++;
-      int result = nesting(p, nest_level, 0);
-      if (result != 0) {
-        return result;
-      }
-    } else if (**p == ',') {
+      frame->resume = RESUME_PAREN;
+      nesting(stack, frame->nest_level);
+      break;
+    case TK_COMMA:
       // 引数区切り
-      apply_last_op(last_op, sign);
-      finish_nesting(is_misaligned);
-      return 0;
-    } else if (**p == ')') {
+      apply_last_op(frame->last_op, frame->sign);
+      finish_nesting();
+      return false;
+    case TK_CLOSE_PAREN:
       // 入れ子終了
       (*p)++;
       // 現在の項を適用する
-      apply_last_op(last_op, sign);
-      finish_nesting(is_misaligned);
-      return 0;
-    } else if (is_identifier_char(**p)) {
+      apply_last_op(frame->last_op, frame->sign);
+      finish_nesting();
+      return false;
+    case TK_IDENTIFIER:
       // 変数名を構成する（未実装）
-      int result = input_variable(p);
-      if (result != 0) {
+      if (input_variable(p) != 0) {
+        error_exit(p);
+        return false;
+      }
+      break;
+    case TK_ARG: {
+      if (ctx->current_function == NULL && !ctx->is_batch) {
         error_exit(p);
-        return 0;
+        return false;
       }
-    } else if (**p == '#' && current_function != NULL) {
-      // 関数内引数参照
+      // 関数内引数参照（バッチモードの最上位では入力列の参照）
       (*p)++;
       int arg_index = 0;
       while (is_digit(**p)) {
         arg_index = arg_index * 10 + (**p - '0');
         (*p)++;
       }
-      arg_index = current_function->arg_count - arg_index;
-      int offset = 16 + arg_index * 8;
-      mprintf("movl %d(%%rbp), %%eax\n", offset);
-    } else {
+      if (ctx->current_function != NULL) {
+        emit(IR_LOAD_ARG, arg_index, ctx->current_function->arg_count);
+      } else if (arg_index > 0) {
+        emit(IR_LOAD_COLUMN, arg_index, 0);
+      } else {
+        error_exit(p);
+        return false;
+      }
+      break;
+    }
+    default:
       error_exit(p);
-      return 0;
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @brief 子の段が終わった後、入れ子を始めた段の続きを処理する。
+ * @param p 入力文字列ポインタへのポインタ。
+ * @param stack 解析中の段のスタック。
+ * @param frame 続きを処理する段 (スタックの一番上)。
+ * @return 段の解析を続けるなら true、段が終わったなら false。
+ */
+static bool resume_frame(char** p, ParseStack* stack, ParseFrame* frame) {
+  switch (frame->resume) {
+    case RESUME_PAREN:
+      return true;
+    case RESUME_IF_COND:
+    case RESUME_IF_THEN: {
+      int id;
+      if (frame->resume == RESUME_IF_COND) {
+        id = ctx->if_counter++;
+        emit(IR_IF_TEST, id, 0);
+      } else {
+        id = frame->id;
+        emit(IR_IF_ELSE, id, 0);
+      }
+      *p += scan_spaces(*p);
+      if (**p != '{') {
+        error_exit(p);
+        return false;
+      }
+      (*p)++;  // consume {
+
+      // Then block / Else block
+      frame->resume = frame->resume == RESUME_IF_COND ? RESUME_IF_THEN : RESUME_IF_ELSE;
+      frame->id = id;
+      nesting(stack, frame->nest_level);
+      return true;
     }
+    case RESUME_IF_ELSE:
+      emit(IR_IF_END, frame->id, 0);
+      return true;
+    case RESUME_CALL_ARG:
+      return next_call_arg(p, stack, frame);
   }
-  apply_last_op(last_op, sign);
-  return 0;
+  return true;
+}
+
+#ifndef CALC_NO_MAIN
+/**
+ * @brief 生成したアセンブリを標準出力に書く CalcSink。
+ */
+static void stdout_sink(void* user, const char* data, size_t size) {
+  (void)user;
+  fwrite(data, 1, size, stdout);
 }
 
 /**
@@ -373,54 +1127,534 @@ int parser(char** p, int nest_level, int is_misaligned) {
  * @param argc 引数の数。
  * @param argv 引数ベクタ。argv[1] に電卓式を受け取る。
  * @return 成功時0、入力が不正な場合は1などのエラーコード。
+ *
+ * --server では電卓式の代わりに 1 行ずつリクエストを受け取り続ける (run_server)。
+ * --input では電卓式を標準入力 (--input=PATH ならそのファイル) から読む。
+ * -DCALC_NO_MAIN でコンパイルすると main を除き、calc.h の API だけのライブラリになる。
  */
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <calc_literal>\n", argv[0]);
+  CalcContext* c = calc_context_new();
+  if (!c) {
+    perror(argv[0]);
     return 1;
   }
-  char* input = argv[1];
-  char** p = &input;
-  initialize();
-  def_default_func();
-  int ret = parser(p, 0, 0);
-  finalize();
+  char* input = NULL;
+  const char* server = NULL;
+  const char* input_path = NULL;
+  char** options = malloc(argc * sizeof(char*));
+  int option_count = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--server") == 0) {
+      server = "";
+    } else if (strncmp(argv[i], "--server=", 9) == 0) {
+      server = argv[i] + 9;
+    } else if (strcmp(argv[i], "--input") == 0) {
+      input_path = "";
+    } else if (strncmp(argv[i], "--input=", 8) == 0) {
+      input_path = argv[i] + 8;
+    } else if (calc_set_option(c, argv[i])) {
+      options[option_count++] = argv[i];
+    } else if (!input) {
+      input = argv[i];
+    } else {
+      input = NULL;
+      break;
+    }
+  }
+  const char* mode_error = calc_check_options(c);
+  int ret = 1;
+  if ((!input + !server + !input_path) != 2 || mode_error) {
+    fprintf(stderr,
+            "Usage: %s [--batch [--aggregate | --filter | --filter-index] | --freestanding] "
+            "[--keep-frames] [--profile-generate[=<path>] | --profile-use=<path>] "
+            "<calc_literal>\n"
+            "       %s [modes] --input[=<path>]\n"
+            "       %s [modes] --server[=<socket_path>]\n",
+            argv[0], argv[0], argv[0]);
+    if (mode_error) {
+      fprintf(stderr, "%s\n", mode_error);
+    }
+  } else if (server) {
+    ret = run_server(server, c, options, option_count);
+  } else if (input_path) {
+    FILE* in = *input_path ? fopen(input_path, "r") : stdin;
+    if (!in) {
+      perror(input_path);
+    } else {
+      ret = calc_compile_file(c, in, stdout_sink, NULL);
+      if (in != stdin) {
+        fclose(in);
+      }
+    }
+  } else {
+    ret = calc_compile(c, input, stdout_sink, NULL);
+  }
+  free(options);
+  calc_context_free(c);
   return ret;
 }
 
 /**
- * @brief デフォルト関数定義を追加する。
+ * @brief 標準入力 (または Unix ドメインソケット) から受けたリクエストを順にコンパイルする。
+ * @param socket_path 空文字列なら標準入出力を使う。そうでなければこのパスで待ち受け、
+ * 接続を 1 つずつ処理する。
+ * @param c 前置きを読み込み済みのコンテキスト。
+ * @param options サーバー起動時に指定されたモードのオプション。
+ * @param option_count options の要素数。
+ * @return 成功時0、ソケットを用意できなければ1。
  *
- * ビルドインではなくソース側で記述された関数テンプレートを、parser
- * を使って事前に読み込んでおく。
+ * リクエストは 1 行で、先頭に --batch などのモードを空白区切りで並べてから
+ * 電卓式を書く (省略したモードはサーバー起動時のものになる)。応答は
+ * アセンブリの後に `.end` だけの行を付けたもので、アセンブラもここで読むのを
+ * やめる。モードの組み合わせが使えなければ `# error:` で始まる行を返す。
+ * ソケットのクライアントが応答を読まずに切断したら、その接続を閉じて次を待つ。
+ *
+ * ビルトイン関数と前置きの関数はコンテキストを作るときに 1 度だけ解析され、
+ * calc_compile がリクエストごとにその直後の状態へ戻す。
  */
-void def_default_func() {
-  is_haste = 0;
-  static const char* codes[] = {
-    "!sgn[1]{@step(#1)-@step(#1S)};",
-    "!abs[1]{@sgn(#1)*#1};",
-    "!gt[2]{@step(#1-#2)};",
-    "!ge[2]{1-@step(#2-#1)};",
-    "!eq[2]{1-@step(@abs(#1-#2))};",
+int run_server(const char* socket_path, CalcContext* c, char* const* options, int option_count) {
+  int listen_fd = -1;
+  int stdout_fd = -1;
+  if (*socket_path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "socket path too long: %s\n", socket_path);
+      return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 16) != 0) {
+      perror(socket_path);
+      return 1;
+    }
+    stdout_fd = dup(STDOUT_FILENO);
+    // 応答を読まずに切断したクライアントへの書き込みで、サーバーごと終わらないようにする
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  char* line = NULL;
+  size_t line_capacity = 0;
+  for (;;) {
+    FILE* in = stdin;
+    if (listen_fd >= 0) {
+      // 接続ごとに応答をソケットへ向け、切断されたら次の接続を待つ
+      int conn = accept(listen_fd, NULL, NULL);
+      if (conn < 0) {
+        continue;
+      }
+      in = fdopen(conn, "r");
+      if (!in) {
+        close(conn);
+        continue;
+      }
+      fflush(stdout);
+      dup2(conn, STDOUT_FILENO);
+    }
+    while (getline(&line, &line_capacity, in) >= 0) {
+      line[strcspn(line, "\r\n")] = '\0';
+      calc_clear_options(c);
+      for (int i = 0; i < option_count; i++) {
+        calc_set_option(c, options[i]);
+      }
+
+      char* input = line;
+      bool bad_option = false;
+      while (*input == ' ') {
+        input++;
+      }
+      while (strncmp(input, "--", 2) == 0) {
+        char* end = strchr(input, ' ');
+        if (end) {
+          *end = '\0';
+        }
+        if (!calc_set_option(c, input)) {
+          bad_option = true;
+        }
+        input = end ? end + 1 : input + strlen(input);
+        while (*input == ' ') {
+          input++;
+        }
+      }
+      if (!*input && !bad_option) {
+        continue;
+      }
+      const char* mode_error = bad_option ? "unknown option" : calc_check_options(c);
+      if (mode_error) {
+        printf("# error: %s\n", mode_error);
+      } else {
+        calc_compile(c, input, stdout_sink, NULL);
+      }
+      printf(".end\n");
+      if (fflush(stdout) != 0 || ferror(stdout)) {
+        break;  // 書けなければ切断されている
+      }
+    }
+    if (listen_fd < 0) {
+      break;
+    }
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+      // 書けずに残った応答は /dev/null に捨て、元の標準出力には混ぜない
+      int null_fd = open("/dev/null", O_WRONLY);
+      if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        fflush(stdout);
+        close(null_fd);
+      }
+      clearerr(stdout);
+    }
+    dup2(stdout_fd, STDOUT_FILENO);
+    fclose(in);
+  }
+  free(line);
+  return 0;
+}
+#endif
+
+/**
+ * @brief IR バッファを複製する。
+ * @param dst 複製先 (空であること)。
+ * @param src 複製元。
+ */
+static void ir_copy(IrBuffer* dst, const IrBuffer* src) {
+  for (size_t i = 0; i < src->count; i++) {
+    ir_append(dst, src->insts[i].op, src->insts[i].a, src->insts[i].b);
+  }
+}
+
+CalcContext* calc_context_new(void) {
+  CalcContext* c = calloc(1, sizeof(CalcContext));
+  if (!c) {
+    return NULL;
+  }
+  CalcContext* saved = ctx;
+  ctx = c;
+  ctx->is_haste = 1;
+  def_builtin_func();
+  def_default_func();
+  // 前置きと同名の関数を定義し直すこともあるので、前置きの IR は写しを取っておく
+  ctx->prelude_count = ctx->function_count;
+  ctx->prelude_if_count = ctx->if_counter;
+  ctx->prelude = malloc(ctx->prelude_count * sizeof(FunctionInfo));
+  if (!ctx->prelude) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (int i = 0; i < ctx->prelude_count; i++) {
+    ctx->prelude[i] = ctx->functions[i];
+    ctx->prelude[i].ir = (IrBuffer){NULL, 0, 0};
+    ir_copy(&ctx->prelude[i].ir, &ctx->functions[i].ir);
+  }
+  ctx = saved;
+  return c;
+}
+
+void calc_context_free(CalcContext* c) {
+  if (!c) {
+    return;
+  }
+  for (int i = 0; i < MAX_FUNC; i++) {
+    free(c->functions[i].ir.insts);
+  }
+  for (int i = 0; i < c->prelude_count; i++) {
+    free(c->prelude[i].ir.insts);
+  }
+  free(c->prelude);
+  free(c->window);
+  free(c->main_ir.insts);
+  free(c->main_stack.calls);
+  free(c->main_stack.profile_ifs);
+  free(c->clones);
+  free(c->profile_generate);
+  free(c->profile);
+  free(c->profile_sites);
+  free(c);
+}
+
+int calc_set_option(CalcContext* c, const char* option) {
+  if (strcmp(option, "--batch") == 0) {
+    c->is_batch = 1;
+  } else if (strcmp(option, "--aggregate") == 0) {
+    c->is_aggregate = 1;
+  } else if (strcmp(option, "--filter") == 0) {
+    c->is_filter = 1;
+  } else if (strcmp(option, "--filter-index") == 0) {
+    c->is_filter = 2;
+  } else if (strcmp(option, "--freestanding") == 0) {
+    c->is_freestanding = 1;
+  } else if (strcmp(option, "--keep-frames") == 0) {
+    c->is_keep_frames = 1;
+  } else if (strcmp(option, "--profile-generate") == 0 ||
+             strncmp(option, "--profile-generate=", 19) == 0) {
+    free(c->profile_generate);
+    c->profile_generate = strdup(option[18] == '=' ? option + 19 : "calc.profile");
+  } else if (strncmp(option, "--profile-use=", 14) == 0) {
+    c->is_profile_use = 1;
+    c->profile_error = !profile_load(c, option + 14);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+void calc_clear_options(CalcContext* c) {
+  c->is_batch = 0;
+  c->is_aggregate = 0;
+  c->is_filter = 0;
+  c->is_freestanding = 0;
+  c->is_keep_frames = 0;
+  free(c->profile_generate);
+  c->profile_generate = NULL;
+  c->is_profile_use = 0;
+  free(c->profile);
+  c->profile = NULL;
+  c->profile_count = 0;
+  c->profile_error = false;
+}
+
+const char* calc_check_options(const CalcContext* c) {
+  if (c->is_batch && c->is_freestanding) {
+    return "--batch and --freestanding cannot be combined";
+  }
+  if ((c->is_aggregate || c->is_filter) && !c->is_batch) {
+    return "--aggregate and --filter need --batch";
+  }
+  if (c->is_aggregate && c->is_filter) {
+    return "--aggregate and --filter cannot be combined";
+  }
+  if (c->profile_generate && c->is_profile_use) {
+    return "--profile-generate and --profile-use cannot be combined";
+  }
+  if ((c->profile_generate || c->is_profile_use) && c->is_batch) {
+    return "--profile-generate and --profile-use cannot be combined with --batch";
+  }
+  // 終了時にプロファイルを書き出すのに libc を使う
+  if (c->profile_generate && c->is_freestanding) {
+    return "--profile-generate and --freestanding cannot be combined";
+  }
+  if (c->profile_error) {
+    return "cannot read the --profile-use file";
+  }
+#if !defined(TARGET_SYSTEM_LINUX)
+  if (c->is_freestanding) {
+    return "--freestanding is only supported on Linux";
+  }
+#endif
+  return NULL;
+}
+
+/**
+ * @brief 利用者の関数・変数・ラベル番号などを前置きの読み込み直後の状態に戻す。
+ * @param sink アセンブリを受け取るコールバック。
+ * @param user sink にそのまま渡す値。
+ */
+static void reset_context(CalcSink sink, void* user) {
+  for (int i = 0; i < ctx->function_count; i++) {
+    clear_func_code(&ctx->functions[i]);
+    ctx->functions[i].cold = false;
+    if (i < ctx->prelude_count) {
+      strcpy(ctx->functions[i].name, ctx->prelude[i].name);
+      ctx->functions[i].arg_count = ctx->prelude[i].arg_count;
+      ir_copy(&ctx->functions[i].ir, &ctx->prelude[i].ir);
+    }
+  }
+  ctx->function_count = ctx->prelude_count;
+  ctx->current_function = NULL;
+  ctx->is_haste = 1;
+  ctx->variable_count = 0;
+  ctx->if_counter = ctx->prelude_if_count;
+  ctx->fork_join_sites = 0;
+  ctx->main_ir.count = 0;
+  ctx->main_stack.depth = 0;
+  ctx->main_stack.call_count = 0;
+  ctx->main_stack.acc_held = false;
+  ctx->main_stack.profile_if_count = 0;
+  ctx->main_value_slots = 0;
+  ctx->functions_final = false;
+  ctx->eval_steps = EVAL_STEP_LIMIT;
+  ctx->clone_count = 0;
+  ctx->clone_insts = 0;
+  ctx->profile_site_count = 0;
+  ctx->profile_slots = 0;
+  ctx->profile_main_ifs = 0;
+  ctx->profile_main_calls = 0;
+  ctx->sink = sink;
+  ctx->sink_user = user;
+}
+
+/**
+ * @brief 電卓式を LEX_PADDING 付きの書き換えられるバッファに写す。
+ * @param src 電卓式。
+ * @return 写したバッファ (呼び出し元で free する)。
+ */
+static char* copy_source(const char* src) {
+  size_t size = strlen(src) + 1;
+  char* copy = calloc(size + LEX_PADDING, 1);
+  if (!copy) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  memcpy(copy, src, size);
+  return copy;
+}
+
+/**
+ * 状態を reset_context で戻してから compile する。ctx は呼び出し元のものを
+ * 退避しておき、最後に戻す。
+ */
+int calc_compile(CalcContext* c, const char* src, CalcSink sink, void* user) {
+  CalcContext* saved = ctx;
+  ctx = c;
+  reset_context(sink, user);
+  char* input = copy_source(src);
+  int ret = compile(input);
+  free(input);
+  ctx = saved;
+  return ret;
+}
+
+/**
+ * 最初の文の並びを read_statements で読んでから compile し、parser が読み終えるたびに
+ * refill_input で次を読ませる。
+ */
+int calc_compile_file(CalcContext* c, FILE* in, CalcSink sink, void* user) {
+  CalcContext* saved = ctx;
+  ctx = c;
+  reset_context(sink, user);
+  ctx->input = in;
+  ctx->input_depth = 0;
+  read_statements();
+  int ret = compile(ctx->window);
+  ctx->input = NULL;
+  ctx = saved;
+  return ret;
+}
+
+/**
+ * @brief 入力から最上位の ; で終わる文を INPUT_WINDOW 文字ほど読んで window に置く。
+ * @return 1 文字でも読めれば true。
+ *
+ * 括弧 ((), {}) の外の ; の直後では parser の状態が式の始めと同じになるので、
+ * そこで区切れば前の文を捨てても続きを解析できる。window の大きさは
+ * INPUT_WINDOW と最も長い文の大きい方で抑えられ、入力全体の長さにはよらない。
+ * 改行とタブは空白として読み、入力の末尾の空白は除く。括弧の外の = で電卓式は
+ * 終わるので、そこで読むのをやめる。
+ */
+bool read_statements() {
+  ctx->window_size = 0;
+  int c;
+  while ((c = getc_unlocked(ctx->input)) != EOF) {
+    if (c == '\n' || c == '\r' || c == '\t') {
+      c = ' ';
+    }
+    if (ctx->window_size + 1 >= ctx->window_capacity) {
+      ctx->window_capacity = ctx->window_capacity ? ctx->window_capacity * 2 : INPUT_WINDOW + 1;
+      ctx->window = realloc(ctx->window, ctx->window_capacity + LEX_PADDING);
+      if (!ctx->window) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+      }
+    }
+    ctx->window[ctx->window_size++] = c;
+    if (c == '(' || c == '{') {
+      ctx->input_depth++;
+    } else if (c == ')' || c == '}') {
+      ctx->input_depth--;
+    } else if (ctx->input_depth == 0 &&
+               (c == '=' || (c == ';' && ctx->window_size >= INPUT_WINDOW))) {
+      break;
+    }
+  }
+  if (!ctx->window) {
+    ctx->window = calloc(1 + LEX_PADDING, 1);
+  }
+  if (c == EOF) {
+    // 末尾の改行で式の終わり方 (R で終わるかどうかなど) が変わらないようにする
+    while (ctx->window_size > 0 && ctx->window[ctx->window_size - 1] == ' ') {
+      ctx->window_size--;
+    }
+  }
+  memset(ctx->window + ctx->window_size, 0, 1 + LEX_PADDING);
+  return ctx->window_size > 0;
+}
+
+/**
+ * @brief 最上位の parser が window を読み終えたら、続きの文を読み込む。
+ * @param p 入力文字列ポインタへのポインタ。読み込めれば window の先頭を指す。
+ * @return 続きを読み込めれば true。
+ *
+ * window の途中の \0 は error_exit が書いたものなので、そこでは読み進めない。
+ */
+bool refill_input(char** p) {
+  if (!ctx->input || *p != ctx->window + ctx->window_size || !read_statements()) {
+    return false;
+  }
+  *p = ctx->window;
+  return true;
+}
+
+/**
+ * @brief 電卓式を 1 つコンパイルし、アセンブリを ctx の出力先に書く。
+ * @param input 電卓式。エラーの箇所で書き換えられる。
+ * @return 成功時0、入力が不正な場合は1などのエラーコード。
+ *
+ * ビルトイン関数と前置きの関数定義は読み込み済みであること。
+ */
+int compile(char* input) {
+  char** p = &input;
+  initialize();
+  int ret = parser(p, 0);
+  if (ctx->is_batch) {
+    finalize_batch();
+  } else {
+    finalize();
+  }
+  return ret;
+}
+
+/**
+ * @brief デフォルト関数定義を追加する。
+ *
+ * ビルドインではなくソース側で記述された関数テンプレートを、parser
+ * を使って事前に読み込んでおく。定義の後の ; などで関数の外に生成される
+ * IR は捨てるので、出力 (と --server で使い回す状態) には何も残らない。
+ */
+void def_default_func() {
+  ctx->is_haste = 0;
+  ctx->is_prelude = 1;
+  static const char* codes[] = {
+    "!sgn[1]{@step(#1)-@step(#1S)};",
+    "!abs[1]{@sgn(#1)*#1};",
+    "!gt[2]{@step(#1-#2)};",
+    "!ge[2]{1-@step(#2-#1)};",
+    "!eq[2]{1-@step(@abs(#1-#2))};",
     "!ne[2]{1-@eq(#1,#2)};",
     "!min[2]{#1+#2-@abs(#1-#2)/2};",
     "!max[2]{#1+#2+@abs(#1-#2)/2};",
-    "!if[3]{@abs(@sgn(#1))*(#2-#3)+#3};",
+    "!if[3]{$if(#1){#2}{#3}};",
   };
   for (size_t i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
-    char* p = (char*)codes[i];
-    parser(&p, 0, 0);
+    char* code = copy_source(codes[i]);
+    char* p = code;
+    parser(&p, 0);
+    free(code);
   }
-  is_haste = 1;
+  ctx->is_prelude = 0;
+  ctx->is_haste = 1;
 }
 
 /**
  * @brief
  * 出力アセンブリのプロローグを生成し、累積レジスタとメモリ領域を初期化する。
- * ビルドイン関数も定義する。
+ *
+ * バッチモードでは main は finalize_batch で実行時ライブラリとして出力するため、
+ * ここでは共通のヘッダだけを出力する。--freestanding では main の代わりに
+ * _start から始める。
  */
 void initialize() {
-  static const char* const lines[] = {
+  static const char* const header_lines[] = {
       ".att_syntax prefix\n",
       ".extern " ASM_EXTERN_PRINTF "\n",
       ".extern " ASM_EXTERN_EXIT "\n",
@@ -429,17 +1663,56 @@ void initialize() {
       ".asciz \"%d\\n\"\n",
       "L_err:\n",
       ".asciz \"E\\n\"\n",
+  };
+  static const char* const entry_lines[] = {
       ASM_TEXT_SECTION "\n",
       ".globl " ASM_GLOBAL_MAIN "\n",
       ASM_GLOBAL_MAIN ":\n",
+  };
+  // _start には戻り先が積まれていないので、main と同じ整列になるよう 8 バイト積む
+  static const char* const freestanding_entry_lines[] = {
+      ASM_TEXT_SECTION "\n",
+      ".globl " ASM_FREESTANDING_ENTRY "\n",
+      ASM_FREESTANDING_ENTRY ":\n",
+      "pushq $0\n",
+  };
+  static const char* const main_lines[] = {
       "pushq %rbp\n",
       "movq %rsp, %rbp\n",
       "xorl %eax, %eax\n",
       "xorl %edx, %edx\n",
       "xorl %r11d, %r11d\n",
   };
-  emit_lines(lines, sizeof(lines) / sizeof(lines[0]));
-  def_builtin_func();
+  // 関数の引数レジスタには呼び出し先保存のものもあるので、main の呼び出し元に戻す
+  // (finalize の exit_lines で -8(%rbp) から復元する)
+  static const char* const saved_register_lines[] = {
+      "pushq %rbx\n",
+      "pushq %r12\n",
+      "pushq %r13\n",
+      "pushq %r14\n",
+      "pushq %r15\n",
+      "subq $8, %rsp\n",
+  };
+  emit_lines(header_lines, sizeof(header_lines) / sizeof(header_lines[0]));
+  if (!ctx->is_batch) {
+    if (ctx->is_freestanding) {
+      emit_lines(freestanding_entry_lines,
+                 sizeof(freestanding_entry_lines) / sizeof(freestanding_entry_lines[0]));
+    } else {
+      emit_lines(entry_lines, sizeof(entry_lines) / sizeof(entry_lines[0]));
+    }
+    emit_lines(main_lines, sizeof(main_lines) / sizeof(main_lines[0]));
+    // 最上位の文は main_lines で項・累積・メモリを 0 にしたところから始まる
+    ctx->main_term = ctx->main_acc = (FoldValue){true, true, 0, false, {0, 0, 0}, 0};
+    ctx->main_memory = ctx->main_term;
+    for (int i = 0; i < MAX_VAR_FUNC; i++) {
+      ctx->main_vars[i] = (FoldVar){true, 0};
+    }
+    if (!ctx->is_freestanding) {
+      emit_lines(saved_register_lines,
+                 sizeof(saved_register_lines) / sizeof(saved_register_lines[0]));
+    }
+  }
 }
 
 /**
@@ -447,72 +1720,45 @@ void initialize() {
  * @param f 初期化する関数情報へのポインタ。
  */
 void clear_func_code(FunctionInfo* f) {
-  f->code_length = 0;
-  f->code[0] = '\0';
+  f->ir.count = 0;
 }
 
 /**
- * @brief FunctionInfo テーブルにビルトイン関数を登録し、遅延出力バッファにコードを蓄積する。
+ * @brief FunctionInfo テーブルにビルトイン関数を登録し、遅延出力バッファに IR を蓄積する。
  *
  * 現在は step 関数のみをハードコードしているが、同じ仕組みで追加の
  * ビルトインを組み込める。
  */
 void def_builtin_func() {
-  is_haste = 0;
+  ctx->is_haste = 0;
   // step function
-  FunctionInfo* f = &functions[function_count++];
+  FunctionInfo* f = &ctx->functions[ctx->function_count++];
   clear_func_code(f);
   strcpy(f->name, "step");
   f->arg_count = 1;
-  static const char* const lines[] = {
-      " # Built-in function: step\n",
-      " # Argument in %edi\n",
-      "movl 16(%rbp), %edx\n",
-      "testl %edx, %edx\n",
-      "jg .Lpositive\n",
-      "xorl %edx, %edx\n",
-      "jmp .Ldone\n",
-      ".Lpositive:\n",
-      "movl $1, %edx\n",
-      ".Ldone:\n",
-  };
-  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
-    strcat(f->code, lines[i]);
-  }
-  is_haste = 1;
+  ir_append(&f->ir, IR_STEP, 0, 0);
+  ctx->is_haste = 1;
 }
 
 /**
  * @brief 今から入れ子の解析を始めるための準備を行う。
- * @param p 入力文字列ポインタへのポインタ。
+ * @param stack 解析中の段のスタック。
  * @param nest_level 現在の入れ子の深さ。
- * @param is_misaligned 呼び出し元でスタック整列が崩れている場合は 1。
- * @return 入れ子内の parser 実行結果。
+ *
+ * 入れ子の中身は積んだ段で parser が解析する。
  */
-int nesting(char** p, int nest_level, int is_misaligned) {
-  mprintf(" # Entering nesting level %d\n", nest_level);
-  if (!is_misaligned) {
-    mprintf("subq $8, %%rsp\n");     // スタック調整
-  }
-  mprintf("pushq %%rdx\n");        // 現在の計算結果を保存
-  mprintf("xorl %%edx, %%edx\n");  // 新しい計算用にクリア
-  mprintf("xorl %%eax, %%eax\n");
-  mprintf(" # Starting parser at nesting level %d\n", nest_level);
-  return parser(p, nest_level + 1, is_misaligned);
+void nesting(ParseStack* stack, int nest_level) {
+  // 現在の計算結果を保存し、新しい計算用にクリアする
+  emit(IR_NEST_BEGIN, nest_level, 0);
+  push_frame(stack, nest_level + 1);
 }
 
 /**
  * @brief 入れ子計算の終了処理を行う。
- * @param is_misaligned 退避時にスタック調整を行わなかったかどうか。
  */
-void finish_nesting(int is_misaligned) {
-  mprintf(" # Exiting nesting level\n");
-  mprintf("movl %%edx, %%eax\n");  // 括弧内の計算結果を %eax に移す
-  mprintf("popq %%rdx\n");         // 計算結果を復元
-  if (!is_misaligned) {
-    mprintf("addq $8, %%rsp\n");     // スタック調整を戻す
-  }
-  mprintf(" # Finished nesting level\n");
+void finish_nesting() {
+  // 括弧内の計算結果を項に移し、計算結果を復元する
+  emit(IR_NEST_END, 0, 0);
 }
 /**
  * @brief 次の項の解析に備えて状態をリセットする。
@@ -520,7 +1766,7 @@ void finish_nesting(int is_misaligned) {
  * @param sign 現在の符号フラグへのポインタ。1 に初期化される。
  */
 void reset_formula(Op* last_op, Sign* sign) {
-  mprintf("xorl %%eax, %%eax\n");
+  emit(IR_TERM_CLEAR, 0, 0);
   *sign = S_PLUS;
   *last_op = PLUS;
 }
@@ -548,50 +1794,34 @@ void input_number(char** p) {
       (*p)++;
     } else {
       // 0 単独
-      mprintf("xorl %%eax, %%eax\n");
+      emit(IR_TERM_CLEAR, 0, 0);
       return;
     }
   }
-  while ((is_digit(**p)) || (**p >= 'a' && **p <= 'f')) {
-    mprintf("movl %%eax, %%edi\n");
-    mprintf("movl $%d, %%esi\n", radex);
-    mprintf("pushq %%rdx\n");
-    mprintf("pushq %%r11\n");
-    mprintf("callq mul32\n");
-    mprintf("popq %%r11\n");
-    mprintf("popq %%rdx\n");
-    if (is_digit(**p)) {
-      mprintf("addl $%d, %%eax\n", **p - '0');
-    } else if (**p >= 'a' && **p <= 'f') {
-      mprintf("addl $%d, %%eax\n", **p - 'a' + 10);
-    }
-    mprintf("jo L_overflow\n");
-    (*p)++;
+  size_t count = scan_number_digits(*p);
+  for (size_t i = 0; i < count; i++) {
+    char c = (*p)[i];
+    emit(IR_DIGIT, radex, is_digit(c) ? c - '0' : c - 'a' + 10);
   }
+  *p += count;
 }
 
 /**
  * @brief 識別子を読み取り、out_var_name に格納する。
  * @param p 入力文字列へのポインタを示すポインタ。
- * @param out_var_name 読み取った識別子を書き込むバッファ。
+ * @param out_var_name 読み取った識別子を書き込むバッファ (MAX_IDENTIFIER_LEN + 1 バイト)。
  */
 void read_identifier(char** p, char* out_var_name) {
-  while (**p == ' ') {
-    (*p)++;
-  }
-  char var_name[MAX_IDENTIFIER_LEN];
+  *p += scan_spaces(*p);
   int length = 0;
   // 変数名を読み取る
   while (is_identifier_char(**p) && length < MAX_IDENTIFIER_LEN) {
-    var_name[length++] = **p;
+    out_var_name[length++] = **p;
     (*p)++;
   }
-  var_name[length] = '\0';
-  strcpy(out_var_name, var_name);
+  out_var_name[length] = '\0';
   // 空白を読み飛ばす
-  while (**p == ' ') {
-    (*p)++;
-  }
+  *p += scan_spaces(*p);
 }
 
 /**
@@ -600,13 +1830,13 @@ void read_identifier(char** p, char* out_var_name) {
  * @return 成功時0、未定義変数の場合は1。
  */
 int input_variable(char** p) {
-  char var_name[MAX_IDENTIFIER_LEN];
+  char var_name[MAX_IDENTIFIER_LEN + 1];
   read_identifier(p, var_name);
   // 変数名が登録されているか確認する
-  for (int i = 0; i < variable_count; i++) {
-    if (strcmp(variable_names[i], var_name) == 0) {
+  for (int i = 0; i < ctx->variable_count; i++) {
+    if (strcmp(ctx->variable_names[i], var_name) == 0) {
       // 変数が見つかった場合、その値を %eax にロードする
-      mprintf("movl var_%s(%%rip), %%eax\n", var_name);
+      emit(IR_LOAD_VAR, i, 0);
       return 0;
     }
   }
@@ -621,7 +1851,7 @@ int input_variable(char** p) {
  * 関数名・引数数を解析し、current_function を遅延出力モードで切り替える。
  */
 void start_def_func(char** p) {
-  char func_name[MAX_IDENTIFIER_LEN];
+  char func_name[MAX_IDENTIFIER_LEN + 1];
   read_identifier(p, func_name);
   if (**p != '[') {
     error_exit(p);
@@ -642,35 +1872,36 @@ void start_def_func(char** p) {
   (*p)++;  // '{' をスキップ
   // 既存の同盟名関数があるか確認する
   int found = -1;
-  for (int i = 0; i < function_count; i++) {
-    if (strcmp(functions[i].name, func_name) == 0) {
+  for (int i = 0; i < ctx->function_count; i++) {
+    if (strcmp(ctx->functions[i].name, func_name) == 0) {
       found = i;
       break;
     }
   }
   // 関数情報を作成する
-  if (function_count < MAX_VAR_FUNC) {
-    current_function = &functions[found < 0 ? function_count++ : found];
-    strcpy(current_function->name, func_name);
-    current_function->arg_count = arg_count;
-    current_function->code_length = 0;
-    current_function->code[0] = '\0';
-    is_haste = 0;  // 遅延出力モードに切り替え
+  if (ctx->function_count < MAX_FUNC) {
+    ctx->current_function = &ctx->functions[found < 0 ? ctx->function_count++ : found];
+    strcpy(ctx->current_function->name, func_name);
+    ctx->current_function->arg_count = arg_count;
+    clear_func_code(ctx->current_function);
+    ctx->is_haste = 0;  // 遅延出力モードに切り替え
   }
 }
 
 /**
  * @brief 関数呼び出しの処理を行う。
  * @param p 入力文字列へのポインタを示すポインタ。
- * @param nest_level 呼び出し元の入れ子深度。
+ * @param stack 解析中の段のスタック。一番上が呼び出し元の段。
+ *
+ * 引数は 1 つずつ入れ子として積み、解析し終えるたびに next_call_arg に進む。
  */
-void start_call_func(char** p, int nest_level) {
-  char func_name[MAX_IDENTIFIER_LEN];
+void start_call_func(char** p, ParseStack* stack) {
+  char func_name[MAX_IDENTIFIER_LEN + 1];
   read_identifier(p, func_name);
   // 既存の同盟名関数があるか確認する
   int found = -1;
-  for (int i = 0; i < function_count; i++) {
-    if (strcmp(functions[i].name, func_name) == 0) {
+  for (int i = 0; i < ctx->function_count; i++) {
+    if (strcmp(ctx->functions[i].name, func_name) == 0) {
       found = i;
       break;
     }
@@ -684,52 +1915,58 @@ void start_call_func(char** p, int nest_level) {
     return;
   }
   (*p)++;  // '(' をスキップ
-  FunctionInfo* f = &functions[found];
-  int align = 0;
-  // まずは現在の計算結果をスタックに保存する
-  if (f->arg_count % 2 == 0) {
-    mprintf("subq $8, %%rsp\n");  // スタック調整（引数が偶数個の場合）
-    align += 8;
-  }
-
-  align += 8;
-  // 現在の計算結果を保存する
-  mprintf("pushq %%rdx\n");
-  // 引数をスタックに積む
-  mprintf("  # Calling function %s with %d arguments\n", func_name, f->arg_count);
-  for (int i = 0; i < f->arg_count; i++) {
-    mprintf("  # Argument %d:\n", i + 1);
-    nesting(p, nest_level, align % 16 == 0 ? 0 : 1);
-    if (i < f->arg_count - 1 && **p == ',') {
-      (*p)++;  // ',' をスキップ
-    } else if (i == f->arg_count - 1) {
-      // 最後の引数の後の ')' はスキップされてる
-    } else {
-      error_exit(p);
-      return;
-    }
-    align += 8;
-    mprintf("pushq %%rax\n");  // 引数をスタックに積む
-    mprintf("  # Result of argument %d in %%eax\n", i + 1);
-  }
+  FunctionInfo* f = &ctx->functions[found];
+  ParseFrame* frame = &stack->frames[stack->depth - 1];
+  // まずは現在の計算結果をスタックに保存する (整列は lower_scalar が合わせる)
+  emit(IR_CALL_BEGIN, found, f->arg_count);
   if (f->arg_count == 0) {
     if (**p != ')') {
       error_exit(p);
       return;
     }
     (*p)++;
+    // 呼び出し後はスタックを戻し、保存していた計算結果を復元する
+    // 返り値は %eax にあるからOK
+    emit(IR_CALL, found, f->arg_count);
+    return;
+  }
+  // 引数をスタックに積む
+  frame->resume = RESUME_CALL_ARG;
+  frame->id = found;
+  frame->arg = 0;
+  emit(IR_ARG_BEGIN, 1, 0);
+  nesting(stack, frame->nest_level);
+}
+
+/**
+ * @brief 関数呼び出しの引数を 1 つ解析し終えた後、次の引数か呼び出しに進む。
+ * @param p 入力文字列へのポインタを示すポインタ。
+ * @param stack 解析中の段のスタック。
+ * @param frame 呼び出し元の段 (スタックの一番上)。
+ * @return 呼び出し元の段の解析を続けるので常に true。
+ */
+static bool next_call_arg(char** p, ParseStack* stack, ParseFrame* frame) {
+  const FunctionInfo* f = &ctx->functions[frame->id];
+  int i = frame->arg;
+  if (i < f->arg_count - 1 && **p == ',') {
+    (*p)++;  // ',' をスキップ
+  } else if (i == f->arg_count - 1) {
+    // 最後の引数の後の ')' はスキップされてる
+  } else {
+    error_exit(p);
+    return true;
   }
-  mprintf("callq func_%s\n", func_name);
-  // スタックを引数分だけ戻す
-  if (f->arg_count > 0) {
-    mprintf("addq $%d, %%rsp\n", f->arg_count * 8);
+  emit(IR_PUSH_ARG, i + 1, 0);  // 引数をスタックに積む
+  if (i + 1 < f->arg_count) {
+    frame->arg = i + 1;
+    emit(IR_ARG_BEGIN, i + 2, 0);
+    nesting(stack, frame->nest_level);
+    return true;
   }
+  // 呼び出し後はスタックを戻し、保存していた計算結果を復元する
   // 返り値は %eax にあるからOK
-  // 保存していた計算結果を復元する
-  mprintf("popq %%rdx\n");
-  if (f->arg_count % 2 == 0) {
-    mprintf("addq $8, %%rsp\n");  // スタック調整を戻す（引数が偶数個の場合）
-  }
+  emit(IR_CALL, frame->id, f->arg_count);
+  return true;
 }
 
 
@@ -740,50 +1977,7 @@ void start_call_func(char** p, int nest_level) {
  * @param sign 項に掛ける符号。-1 の場合は項を反転してから演算する。
  */
 void apply_last_op(Op last_op, Sign sign) {
-  // 構築済みの数字が %eax にあるので %esi に移す
-  mprintf("movl %%eax, %%esi\n");
-  // 符号を反転する場合は %esi を neg する
-  if (sign == S_MINUS) {
-    mprintf("negl %%esi\n");
-    mprintf("jo L_overflow\n");
-  }
-  switch (last_op) {
-    case PLUS:
-      mprintf("addl %%esi, %%edx\n");
-      mprintf("jo L_overflow\n");
-      break;
-    case MINUS:
-      mprintf("subl %%esi, %%edx\n");
-      mprintf("jo L_overflow\n");
-      break;
-    case MUL:
-      mprintf("movl %%edx, %%edi\n");
-      mprintf("subq $8, %%rsp\n");
-      mprintf("pushq %%r11\n");
-      mprintf("callq mul32\n");
-      mprintf("popq %%r11\n");
-      mprintf("addq $8, %%rsp\n");
-      mprintf("movl %%eax, %%edx\n");
-      break;
-    case DIV:
-      mprintf("movl %%edx, %%edi\n");
-      mprintf("subq $8, %%rsp\n");
-      mprintf("pushq %%r11\n");
-      mprintf("callq div32\n");
-      mprintf("popq %%r11\n");
-      mprintf("addq $8, %%rsp\n");
-      mprintf("movl %%eax, %%edx\n");
-      break;
-    case MOD:
-      mprintf("movl %%edx, %%edi\n");
-      mprintf("subq $8, %%rsp\n");
-      mprintf("pushq %%r11\n");
-      mprintf("callq div32\n");
-      mprintf("popq %%r11\n");
-      mprintf("addq $8, %%rsp\n");
-      // mprintf("movl %%edx, %%edx\n");
-      break;
-  }
+  emit(IR_APPLY, last_op, sign);
 }
 
 /**
@@ -791,114 +1985,3413 @@ void apply_last_op(Op last_op, Sign sign) {
  * @param p 入力文字列へのポインタを示すポインタ。変数名分だけ進む。
  */
 void set_variable(char** p) {
-  char var_name[MAX_IDENTIFIER_LEN];
+  char var_name[MAX_IDENTIFIER_LEN + 1];
   read_identifier(p, var_name);
-  // 現在の計算結果を変数に保存する
-  mprintf("movl %%edx, var_%s(%%rip)\n", var_name);
   // 変数名が既に登録されているか確認する
-  for (int i = 0; i < variable_count; i++) {
-    if (strcmp(variable_names[i], var_name) == 0) {
-      return;
+  int found = -1;
+  for (int i = 0; i < ctx->variable_count; i++) {
+    if (strcmp(ctx->variable_names[i], var_name) == 0) {
+      found = i;
+      break;
     }
   }
   // 新しい変数名を登録する
-  if (variable_count < MAX_VAR_FUNC) {
-    strcpy(variable_names[variable_count++], var_name);
+  if (found < 0) {
+    if (ctx->variable_count >= MAX_VAR_FUNC) {
+      error_exit(p);
+      return;
+    }
+    found = ctx->variable_count;
+    strcpy(ctx->variable_names[ctx->variable_count++], var_name);
   }
+  // 現在の計算結果を変数に保存する
+  emit(IR_STORE_VAR, found, 0);
 }
 
+static const char* const arg_registers[ARG_REGISTER_COUNT] = {
+    ARG_REGISTER_1, ARG_REGISTER_2, ARG_REGISTER_3,
+    ARG_REGISTER_4, ARG_REGISTER_5, ARG_REGISTER_6,
+};
+
 /**
- * @brief 変数定義用のデータセクションを出力する。
- *
- * parser 中に `->` で登録された全変数について .data/.rodata を発行する。
+ * @brief 引数の評価を始めた呼び出しを覚える。
  */
-void finalize_variables() {
-  for (int i = 0; i < variable_count; i++) {
-    printf(ASM_DATA_SECTION "\n");
-    printf("var_%s:\n .long 0\n", variable_names[i]);
+static void push_call(StackState* st, OpenCall call) {
+  if (st->call_count == st->call_capacity) {
+    size_t capacity = st->call_capacity ? st->call_capacity * 2 : 64;
+    OpenCall* calls = realloc(st->calls, capacity * sizeof(OpenCall));
+    if (!calls) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    st->calls = calls;
+    st->call_capacity = capacity;
   }
+  st->calls[st->call_count++] = call;
 }
 
 /**
- * @brief 関数定義部分を出力する。
- *
- * 遅延出力された各 FunctionInfo の本体を .text として展開し、簡易 prologue/epilogue
- * を付与して再利用できるようにする。
+ * @brief --profile-generate で、変換を始めた $if の then 節のカウンタの番号を積む。
  */
-void finalize_functions() {
-  for (int i = 0; i < function_count; i++) {
-    FunctionInfo* f = &functions[i];
-    printf(ASM_TEXT_SECTION "\n");
-    printf(".globl func_%s\n", f->name);
-    printf("func_%s:\n", f->name);
-    printf("pushq %%rbp\n");
-    printf("movq %%rsp, %%rbp\n");
-    printf("xorl %%eax, %%eax\n");
-    printf("xorl %%edx, %%edx\n");
-    // 関数本体コードを出力する
-    fputs(f->code, stdout);
-    // 関数終了処理
-    printf("movl %%edx, %%eax\n");
-    printf("leave\n");
-    printf("ret\n");
+static void push_profile_if(StackState* st, int slot) {
+  if (st->profile_if_count == st->profile_if_capacity) {
+    size_t capacity = st->profile_if_capacity ? st->profile_if_capacity * 2 : 16;
+    int* ifs = realloc(st->profile_ifs, capacity * sizeof(int));
+    if (!ifs) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    st->profile_ifs = ifs;
+    st->profile_if_capacity = capacity;
   }
+  st->profile_ifs[st->profile_if_count++] = slot;
 }
 
 /**
- * @brief 計算結果およびエラー表示、サポート関数定義まで含めた終端コードを生成する。
+ * @brief IR 命令 1 つをスカラー版のアセンブリに変換して出力する。
+ * @param inst 変換する命令。
+ * @param st 変換中の本体のスタックの状態。積み下ろしに合わせて更新する。
+ *
+ * 項は %eax、累積は %edx、メモリは %r11d に置く。関数の先頭の ARG_REGISTER_COUNT 個の
+ * 引数は評価した値をそのままレジスタに置き、assign_arg_registers が積むと決めた
+ * ものだけを積んで呼び出しの直前にレジスタに読む。呼び出し元の累積は、外側の
+ * 呼び出しが使っていなければ ACC_SAVE_REGISTER に置き、使っていれば積む。
+ * %rsp を 16 バイト境界に揃えるのは関数と fork-join の実行時ライブラリを呼ぶ
+ * ときだけで、呼び出しの最初に引数を積み終えたときの深さから詰め物を決める。
+ * mul32・div32 は整列を要らず、E の出力は自分で揃える。
+ * --profile-generate では $if の各節と呼び出しの通過回数をカウンタに足す
+ * (カウンタの番号は record_profile_sites が同じ順で振ってある)。
  */
-void finalize() {
-  static const char* const lines[] = {
-      "movl %edx, %esi\n",
-      "leaq L_fmt(%rip), %rdi\n",
-      "movl $0, %eax\n",
-      "callq " ASM_EXTERN_PRINTF "\n",
-      "xorl %eax, %eax\n",
-      "leave\n",
-      "ret\n",
-      "L_overflow:\n",
-      "leaq L_err(%rip), %rdi\n",
-      "movl $0, %eax\n",
-      "callq " ASM_EXTERN_PRINTF "\n",
-      "leave\n",
-      "movl $1, %edi\n",
-      "callq " ASM_EXTERN_EXIT "\n",
-      ".globl div32\n",
-      "div32:\n",
-      "pushq %rbp\n",
-      "movq %rsp, %rbp\n",
-      "pushq %rdi\n",
-      "pushq %rsi\n", // 割る数
-      "testl %esi, %esi\n",
-      "je L_overflow\n",
-      "cmpl $0x80000000, %edi\n",
-      "jne .L_div32_safe\n",
-      "cmpl $-1, %esi\n",
-      "je L_overflow\n",
-      ".L_div32_safe:\n",
-      "callq abs32\n",
-      "movq %rax, %r8\n",
-      "movq %rsi, %rdi\n",
-      "callq abs32\n",
-      "movq %rax, %r9\n",
-      "xorq %rax, %rax\n",
-      "xorq %rdx, %rdx\n",
-      "movl $32, %ecx\n",
-      ".L_div32_loop:\n",
-      "shll $1, %eax\n",
-      "shll $1, %r8d\n",
-      "rcll %edx\n",
-      "cmpl %edx, %r9d\n",
-      "jg .L_div32_skip\n",
-      "addl $1, %eax\n",
-      "subl %r9d, %edx\n",
-      ".L_div32_skip:\n",
-      "decl %ecx\n",
-      "jnz .L_div32_loop\n",
-      "popq %rsi\n",
-      "popq %rdi\n",
-      "testl $0x80000000, %edi\n",
-      "jz .L_div32_quotient_neg\n",
+void lower_scalar(const IrInst* inst, StackState* st) {
+  switch (inst->op) {
+    case IR_TERM_CLEAR:
+      mprintf("xorl %%eax, %%eax\n");
+      break;
+    case IR_ACC_CLEAR:
+      mprintf("xorl %%edx, %%edx\n");
+      break;
+    case IR_DIGIT:
+      // mul32 は %edx・%r11d・引数レジスタを変えないので退避しない
+      mprintf("movl %%eax, %%edi\n");
+      mprintf("movl $%d, %%esi\n", inst->a);
+      mprintf("callq mul32\n");
+      mprintf("addl $%d, %%eax\n", inst->b);
+      mprintf("jo L_overflow\n");
+      break;
+    case IR_APPLY:
+      // 構築済みの数字が %eax にあるので %esi に移す
+      mprintf("movl %%eax, %%esi\n");
+      // 符号を反転する場合は %esi を neg する
+      if (inst->b == S_MINUS) {
+        mprintf("negl %%esi\n");
+        mprintf("jo L_overflow\n");
+      }
+      switch (inst->a) {
+        case PLUS:
+          mprintf("addl %%esi, %%edx\n");
+          mprintf("jo L_overflow\n");
+          break;
+        case MINUS:
+          mprintf("subl %%esi, %%edx\n");
+          mprintf("jo L_overflow\n");
+          break;
+        // 累積は結果で置き換えるので、どちらの補助ルーチンも何も退避しなくてよい
+        case MUL:
+          mprintf("movl %%edx, %%edi\n");
+          mprintf("callq mul32\n");
+          mprintf("movl %%eax, %%edx\n");
+          break;
+        case DIV:
+          mprintf("movl %%edx, %%edi\n");
+          mprintf("callq div32\n");
+          mprintf("movl %%eax, %%edx\n");
+          break;
+        case MOD:
+          mprintf("movl %%edx, %%edi\n");
+          mprintf("callq div32\n");
+          // 剰余は div32 が %edx に残す
+          break;
+      }
+      break;
+    case IR_MEM_CLEAR:
+      mprintf("xorl %%edx, %%edx\n");
+      mprintf("movl %%edx,  %%r11d\n");
+      break;
+    case IR_MEM_RECALL:
+      mprintf("movl %%r11d, %%edx\n");
+      break;
+    case IR_MEM_ADD:
+    case IR_MEM_SUB:
+      // メモリから取り出し、加減算してメモリに戻す
+      mprintf("movl %%r11d, %%eax\n");
+      mprintf(inst->op == IR_MEM_ADD ? "addl %%edx, %%eax\n" : "subl %%edx, %%eax\n");
+      mprintf("jo L_overflow\n");
+      mprintf("movl %%eax, %%r11d\n");
+      // 計算結果はクリアする
+      mprintf("xorl %%edx, %%edx\n");
+      break;
+    case IR_NEST_BEGIN:
+      mprintf(" # Entering nesting level %d\n", inst->a);
+      if (!inst->b) {
+        mprintf("pushq %%rdx\n");  // 現在の計算結果を保存
+        st->depth += 8;
+      }
+      mprintf("xorl %%edx, %%edx\n");  // 新しい計算用にクリア
+      mprintf("xorl %%eax, %%eax\n");
+      mprintf(" # Starting parser at nesting level %d\n", inst->a);
+      break;
+    case IR_NEST_END:
+      mprintf(" # Exiting nesting level\n");
+      mprintf("movl %%edx, %%eax\n");  // 括弧内の計算結果を %eax に移す
+      if (!inst->b) {
+        mprintf("popq %%rdx\n");  // 計算結果を復元
+        st->depth -= 8;
+      }
+      mprintf(" # Finished nesting level\n");
+      break;
+    case IR_LOAD_VAR:
+      mprintf("movl var_%s(%%rip), %%eax\n", ctx->variable_names[inst->a]);
+      break;
+    case IR_STORE_VAR:
+      mprintf("movl %%edx, var_%s(%%rip)\n", ctx->variable_names[inst->a]);
+      break;
+    case IR_LOAD_ARG:
+      mprintf("movl %d(%%rbp), %%eax\n", 16 + (inst->b - inst->a) * 8);
+      break;
+    case IR_LOAD_COLUMN:
+      // 列参照はバッチモードにしか現れない
+      break;
+    case IR_CALL_BEGIN: {
+      const CallPlan* plan = &st->plans[st->plan_next++];
+      // タスクの累積は IR_JOIN がスタックから読むので、常に積む
+      bool acc_register = !plan->spawn && !st->acc_held;
+      int saved = acc_register ? 0 : 8;
+      // 計算結果と引数を積み終えたときに揃うよう、先に詰める
+      int pad = (st->depth + saved + plan->words * 8) % 16;
+      push_call(st, (OpenCall){plan, pad, acc_register});
+      if (pad) {
+        mprintf("subq $8, %%rsp\n");
+      }
+      // 現在の計算結果を保存する
+      if (acc_register) {
+        mprintf("movl %%edx, %s\n", ACC_SAVE_REGISTER);
+        st->acc_held = true;
+      } else {
+        mprintf("pushq %%rdx\n");
+      }
+      st->depth += pad + saved;
+      mprintf("  # Calling function %s with %d arguments\n", ctx->functions[inst->a].name, inst->b);
+      break;
+    }
+    case IR_ARG_BEGIN:
+      mprintf("  # Argument %d:\n", inst->a);
+      break;
+    case IR_PUSH_ARG:
+      if (inst->b) {
+        mprintf("pushq %%rax\n");
+        st->depth += 8;
+      } else {
+        mprintf("movl %%eax, %s\n", arg_registers[inst->a - 1]);
+      }
+      mprintf("  # Result of argument %d in %%eax\n", inst->a);
+      break;
+    case IR_CALL: {
+      OpenCall call = st->calls[--st->call_count];
+      // 積んだ引数のうちレジスタで渡すものは、後の引数の評価が済んでから読む
+      int above = call.plan->words;
+      for (int k = 1; k <= inst->b && k <= ARG_REGISTER_COUNT; k++) {
+        if (call.plan->stacked & (1u << (k - 1))) {
+          above--;
+          mprintf("movl %d(%%rsp), %s\n", above * 8, arg_registers[k - 1]);
+        }
+      }
+      if (ctx->profile_generate) {
+        mprintf("incq L_prof_counts+%d(%%rip)\n", st->profile_next++ * 8);
+      }
+      mprintf("callq func_%s\n", ctx->functions[inst->a].name);
+      // スタックを積んだ引数分だけ戻す
+      if (call.plan->words > 0) {
+        mprintf("addq $%d, %%rsp\n", call.plan->words * 8);
+      }
+      // 保存していた計算結果を復元する
+      if (call.acc_register) {
+        mprintf("movl %s, %%edx\n", ACC_SAVE_REGISTER);
+        st->acc_held = false;
+      } else {
+        mprintf("popq %%rdx\n");
+      }
+      if (call.pad) {
+        mprintf("addq $8, %%rsp\n");
+      }
+      st->depth -= call.plan->words * 8 + (call.acc_register ? 0 : 8) + call.pad;
+      break;
+    }
+    case IR_IF_TEST:
+      mprintf("cmpl $0, %%eax\n");
+      // 節を入れ替えた $if は、条件が 0 でなければ後ろの節 (元の then 節) に飛ぶ
+      mprintf(inst->b ? "jne .L_else_%d\n" : "je .L_else_%d\n", inst->a);
+      if (ctx->profile_generate) {
+        push_profile_if(st, st->profile_next);
+        mprintf("incq L_prof_counts+%d(%%rip)\n", st->profile_next * 8);
+        st->profile_next += 2;
+      }
+      break;
+    case IR_IF_ELSE:
+      mprintf("jmp .L_end_%d\n", inst->a);
+      mprintf(".L_else_%d:\n", inst->a);
+      if (ctx->profile_generate && st->profile_if_count > 0) {
+        mprintf("incq L_prof_counts+%d(%%rip)\n",
+                (st->profile_ifs[st->profile_if_count - 1] + 1) * 8);
+      }
+      break;
+    case IR_IF_END:
+      mprintf(".L_end_%d:\n", inst->a);
+      if (ctx->profile_generate && st->profile_if_count > 0) {
+        st->profile_if_count--;
+      }
+      break;
+    case IR_ERROR:
+      if (ctx->is_freestanding) {
+        mprintf("jmp L_overflow\n");
+        break;
+      }
+      // フレームを省いた関数の中ではスタックが揃っていないので、揃えてから呼ぶ
+      mprintf("andq $-16, %%rsp\n");
+      mprintf("leaq L_err(%%rip), %%rdi\n");
+      mprintf("movl $0, %%eax\n");
+      mprintf("callq " ASM_EXTERN_PRINTF "\n");
+      mprintf("movl $1, %%edi\n");
+      mprintf("callq " ASM_EXTERN_EXIT "\n");
+      break;
+    case IR_STEP: {
+      static const char* const lines[] = {
+          " # Built-in function: step\n",
+          " # Argument in " ARG_REGISTER_1 "\n",
+          "movl " ARG_REGISTER_1 ", %edx\n",
+          "testl %edx, %edx\n",
+          "jg .Lpositive\n",
+          "xorl %edx, %edx\n",
+          "jmp .Ldone\n",
+          ".Lpositive:\n",
+          "movl $1, %edx\n",
+          ".Ldone:\n",
+      };
+      emit_lines(lines, sizeof(lines) / sizeof(lines[0]));
+      break;
+    }
+    case IR_SPAWN:
+      // 積まれた引数の下にタスクの見出し (FJ_TASK_HEADER バイト) を置く
+      mprintf("subq $%d, %%rsp\n", FJ_TASK_HEADER);
+      st->depth += FJ_TASK_HEADER;
+      mprintf("leaq func_%s(%%rip), %%rax\n", ctx->functions[inst->a].name);
+      mprintf("movq %%rax, (%%rsp)\n");
+      mprintf("movq $%d, 8(%%rsp)\n", inst->b);
+      mprintf("movq %%rsp, %%rdi\n");
+      mprintf("callq calc_fj_spawn\n");
+      break;
+    case IR_JOIN:
+      // 後の兄弟の結果を見出しに退避し、タスクの結果と呼び出し前の累積を戻す
+      mprintf("movl %%eax, 40(%%rsp)\n");
+      mprintf("movq %%rsp, %%rdi\n");
+      mprintf("callq calc_fj_join\n");
+      mprintf("movl %d(%%rsp), %%edx\n", FJ_TASK_HEADER + inst->a * 8);
+      break;
+    case IR_JOIN_END: {
+      // タスクは IR_CALL の代わりなので、呼び出しの詰め物もここで戻す
+      int size = FJ_TASK_HEADER + (inst->a + 1) * 8 + st->calls[--st->call_count].pad;
+      mprintf("movl 40(%%rsp), %%eax\n");
+      mprintf("addq $%d, %%rsp\n", size);
+      st->depth -= size;
+      break;
+    }
+    // 関数の中の退避領域は lower_function がフレームに置く
+    case IR_SAVE_VALUE:
+      mprintf("movl %%eax, L_value_%d(%%rip)\n", inst->a);
+      break;
+    case IR_LOAD_VALUE:
+      mprintf("movl L_value_%d(%%rip), %%eax\n", inst->a);
+      break;
+    case IR_TERM_CONST:
+      mprintf("movl $%d, %%eax\n", inst->a);
+      break;
+    case IR_ACC_CONST:
+      mprintf("movl $%d, %%edx\n", inst->a);
+      break;
+    case IR_MEM_CONST:
+      mprintf("movl $%d, %%r11d\n", inst->a);
+      break;
+    case IR_APPLY_CONST:
+      // IR_APPLY と同じく、乗除算は結果 (MOD は商) を %eax にも残す
+      switch (inst->a) {
+        case PLUS:
+          mprintf("addl $%d, %%edx\n", inst->b);
+          mprintf("jo L_overflow\n");
+          break;
+        case MINUS:
+          mprintf("subl $%d, %%edx\n", inst->b);
+          mprintf("jo L_overflow\n");
+          break;
+        case MUL:
+          mprintf("movl %%edx, %%edi\n");
+          mprintf("movl $%d, %%esi\n", inst->b);
+          mprintf("callq mul32\n");
+          mprintf("movl %%eax, %%edx\n");
+          break;
+        case DIV:
+        case MOD:
+          mprintf("movl %%edx, %%edi\n");
+          mprintf("movl $%d, %%esi\n", inst->b);
+          mprintf("callq div32\n");
+          if (inst->a == DIV) {
+            mprintf("movl %%eax, %%edx\n");
+          }
+          break;
+      }
+      break;
+  }
+}
+
+/**
+ * @brief 変数定義用のデータセクションを出力する。
+ *
+ * parser 中に `->` で登録された全変数について .data/.rodata を発行する。
+ * 最上位の式の共通部分式を退避する領域もここに置く。
+ */
+void finalize_variables() {
+  for (int i = 0; i < ctx->variable_count; i++) {
+    mprintf(ASM_DATA_SECTION "\n");
+    mprintf("var_%s:\n .long 0\n", ctx->variable_names[i]);
+  }
+  for (int i = 0; i < ctx->main_value_slots; i++) {
+    mprintf(ASM_DATA_SECTION "\n");
+    mprintf("L_value_%d:\n .long 0\n", i);
+  }
+}
+
+/**
+ * @brief 引数の参照が、呼び出しで上書きされる前なら引数レジスタから読めるか。
+ */
+static bool is_register_arg(const IrInst* inst) {
+  return inst->a >= 1 && inst->a <= inst->b && inst->a <= ARG_REGISTER_COUNT;
+}
+
+/**
+ * @brief 関数に %rbp のフレームが要るかを調べる。
+ *
+ * 関数を呼ばず、引数をすべてレジスタから読み、共通部分式の値を退避しない関数は
+ * スタックの領域を使わないのでフレームを省く。呼び出し先はスタックが揃っていることを前提にするので、
+ * 呼び出しのある関数には作る。--keep-frames ならプロファイラがフレームを
+ * 辿れるように常に作る。
+ */
+static bool needs_frame(const FunctionInfo* f) {
+  if (ctx->is_keep_frames || f->value_slots > 0) {
+    return true;
+  }
+  for (size_t j = 0; j < f->ir.count; j++) {
+    const IrInst* inst = &f->ir.insts[j];
+    if (inst->op == IR_CALL || inst->op == IR_SPAWN || inst->op == IR_JOIN ||
+        (inst->op == IR_LOAD_ARG && !is_register_arg(inst))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief 命令を実行すると値が変わる引数レジスタを返す。
+ *
+ * 呼び出しは呼び出し先の引数を読み込む分と、呼び出し先の arg_clobbers を
+ * 上書きする。レジスタで渡す引数はそれを評価した時点で置く。fork-join の
+ * 待ち合わせは他のタスクも実行しうるので全部とみなす。
+ */
+static unsigned inst_arg_clobbers(const IrInst* inst) {
+  switch (inst->op) {
+    case IR_CALL:
+    case IR_SPAWN: {
+      const FunctionInfo* g = &ctx->functions[inst->a];
+      int passed = g->arg_count < ARG_REGISTER_COUNT ? g->arg_count : ARG_REGISTER_COUNT;
+      return ((1u << passed) - 1) | g->arg_clobbers;
+    }
+    case IR_PUSH_ARG:
+      return inst->a <= ARG_REGISTER_COUNT ? 1u << (inst->a - 1) : 0;
+    case IR_JOIN:
+      return (1u << ARG_REGISTER_COUNT) - 1;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief 関数ごとに、呼ぶと値が変わる引数レジスタを求める (arg_clobbers)。
+ *
+ * 再帰があるので、変化がなくなるまで呼び出し先の集合を足し込む。
+ */
+static void analyze_clobbers() {
+  for (int i = 0; i < ctx->function_count; i++) {
+    ctx->functions[i].arg_clobbers = 0;
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < ctx->function_count; i++) {
+      FunctionInfo* f = &ctx->functions[i];
+      for (size_t j = 0; j < f->ir.count; j++) {
+        unsigned c = inst_arg_clobbers(&f->ir.insts[j]);
+        if (c & ~f->arg_clobbers) {
+          f->arg_clobbers |= c;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * assign_arg_registers が追う、引数を評価中の呼び出し 1 つ。
+ */
+typedef struct {
+  size_t pushes[ARG_REGISTER_COUNT];  // 第 k 引数の IR_PUSH_ARG の位置
+  unsigned pending;                   // 評価し終えた、レジスタで渡す候補の引数
+  unsigned stacked;                   // 後の引数の評価がレジスタを上書きする引数
+  unsigned inner;                     // 引数の評価中に上書きされたレジスタ (閉じたら外へ渡す)
+} ArgPlan;
+
+/**
+ * @brief 呼び出しの引数をレジスタに直接置くか積むかを決め、IR に書き込む。
+ * @param ir 変換する直前の IR。
+ * @param callees_known 呼び出し先の arg_clobbers が求めてあるか (なければ全部とみなす)。
+ *
+ * 先頭の ARG_REGISTER_COUNT 個の引数は、後の引数の評価 (入れ子の呼び出しと
+ * その引数) がそのレジスタを上書きしなければ直接置く。上書きするものと、
+ * それより後ろの引数、タスクにする呼び出しの引数は積む (IR_PUSH_ARG の b を 1 にする)。
+ * 引数全体を囲む入れ子は、呼び出しが累積を退避してあるので退避しない
+ * (IR_NEST_BEGIN・IR_NEST_END の b を 1 にする)。
+ */
+static void assign_arg_registers(IrBuffer* ir, bool callees_known) {
+  ArgPlan* open = NULL;
+  size_t open_count = 0, open_capacity = 0;
+  size_t* nests = NULL;
+  size_t nest_count = 0, nest_capacity = 0;
+  for (size_t i = 0; i < ir->count; i++) {
+    IrInst* inst = &ir->insts[i];
+    if (inst->op == IR_CALL_BEGIN) {
+      if (open_count == open_capacity) {
+        open_capacity = open_capacity ? open_capacity * 2 : 64;
+        ArgPlan* grown = realloc(open, open_capacity * sizeof(ArgPlan));
+        if (!grown) {
+          fprintf(stderr, "out of memory\n");
+          exit(1);
+        }
+        open = grown;
+      }
+      open[open_count++] = (ArgPlan){{0}, 0, 0, 0};
+      continue;
+    }
+    if (inst->op == IR_NEST_BEGIN) {
+      if (nest_count == nest_capacity) {
+        nest_capacity = nest_capacity ? nest_capacity * 2 : 64;
+        size_t* grown = realloc(nests, nest_capacity * sizeof(size_t));
+        if (!grown) {
+          fprintf(stderr, "out of memory\n");
+          exit(1);
+        }
+        nests = grown;
+      }
+      nests[nest_count++] = i;
+      continue;
+    }
+    if (inst->op == IR_NEST_END) {
+      size_t begin = nests[--nest_count];
+      int bare = begin > 0 && ir->insts[begin - 1].op == IR_ARG_BEGIN && i + 1 < ir->count &&
+                 ir->insts[i + 1].op == IR_PUSH_ARG;
+      ir->insts[begin].b = bare;
+      inst->b = bare;
+      continue;
+    }
+    if (inst->op == IR_CALL || inst->op == IR_SPAWN) {
+      ArgPlan* plan = &open[--open_count];
+      for (int k = 1; k <= inst->b && k <= ARG_REGISTER_COUNT; k++) {
+        ir->insts[plan->pushes[k - 1]].b =
+            inst->op == IR_SPAWN || (plan->stacked & (1u << (k - 1)));
+      }
+      // 外側の pending は内側を評価している間は変わらないので、まとめて反映する
+      if (open_count > 0) {
+        ArgPlan* outer = &open[open_count - 1];
+        outer->stacked |= outer->pending & plan->inner;
+        outer->inner |= plan->inner;
+      }
+    }
+    unsigned c = inst_arg_clobbers(inst);
+    if (!callees_known && (inst->op == IR_CALL || inst->op == IR_SPAWN)) {
+      c = (1u << ARG_REGISTER_COUNT) - 1;
+    }
+    if (open_count > 0) {
+      open[open_count - 1].stacked |= open[open_count - 1].pending & c;
+      open[open_count - 1].inner |= c;
+    }
+    if (inst->op == IR_PUSH_ARG) {
+      if (inst->a <= ARG_REGISTER_COUNT) {
+        open[open_count - 1].pushes[inst->a - 1] = i;
+        open[open_count - 1].pending |= 1u << (inst->a - 1);
+      } else {
+        inst->b = 1;
+      }
+    }
+  }
+  free(open);
+  free(nests);
+}
+
+/**
+ * @brief assign_arg_registers が書き込んだ IR から、呼び出しごとの渡し方を求める。
+ * @return IR_CALL_BEGIN の順の渡し方 (呼び出し側で free する)。
+ */
+static CallPlan* plan_calls(const IrBuffer* ir) {
+  size_t count = 0;
+  for (size_t i = 0; i < ir->count; i++) {
+    count += ir->insts[i].op == IR_CALL_BEGIN;
+  }
+  CallPlan* plans = calloc(count ? count : 1, sizeof(CallPlan));
+  size_t* open = malloc((count ? count : 1) * sizeof(size_t));
+  if (!plans || !open) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  size_t next = 0, open_count = 0;
+  for (size_t i = 0; i < ir->count; i++) {
+    const IrInst* inst = &ir->insts[i];
+    switch (inst->op) {
+      case IR_CALL_BEGIN:
+        open[open_count++] = next++;
+        break;
+      case IR_PUSH_ARG:
+        if (inst->b) {
+          CallPlan* plan = &plans[open[open_count - 1]];
+          plan->words++;
+          if (inst->a <= ARG_REGISTER_COUNT) {
+            plan->stacked |= 1u << (inst->a - 1);
+          }
+        }
+        break;
+      case IR_CALL:
+      case IR_SPAWN:
+        plans[open[--open_count]].spawn = inst->op == IR_SPAWN;
+        break;
+      default:
+        break;
+    }
+  }
+  free(open);
+  return plans;
+}
+
+/**
+ * @brief 関数 1 つを prologue/epilogue 付きのアセンブリに変換する。
+ *
+ * 引数は、その引数レジスタを上書きする命令 (呼び出しとその引数、fork-join の
+ * 積み込み・待ち合わせ) より前ならレジスタから読む。後でも読む引数だけを
+ * 本体の始めにフレームへ退避しておき、そこから読む。$if は前にしか飛ばないので、
+ * 命令の並びで後にある参照は実行も後になる。関数を呼ぶ関数は、呼び出し元の
+ * ACC_SAVE_REGISTER を本体の始めに退避して最後に戻す。
+ * プロファイルで一度も呼ばれなかった関数は、よく呼ぶ関数の間に挟まないよう
+ * 別のセクションに置く。
+ */
+static void lower_function(const FunctionInfo* f) {
+  // 退避領域の後ろに、退避する引数と ACC_SAVE_REGISTER の場所を取る
+  int spill_slots[ARG_REGISTER_COUNT];
+  int slots = f->value_slots;
+  bool saves_acc = false;
+  unsigned spills = 0, clobbered = 0;
+  for (size_t j = 0; j < f->ir.count; j++) {
+    const IrInst* inst = &f->ir.insts[j];
+    if (inst->op == IR_LOAD_ARG && is_register_arg(inst) &&
+        (clobbered & ~spills & (1u << (inst->a - 1)))) {
+      spills |= 1u << (inst->a - 1);
+      spill_slots[inst->a - 1] = slots++;
+    }
+    saves_acc |= inst->op == IR_CALL;
+    clobbered |= inst_arg_clobbers(inst);
+  }
+  int acc_slot = slots;
+  slots += saves_acc;
+  bool frame = needs_frame(f);
+  mprintf(f->cold ? ASM_COLD_TEXT_SECTION "\n" : ASM_TEXT_SECTION "\n");
+  mprintf(".globl func_%s\n", f->name);
+  mprintf("func_%s:\n", f->name);
+  if (frame) {
+    mprintf("pushq %%rbp\n");
+    mprintf("movq %%rsp, %%rbp\n");
+  }
+  if (slots > 0) {
+    // 本体の始めが 16 バイト境界のままになるよう、退避領域を 16 バイト単位で取る
+    mprintf("subq $%d, %%rsp\n", (slots * 4 + 15) / 16 * 16);
+  }
+  for (int k = 1; k <= ARG_REGISTER_COUNT; k++) {
+    if (spills & (1u << (k - 1))) {
+      mprintf("movl %s, %d(%%rbp)\n", arg_registers[k - 1], -4 * (spill_slots[k - 1] + 1));
+    }
+  }
+  if (saves_acc) {
+    mprintf("movl %s, %d(%%rbp)\n", ACC_SAVE_REGISTER, -4 * (acc_slot + 1));
+  }
+  mprintf("xorl %%eax, %%eax\n");
+  mprintf("xorl %%edx, %%edx\n");
+  CallPlan* plans = plan_calls(&f->ir);
+  StackState st = {0};
+  st.plans = plans;
+  st.profile_next = f->profile_base;
+  if (ctx->profile_generate) {
+    mprintf("incq L_prof_counts+%d(%%rip)\n", st.profile_next++ * 8);
+  }
+  // 関数本体コードを出力する
+  clobbered = 0;
+  for (size_t j = 0; j < f->ir.count; j++) {
+    const IrInst* inst = &f->ir.insts[j];
+    if (inst->op == IR_LOAD_ARG && is_register_arg(inst)) {
+      if (clobbered & (1u << (inst->a - 1))) {
+        mprintf("movl %d(%%rbp), %%eax\n", -4 * (spill_slots[inst->a - 1] + 1));
+      } else {
+        mprintf("movl %s, %%eax\n", arg_registers[inst->a - 1]);
+      }
+      continue;
+    }
+    if (inst->op == IR_SAVE_VALUE || inst->op == IR_LOAD_VALUE) {
+      int offset = -4 * (inst->a + 1);
+      mprintf(inst->op == IR_SAVE_VALUE ? "movl %%eax, %d(%%rbp)\n" : "movl %d(%%rbp), %%eax\n",
+              offset);
+      continue;
+    }
+    lower_scalar(inst, &st);
+    clobbered |= inst_arg_clobbers(inst);
+  }
+  free(plans);
+  free(st.calls);
+  free(st.profile_ifs);
+  // 関数終了処理
+  if (saves_acc) {
+    mprintf("movl %d(%%rbp), %s\n", -4 * (acc_slot + 1), ACC_SAVE_REGISTER);
+  }
+  mprintf("movl %%edx, %%eax\n");
+  if (frame) {
+    mprintf("leave\n");
+  }
+  mprintf("ret\n");
+}
+
+/**
+ * finalize_functions で関数を並列に変換するときの作業の受け渡し。
+ */
+typedef struct {
+  CalcContext* context;
+  TextBuffer* texts;  // texts[i] に functions[begin + i] の出力を溜める
+  int begin;
+  int end;
+  int next;  // 次に変換する関数番号 (ワーカーが奪い合う)
+} LoweringJob;
+
+/**
+ * @brief 残っている関数を 1 つずつ取り、それぞれのバッファに変換する。
+ */
+static void* lowering_worker(void* arg) {
+  LoweringJob* job = arg;
+  ctx = job->context;
+  for (;;) {
+    int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (i >= job->end) {
+      break;
+    }
+    capture = &job->texts[i - job->begin];
+    capture->size = 0;
+    lower_function(&ctx->functions[i]);
+  }
+  capture = NULL;
+  return NULL;
+}
+
+/**
+ * @brief 関数の変換に使うスレッド数を決める。
+ *
+ * オンラインの CPU 数 (環境変数 CALC_COMPILE_THREADS で変更できる) を、
+ * 1 スレッドが FUNCS_PER_THREAD 個以上の関数を受け持つように抑える。
+ */
+static int lowering_thread_count() {
+  const char* env = getenv("CALC_COMPILE_THREADS");
+  long threads = 1;
+  if (env) {
+    threads = atol(env);
+  } else {
+#ifdef _SC_NPROCESSORS_ONLN
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  }
+  long limit = ctx->function_count / FUNCS_PER_THREAD;
+  if (threads > limit) {
+    threads = limit;
+  }
+  return threads < 1 ? 1 : (int)threads;
+}
+
+/**
+ * @brief 関数定義部分を出力する。
+ *
+ * 遅延出力された各 FunctionInfo の本体を .text として展開し、簡易 prologue/epilogue
+ * を付与して再利用できるようにする。関数が多ければ、threads * FUNCS_PER_THREAD
+ * 個ずつ複数のスレッドで別々のバッファに変換し、関数の順に sink へ渡す
+ * (出力は 1 スレッドで変換したときと同じで、sink も呼び出し元のスレッドからしか
+ * 呼ばない)。変換は IR と関数表を読むだけなので、ワーカーは ctx を共有する。
+ */
+void finalize_functions() {
+  int threads = lowering_thread_count();
+  if (threads == 1) {
+    for (int i = 0; i < ctx->function_count; i++) {
+      lower_function(&ctx->functions[i]);
+    }
+    return;
+  }
+  int window = threads * FUNCS_PER_THREAD;
+  TextBuffer* texts = calloc(window, sizeof(TextBuffer));
+  pthread_t* workers = malloc((threads - 1) * sizeof(pthread_t));
+  for (int begin = 0; begin < ctx->function_count; begin += window) {
+    int end = begin + window < ctx->function_count ? begin + window : ctx->function_count;
+    LoweringJob job = {ctx, texts, begin, end, begin};
+    int started = 0;
+    for (int t = 0; t < threads - 1; t++) {
+      if (pthread_create(&workers[started], NULL, lowering_worker, &job) == 0) {
+        started++;
+      }
+    }
+    // 呼び出し元のスレッドも変換に加わる (スレッドを作れなくても最後まで進む)
+    lowering_worker(&job);
+    for (int t = 0; t < started; t++) {
+      pthread_join(workers[t], NULL);
+    }
+    for (int i = 0; i < end - begin; i++) {
+      ctx->sink(ctx->sink_user, texts[i].data, texts[i].size);
+    }
+  }
+  for (int i = 0; i < window; i++) {
+    free(texts[i].data);
+  }
+  free(texts);
+  free(workers);
+}
+
+/**
+ * @brief 命令 1 つが読み書きする状態を返す。
+ * @param inst 調べる命令。
+ * @param in_function 関数本体の命令か。最上位の文の呼び出しは、後で呼び出し先が
+ * 定義し直されて副作用を持つかもしれないので、すべてを読み書きするとみなす。
+ */
+static unsigned inst_effects(const IrInst* inst, bool in_function) {
+  switch (inst->op) {
+    case IR_LOAD_VAR:
+      return EFFECT_READ_VAR;
+    case IR_STORE_VAR:
+      return EFFECT_WRITE_VAR;
+    case IR_MEM_RECALL:
+      return EFFECT_READ_MEMORY;
+    case IR_MEM_CLEAR:
+    case IR_MEM_ADD:
+    case IR_MEM_SUB:
+      return EFFECT_READ_MEMORY | EFFECT_WRITE_MEMORY;
+    case IR_MEM_CONST:
+      return EFFECT_WRITE_MEMORY;
+    case IR_CALL:
+    case IR_SPAWN:
+      return in_function ? ctx->functions[inst->a].effects : EFFECT_ALL;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief 関数ごとに、呼ぶと読み書きする変数とメモリを求める (effects)。
+ *
+ * 呼び出し先の性質も含めて判定するため、変化がなくなるまで繰り返す。
+ */
+static void analyze_side_effects() {
+  for (int i = 0; i < ctx->function_count; i++) {
+    ctx->functions[i].effects = 0;
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < ctx->function_count; i++) {
+      FunctionInfo* f = &ctx->functions[i];
+      for (size_t j = 0; j < f->ir.count; j++) {
+        unsigned e = inst_effects(&f->ir.insts[j], true);
+        if (e & ~f->effects) {
+          f->effects |= e;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief 配列に count 番目の要素を置けるよう、足りなければ倍に広げる。
+ */
+static void* grow_array(void* data, size_t count, size_t* capacity, size_t size) {
+  if (count < *capacity) {
+    return data;
+  }
+  while (count >= *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+  }
+  data = realloc(data, *capacity * size);
+  if (!data) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return data;
+}
+
+/**
+ * @brief コンパイル時にわかっている (まだレジスタには読んでいない) 値。
+ */
+static FoldValue fold_known(int value) {
+  return (FoldValue){true, false, value, false, {0, 0, 0}, 0};
+}
+
+/**
+ * @brief 実行時にしかわからない (レジスタに入っている) 値。
+ */
+static FoldValue fold_unknown() {
+  return (FoldValue){false, true, 0, false, {0, 0, 0}, 0};
+}
+
+/**
+ * @brief 1 桁追加や演算子の適用をコンパイル時に計算する。
+ * @param op 演算子 (桁の追加は MUL と同じ)。
+ * @param acc 累積。
+ * @param term 符号を適用した項。
+ * @param result 累積の結果を受け取る。
+ * @param quotient MOD のとき、div32 が %eax に残す商を受け取る。
+ * @return 実行時に L_overflow へ飛ぶなら false。
+ *
+ * mul32・div32 と同じく、結果が 32 ビットに収まらない乗算、0 での除算と
+ * INT_MIN / -1 はエラーにする。
+ */
+static bool fold_op(Op op, int acc, int term, int* result, int* quotient) {
+  int64_t r;
+  switch (op) {
+    case PLUS:
+      r = (int64_t)acc + term;
+      break;
+    case MINUS:
+      r = (int64_t)acc - term;
+      break;
+    case MUL:
+      r = (int64_t)acc * term;
+      break;
+    default:
+      if (term == 0 || (acc == INT32_MIN && term == -1)) {
+        return false;
+      }
+      *quotient = acc / term;
+      r = op == DIV ? acc / term : acc % term;
+      break;
+  }
+  if (r < INT32_MIN || r > INT32_MAX) {
+    return false;
+  }
+  *result = (int)r;
+  return true;
+}
+
+/**
+ * @brief わかっている値をレジスタに読み込む命令を出す。
+ */
+static void fold_materialize(IrBuffer* out, FoldValue* v, IrOp op) {
+  if (v->known && !v->held) {
+    ir_append(out, op, v->value, 0);
+    v->held = true;
+  }
+}
+
+/**
+ * 変数への代入 1 つ (書き換えの記録では書き換える前の値、$if の節の後の値の
+ * 一覧では節の後の値)。
+ */
+typedef struct {
+  int var;
+  FoldVar value;
+} FoldAssign;
+
+/**
+ * fold_constants が変換中の $if 1 つ分の状態。
+ */
+typedef struct {
+  int taken;         // 条件がわかっていれば通る節 (1: then, 0: else)、わからなければ -1
+  size_t log_base;   // 条件を判定したときの書き換えの記録の長さ
+  size_t then_base;  // この $if の節の後の値の一覧 (branch_vars) の始め
+  size_t then_end;   // then 節の後の値の終わり (else 節の後の値の始め)
+  FoldValue acc;     // 条件を判定したときの累積・項 (条件)・メモリ
+  FoldValue term;
+  FoldValue memory_at_test;
+  FoldValue memory;  // then 節の後のメモリ
+} FoldIf;
+
+/**
+ * fold_constants の変換中の状態。
+ */
+typedef struct {
+  IrBuffer out;
+  FoldValue term;
+  FoldValue acc;
+  FoldValue memory;  // %r11d
+  FoldVar vars[MAX_VAR_FUNC];
+  int var_epoch;     // 変数に書き込んだ回数 (x - x の判定用)
+  FoldAssign* log;   // 変数の書き換えの記録 ($if の節を出るときに戻す)
+  size_t log_count;
+  size_t log_capacity;
+  FoldAssign* branch_vars;
+  size_t branch_count;
+  size_t branch_capacity;
+  int seen[MAX_VAR_FUNC];  // fold_take_branch が集めた変数の印
+  int stamp;
+  FoldIf* ifs;
+  size_t if_count;
+  size_t if_capacity;
+} FoldState;
+
+/**
+ * fold_constants が引数を評価中の呼び出し。
+ */
+typedef struct {
+  size_t begin;     // IR_CALL_BEGIN を出した out の位置
+  size_t arg_base;  // 引数の一覧 (FoldArg) の始め
+} FoldCall;
+
+/**
+ * fold_constants が評価した呼び出しの引数 1 つ。
+ */
+typedef struct {
+  size_t begin;  // IR_ARG_BEGIN を出した out の位置
+  bool known;    // 値がわかっている
+  int value;
+} FoldArg;
+
+/**
+ * @brief 実行時に必ずエラーになる位置に IR_ERROR を出す (以降は実行されない)。
+ */
+static void fold_error(FoldState* st) {
+  ir_append(&st->out, IR_ERROR, 0, 0);
+  st->term = st->acc = st->memory = fold_unknown();
+}
+
+/**
+ * @brief 変数の値を記録を残して書き換える ($if の節を出るときに戻すため)。
+ */
+static void fold_set_var(FoldState* st, int var, FoldVar value) {
+  FoldVar old = st->vars[var];
+  if (old.known == value.known && (!old.known || old.value == value.value)) {
+    return;
+  }
+  st->log = grow_array(st->log, st->log_count, &st->log_capacity, sizeof(FoldAssign));
+  st->log[st->log_count++] = (FoldAssign){var, old};
+  st->vars[var] = value;
+}
+
+/**
+ * @brief 変数に書き込むかもしれない呼び出しの後、すべての変数の値を忘れる。
+ */
+static void fold_forget_vars(FoldState* st) {
+  for (int v = 0; v < ctx->variable_count; v++) {
+    fold_set_var(st, v, (FoldVar){false, 0});
+  }
+}
+
+/**
+ * @brief $if の節で書き換えた変数の、節の後の値を branch_vars に (重複なく) 積み、
+ * 変数を節の前 (記録が base 個だったとき) の値に戻す。
+ */
+static void fold_take_branch(FoldState* st, size_t base) {
+  int stamp = ++st->stamp;
+  for (size_t k = st->log_count; k > base; k--) {
+    int var = st->log[k - 1].var;
+    if (st->seen[var] != stamp) {
+      st->seen[var] = stamp;
+      st->branch_vars = grow_array(st->branch_vars, st->branch_count, &st->branch_capacity,
+                                   sizeof(FoldAssign));
+      st->branch_vars[st->branch_count++] = (FoldAssign){var, st->vars[var]};
+    }
+  }
+  while (st->log_count > base) {
+    FoldAssign entry = st->log[--st->log_count];
+    st->vars[entry.var] = entry.value;
+  }
+}
+
+/**
+ * @brief 演算子の適用を畳み込む。
+ * @param clears_term 直後に項を 0 にするか。
+ */
+static void fold_apply(FoldState* st, Op op, bool negate, bool clears_term) {
+  int value;
+  int quotient = 0;
+  if (st->term.known && negate && st->term.value == INT32_MIN) {
+    fold_error(st);
+    return;
+  }
+  int t = st->term.known && negate ? -st->term.value : st->term.value;
+  if (st->term.known && st->acc.known) {
+    if (!fold_op(op, st->acc.value, t, &value, &quotient)) {
+      fold_error(st);
+      return;
+    }
+    st->acc = fold_known(value);
+    if (op == MUL || op == DIV || op == MOD) {
+      st->term = fold_known(op == MOD ? quotient : value);
+    }
+    return;
+  }
+  if (st->term.known) {
+    if ((op == PLUS || op == MINUS) && t == 0) {
+      return;
+    }
+    if (op == MUL && t == 0) {
+      st->acc = st->term = fold_known(0);
+      return;
+    }
+    if ((op == DIV || op == MOD) && t == 0) {
+      fold_error(st);
+      return;
+    }
+    if ((op == MUL || op == DIV || op == MOD) && t == 1 && clears_term) {
+      if (op == MOD) {
+        st->acc = fold_known(0);
+      }
+      return;
+    }
+    // わかっている項を即値で適用する (加減算は %eax を変えない)
+    ir_append(&st->out, IR_APPLY_CONST, op, t);
+    st->acc = fold_unknown();
+    if (op == MUL || op == DIV || op == MOD) {
+      st->term = st->acc;
+    }
+    return;
+  }
+  if (st->acc.known && st->acc.value == 1 && op == MUL && (!negate || clears_term)) {
+    // 1 * x は 0 + x と同じ (積の x は %eax にもう入っている)
+    st->acc = fold_known(0);
+    op = negate ? MINUS : PLUS;
+    negate = false;
+  }
+  if (st->acc.known && st->acc.value == 0 && op == MUL) {
+    // 0 * x は x によらず 0 (%eax にも積の 0 が入る)
+    st->term = fold_known(0);
+    return;
+  }
+  if (op == MINUS && !negate && st->term.sourced && st->acc.sourced &&
+      st->term.source.op == st->acc.source.op && st->term.source.a == st->acc.source.a &&
+      st->term.epoch == st->acc.epoch) {
+    // x - x はあふれずに 0 になり、項はそのまま残る
+    st->acc = fold_known(0);
+    return;
+  }
+  bool copies = op == PLUS && !negate && st->acc.known && st->acc.value == 0;
+  fold_materialize(&st->out, &st->acc, IR_ACC_CONST);
+  ir_append(&st->out, IR_APPLY, op, negate ? S_MINUS : S_PLUS);
+  FoldValue term = st->term;
+  st->acc = fold_unknown();
+  if (copies && term.sourced) {
+    st->acc.sourced = true;
+    st->acc.source = term.source;
+    st->acc.epoch = term.epoch;
+  }
+  if (op == MUL || op == DIV || op == MOD) {
+    st->term = fold_unknown();
+  }
+}
+
+/**
+ * @brief メモリの操作 (C/R/P/M) を畳み込む。
+ */
+static void fold_memory(FoldState* st, IrInst inst) {
+  switch (inst.op) {
+    case IR_MEM_CLEAR:
+      st->acc = st->memory = fold_known(0);
+      break;
+    case IR_MEM_RECALL:
+      if (st->memory.known) {
+        st->acc = fold_known(st->memory.value);
+        break;
+      }
+      ir_append(&st->out, inst.op, inst.a, inst.b);
+      st->acc = fold_unknown();
+      break;
+    default: {
+      // P・M は新しいメモリの値を %eax にも残し、累積を 0 にする
+      int value;
+      int unused;
+      if (st->memory.known && st->acc.known) {
+        if (!fold_op(inst.op == IR_MEM_ADD ? PLUS : MINUS, st->memory.value, st->acc.value,
+                     &value, &unused)) {
+          fold_error(st);
+          break;
+        }
+        st->term = st->memory = fold_known(value);
+        st->acc = fold_known(0);
+        break;
+      }
+      fold_materialize(&st->out, &st->acc, IR_ACC_CONST);
+      fold_materialize(&st->out, &st->memory, IR_MEM_CONST);
+      ir_append(&st->out, inst.op, inst.a, inst.b);
+      st->term = st->memory = fold_unknown();
+      st->acc = fold_known(0);
+      st->acc.held = true;
+      break;
+    }
+  }
+}
+
+/**
+ * @brief $if の命令 (ir->insts[i]) を畳み込む。
+ * @return 次に読む命令の位置。
+ *
+ * 条件がわかっていれば、通らない節を命令ごと飛ばす。わからなければ両方の節を
+ * 変換し、節の後で値が一致する変数とメモリだけをわかっているものとする。
+ * 節の値とメモリはどちらの節でもレジスタに読んでから合流する。累積は入れ子が
+ * 戻すので、条件を判定したときのままになる。
+ */
+static size_t fold_if(FoldState* st, const IrBuffer* ir, size_t i, const size_t* partner) {
+  IrInst inst = ir->insts[i];
+  if (inst.op == IR_IF_TEST) {
+    FoldIf frame = {-1, st->log_count, st->branch_count, 0, st->acc, st->term, st->memory,
+                    fold_unknown()};
+    if (st->term.known && partner[i] != SIZE_MAX && partner[partner[i]] != SIZE_MAX) {
+      frame.taken = st->term.value != 0;
+    } else {
+      fold_materialize(&st->out, &st->term, IR_TERM_CONST);
+      frame.term = st->term;
+      ir_append(&st->out, inst.op, inst.a, inst.b);
+    }
+    st->ifs = grow_array(st->ifs, st->if_count, &st->if_capacity, sizeof(FoldIf));
+    st->ifs[st->if_count++] = frame;
+    // else 節だけを通るなら then 節を飛ばす
+    return frame.taken == 0 ? partner[i] + 1 : i + 1;
+  }
+  if (st->if_count == 0) {
+    // 対応しない命令 (入力の誤り) はそのまま出す
+    fold_materialize(&st->out, &st->term, IR_TERM_CONST);
+    ir_append(&st->out, inst.op, inst.a, inst.b);
+    st->term = fold_unknown();
+    return i + 1;
+  }
+  FoldIf* frame = &st->ifs[st->if_count - 1];
+  if (frame->taken == 1) {
+    // then 節だけを通ったので else 節を飛ばす
+    st->if_count--;
+    return partner[i] + 1;
+  }
+  if (frame->taken == 0) {
+    st->if_count--;
+    return i + 1;
+  }
+  fold_materialize(&st->out, &st->term, IR_TERM_CONST);
+  fold_materialize(&st->out, &st->memory, IR_MEM_CONST);
+  ir_append(&st->out, inst.op, inst.a, inst.b);
+  if (inst.op == IR_IF_ELSE) {
+    fold_take_branch(st, frame->log_base);
+    frame->then_end = st->branch_count;
+    frame->memory = st->memory;
+    st->acc = frame->acc;
+    st->term = frame->term;
+    st->memory = frame->memory_at_test;
+    return i + 1;
+  }
+  // 節の前の値に戻してから、両方の節の後の値が一致する変数だけを残す
+  fold_take_branch(st, frame->log_base);
+  FoldVar after_then[MAX_VAR_FUNC];
+  FoldVar after_else[MAX_VAR_FUNC];
+  for (size_t k = frame->then_base; k < st->branch_count; k++) {
+    int var = st->branch_vars[k].var;
+    after_then[var] = after_else[var] = st->vars[var];
+  }
+  for (size_t k = frame->then_base; k < st->branch_count; k++) {
+    FoldVar* after = k < frame->then_end ? after_then : after_else;
+    after[st->branch_vars[k].var] = st->branch_vars[k].value;
+  }
+  for (size_t k = frame->then_base; k < st->branch_count; k++) {
+    int var = st->branch_vars[k].var;
+    bool same = after_then[var].known && after_else[var].known &&
+                after_then[var].value == after_else[var].value;
+    fold_set_var(st, var, same ? after_then[var] : (FoldVar){false, 0});
+  }
+  st->branch_count = frame->then_base;
+  bool same_memory = frame->memory.known && st->memory.known &&
+                     frame->memory.value == st->memory.value;
+  st->memory = same_memory ? frame->memory : fold_unknown();
+  st->memory.held = true;
+  st->acc = frame->acc;
+  st->term = fold_unknown();
+  st->if_count--;
+  return i + 1;
+}
+
+/**
+ * @brief $if の飛び先を求める。
+ * @return IF_TEST の位置に対応する IF_ELSE の位置を、IF_ELSE の位置に IF_END の
+ * 位置を入れた配列 (ほかの位置と対応のないものは SIZE_MAX)。呼び出し元で free する。
+ */
+static size_t* match_ifs(const IrBuffer* ir) {
+  size_t* partner = malloc((ir->count + 1) * sizeof(size_t));
+  size_t* tests = NULL;
+  size_t test_count = 0, test_capacity = 0;
+  if (!partner) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < ir->count; i++) {
+    partner[i] = SIZE_MAX;
+    if (ir->insts[i].op == IR_IF_TEST) {
+      tests = grow_array(tests, test_count, &test_capacity, sizeof(size_t));
+      tests[test_count++] = i;
+    } else if (ir->insts[i].op == IR_IF_ELSE && test_count > 0) {
+      partner[tests[test_count - 1]] = i;
+    } else if (ir->insts[i].op == IR_IF_END && test_count > 0) {
+      size_t test = tests[--test_count];
+      if (partner[test] != SIZE_MAX) {
+        partner[partner[test]] = i;
+      }
+    }
+  }
+  free(tests);
+  return partner;
+}
+
+typedef enum {
+  EVAL_OK,       // 値が求まった
+  EVAL_ERROR,    // 実行すると E になる
+  EVAL_GIVE_UP,  // 上限に達したか、コンパイル時には評価できない命令があった
+} EvalStatus;
+
+/**
+ * 評価済みの呼び出し (関数と引数から結果を引く表の 1 項目)。
+ */
+typedef struct {
+  bool used;
+  EvalStatus status;
+  int function;
+  int arg_count;
+  int args[MAX_ARGUMENTS];
+  int result;
+} EvalMemo;
+
+/**
+ * 定数の引数での呼び出しをコンパイル時に評価する間の状態。
+ */
+typedef struct {
+  int depth;
+  size_t** jumps;  // 関数ごとの match_ifs の結果 (まだ求めていなければ NULL)
+  EvalMemo* memo;  // 開番地法のハッシュ表 (容量は 2 の累乗)
+  size_t memo_count;
+  size_t memo_capacity;
+} Evaluator;
+
+/**
+ * @brief 呼び出しの評価の表で、関数と引数の項目 (なければ空き) を探す。
+ */
+static EvalMemo* eval_memo_slot(Evaluator* ev, int f, const int* args, int arg_count) {
+  uint64_t hash = 14695981039346656037u ^ (uint32_t)f;
+  hash *= 1099511628211u;
+  for (int k = 0; k < arg_count; k++) {
+    hash ^= (uint32_t)args[k];
+    hash *= 1099511628211u;
+  }
+  size_t mask = ev->memo_capacity - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    EvalMemo* m = &ev->memo[i];
+    if (!m->used || (m->function == f && m->arg_count == arg_count &&
+                     memcmp(m->args, args, arg_count * sizeof(int)) == 0)) {
+      return m;
+    }
+  }
+}
+
+/**
+ * @brief 呼び出しの評価の結果を表に加える (半分埋まったら倍に広げる)。
+ */
+static void eval_memo_add(Evaluator* ev, int f, const int* args, int arg_count,
+                          EvalStatus status, int result) {
+  if ((ev->memo_count + 1) * 2 > ev->memo_capacity) {
+    EvalMemo* old = ev->memo;
+    size_t old_capacity = ev->memo_capacity;
+    ev->memo_capacity = old_capacity ? old_capacity * 2 : 256;
+    ev->memo = calloc(ev->memo_capacity, sizeof(EvalMemo));
+    if (!ev->memo) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old[i].used) {
+        *eval_memo_slot(ev, old[i].function, old[i].args, old[i].arg_count) = old[i];
+      }
+    }
+    free(old);
+  }
+  EvalMemo* m = eval_memo_slot(ev, f, args, arg_count);
+  *m = (EvalMemo){true, status, f, arg_count, {0}, result};
+  memcpy(m->args, args, arg_count * sizeof(int));
+  ev->memo_count++;
+}
+
+/**
+ * @brief 演算子の適用を実行時と同じに計算する (乗除算は %eax にも結果を残す)。
+ * @return 実行時に L_overflow へ飛ぶなら false。
+ */
+static bool eval_apply(Op op, int t, int* acc, int* term) {
+  int quotient = 0;
+  if (!fold_op(op, *acc, t, acc, &quotient)) {
+    return false;
+  }
+  if (op == MUL || op == DIV) {
+    *term = *acc;
+  } else if (op == MOD) {
+    *term = quotient;
+  }
+  return true;
+}
+
+/**
+ * @brief 関数を定数の引数でコンパイル時に実行する。
+ * @param ev 評価の状態。
+ * @param f 関数番号。
+ * @param args 引数の値。
+ * @param arg_count 引数の数。
+ * @param result 関数の返す値を受け取る。
+ * @return 評価の結果。
+ *
+ * 変数とメモリに触れない関数 (effects が 0) だけを対象に、IR を lower_scalar の
+ * 出力と同じ意味で解釈する。同じ引数での呼び出しは表から引くので、fibo のような
+ * 再帰も呼び出しの数だけは繰り返さない。ctx->eval_steps を使い切るか、呼び出しが
+ * EVAL_DEPTH_LIMIT より深くなったらあきらめる。
+ */
+static EvalStatus eval_function(Evaluator* ev, int f, const int* args, int arg_count,
+                                int* result) {
+  const FunctionInfo* fn = &ctx->functions[f];
+  if (ev->memo_capacity > 0) {
+    EvalMemo* m = eval_memo_slot(ev, f, args, arg_count);
+    if (m->used) {
+      *result = m->result;
+      return m->status;
+    }
+  }
+  if (fn->effects != 0 || ev->depth >= EVAL_DEPTH_LIMIT) {
+    return EVAL_GIVE_UP;
+  }
+  if (!ev->jumps[f]) {
+    ev->jumps[f] = match_ifs(&fn->ir);
+  }
+  const size_t* jumps = ev->jumps[f];
+  int term = 0;
+  int acc = 0;
+  int* stack = NULL;  // 入れ子と呼び出しで積む累積と引数
+  size_t count = 0, capacity = 0;
+  EvalStatus status = EVAL_OK;
+  ev->depth++;
+  for (size_t i = 0; i < fn->ir.count && status == EVAL_OK; i++) {
+    if (--ctx->eval_steps < 0) {
+      // 使い切ったら以後の評価はすべてあきらめるので、表はここで手放す
+      free(ev->memo);
+      ev->memo = NULL;
+      ev->memo_count = ev->memo_capacity = 0;
+      status = EVAL_GIVE_UP;
+      break;
+    }
+    IrInst inst = fn->ir.insts[i];
+    int unused;
+    switch (inst.op) {
+      case IR_TERM_CLEAR:
+        term = 0;
+        break;
+      case IR_ACC_CLEAR:
+        acc = 0;
+        break;
+      case IR_DIGIT:
+        if (!fold_op(MUL, term, inst.a, &term, &unused) ||
+            !fold_op(PLUS, term, inst.b, &term, &unused)) {
+          status = EVAL_ERROR;
+        }
+        break;
+      case IR_APPLY:
+        if (inst.b == S_MINUS && term == INT32_MIN) {
+          status = EVAL_ERROR;
+        } else if (!eval_apply((Op)inst.a, inst.b == S_MINUS ? -term : term, &acc, &term)) {
+          status = EVAL_ERROR;
+        }
+        break;
+      case IR_APPLY_CONST:
+        if (!eval_apply((Op)inst.a, inst.b, &acc, &term)) {
+          status = EVAL_ERROR;
+        }
+        break;
+      case IR_TERM_CONST:
+        term = inst.a;
+        break;
+      case IR_ACC_CONST:
+        acc = inst.a;
+        break;
+      case IR_NEST_BEGIN:
+      case IR_CALL_BEGIN:
+        stack = grow_array(stack, count, &capacity, sizeof(int));
+        stack[count++] = acc;
+        if (inst.op == IR_NEST_BEGIN) {
+          term = acc = 0;
+        }
+        break;
+      case IR_NEST_END:
+        if (count == 0) {
+          status = EVAL_GIVE_UP;
+          break;
+        }
+        term = acc;
+        acc = stack[--count];
+        break;
+      case IR_ARG_BEGIN:
+      case IR_IF_END:
+        break;
+      case IR_PUSH_ARG:
+        stack = grow_array(stack, count, &capacity, sizeof(int));
+        stack[count++] = term;
+        break;
+      case IR_LOAD_ARG:
+        if (inst.a < 1 || inst.a > arg_count || inst.b != arg_count) {
+          status = EVAL_GIVE_UP;
+          break;
+        }
+        term = args[inst.a - 1];
+        break;
+      case IR_CALL:
+        if (count < (size_t)inst.b + 1) {
+          status = EVAL_GIVE_UP;
+          break;
+        }
+        count -= inst.b;
+        status = eval_function(ev, inst.a, &stack[count], inst.b, &term);
+        acc = stack[--count];
+        break;
+      case IR_IF_TEST:
+      case IR_IF_ELSE:
+        // 条件が 0 なら else 節の始めへ、then 節の終わりからは $if の後へ飛ぶ
+        if (jumps[i] == SIZE_MAX) {
+          status = EVAL_GIVE_UP;
+        } else if (inst.op == IR_IF_ELSE || term == 0) {
+          i = jumps[i];
+        }
+        break;
+      case IR_STEP:
+        if (arg_count < 1) {
+          status = EVAL_GIVE_UP;
+          break;
+        }
+        acc = args[0] > 0;
+        break;
+      case IR_ERROR:
+        status = EVAL_ERROR;
+        break;
+      default:
+        status = EVAL_GIVE_UP;
+        break;
+    }
+  }
+  ev->depth--;
+  free(stack);
+  *result = acc;
+  if (status != EVAL_GIVE_UP) {
+    eval_memo_add(ev, f, args, arg_count, status, acc);
+  }
+  return status;
+}
+
+/**
+ * @brief 定数の引数での呼び出し 1 つをコンパイル時に評価する。
+ * @return 評価の結果。EVAL_OK なら result に呼び出しの値が入る。
+ * ctx->eval_steps を使い切った後は何もせずにあきらめる。
+ */
+static EvalStatus eval_call(int f, const int* args, int arg_count, int* result) {
+  if (ctx->eval_steps <= 0) {
+    return EVAL_GIVE_UP;
+  }
+  Evaluator ev = {0, calloc(ctx->function_count, sizeof(size_t*)), NULL, 0, 0};
+  if (!ev.jumps) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  EvalStatus status = eval_function(&ev, f, args, arg_count, result);
+  for (int i = 0; i < ctx->function_count; i++) {
+    free(ev.jumps[i]);
+  }
+  free(ev.jumps);
+  free(ev.memo);
+  return status;
+}
+
+/**
+ * @brief out の [begin, end) が、取り除いても状態の変わらない命令
+ * (呼び出しの枠と定数の読み込み) だけか。
+ */
+static bool fold_loads_only(const IrBuffer* out, size_t begin, size_t end) {
+  for (size_t k = begin; k < end; k++) {
+    IrOp op = out->insts[k].op;
+    if (op != IR_CALL_BEGIN && op != IR_ARG_BEGIN && op != IR_PUSH_ARG &&
+        op != IR_TERM_CONST && op != IR_ACC_CONST) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief 引数の値がすべてわかっている呼び出しをコンパイル時に評価する。
+ * @param st 変換中の状態。out の末尾が呼び出しの IR_CALL_BEGIN からの命令。
+ * @param call 呼び出しの IR_CALL_BEGIN の位置と引数。
+ * @param args 引数。
+ * @param inst 呼び出しの IR_CALL。
+ * @return 評価できて呼び出しを値 (か IR_ERROR) に置き換えたら true。
+ *
+ * 引数の評価が定数の読み込みだけのときに限り、呼び出しを丸ごと取り除く。
+ */
+static bool fold_evaluate(FoldState* st, FoldCall call, const FoldArg* args, IrInst inst) {
+  int values[MAX_ARGUMENTS];
+  for (int k = 0; k < inst.b; k++) {
+    if (!args[k].known) {
+      return false;
+    }
+    values[k] = args[k].value;
+  }
+  if (!fold_loads_only(&st->out, call.begin, st->out.count)) {
+    return false;
+  }
+  int result;
+  EvalStatus status = eval_call(inst.a, values, inst.b, &result);
+  if (status == EVAL_GIVE_UP) {
+    return false;
+  }
+  st->out.count = call.begin;
+  if (status == EVAL_ERROR) {
+    fold_error(st);
+  } else {
+    st->term = fold_known(result);
+  }
+  return true;
+}
+
+/**
+ * find_selector が追う、関数本体の項か累積の値の形。
+ */
+typedef struct {
+  enum { SHAPE_UNKNOWN, SHAPE_CONST, SHAPE_ARG, SHAPE_SELECT } kind;
+  int value;  // 定数の値か引数番号
+} Shape;
+
+/**
+ * @brief 関数が $if(#1){#j}{#k} の形の選択かを調べる。
+ * @param f 調べる関数。
+ * @param then_arg 第 1 引数が 0 でないときに返す引数の番号を受け取る。
+ * @param else_arg 第 1 引数が 0 のときに返す引数の番号を受け取る。
+ * @return 3 引数の選択なら true。
+ *
+ * 畳み込む前と後のどちらの本体でも、命令を値の形で追って確かめる。
+ */
+static bool find_selector(const FunctionInfo* f, int* then_arg, int* else_arg) {
+  if (f->arg_count != 3) {
+    return false;
+  }
+  Shape term = {SHAPE_CONST, 0};
+  Shape acc = {SHAPE_CONST, 0};
+  Shape saved[8];  // 入れ子の外の累積
+  int depth = 0;
+  int state = 0;  // 0: $if の前, 1: then 節, 2: else 節, 3: $if の後
+  int if_depth = 0;
+  Shape then_term = term;
+  Shape test_acc = acc;
+  for (size_t i = 0; i < f->ir.count; i++) {
+    IrInst inst = f->ir.insts[i];
+    switch (inst.op) {
+      case IR_TERM_CLEAR:
+      case IR_TERM_CONST:
+        term = (Shape){SHAPE_CONST, inst.op == IR_TERM_CONST ? inst.a : 0};
+        break;
+      case IR_ACC_CLEAR:
+      case IR_ACC_CONST:
+        acc = (Shape){SHAPE_CONST, inst.op == IR_ACC_CONST ? inst.a : 0};
+        break;
+      case IR_LOAD_ARG:
+        if (inst.b != 3) {
+          return false;
+        }
+        term = (Shape){SHAPE_ARG, inst.a};
+        break;
+      case IR_NEST_BEGIN:
+        if (depth == (int)(sizeof(saved) / sizeof(saved[0]))) {
+          return false;
+        }
+        saved[depth++] = acc;
+        term = acc = (Shape){SHAPE_CONST, 0};
+        break;
+      case IR_NEST_END:
+        if (depth == 0) {
+          return false;
+        }
+        term = acc;
+        acc = saved[--depth];
+        break;
+      case IR_APPLY:
+      case IR_APPLY_CONST: {
+        bool plus = inst.a == PLUS && (inst.op == IR_APPLY_CONST || inst.b != S_MINUS);
+        if (inst.op == IR_APPLY_CONST && (inst.a == PLUS || inst.a == MINUS) && inst.b == 0) {
+          break;
+        }
+        if (inst.op == IR_APPLY && plus && acc.kind == SHAPE_CONST && acc.value == 0) {
+          acc = term;  // 0 + x
+          break;
+        }
+        acc = (Shape){SHAPE_UNKNOWN, 0};
+        if (inst.a == MUL || inst.a == DIV || inst.a == MOD) {
+          term = acc;
+        }
+        break;
+      }
+      case IR_IF_TEST:
+        if (state != 0 || term.kind != SHAPE_ARG || term.value != 1) {
+          return false;
+        }
+        state = 1;
+        if_depth = depth;
+        test_acc = acc;
+        break;
+      case IR_IF_ELSE:
+        if (state != 1 || depth != if_depth || memcmp(&acc, &test_acc, sizeof(Shape)) != 0) {
+          return false;
+        }
+        state = 2;
+        then_term = term;
+        term = (Shape){SHAPE_ARG, 1};
+        break;
+      case IR_IF_END:
+        if (state != 2 || depth != if_depth || memcmp(&acc, &test_acc, sizeof(Shape)) != 0 ||
+            then_term.kind != SHAPE_ARG || term.kind != SHAPE_ARG || then_term.value < 2 ||
+            term.value < 2 || then_term.value == term.value) {
+          return false;
+        }
+        state = 3;
+        *then_arg = then_term.value;
+        *else_arg = term.value;
+        term = (Shape){SHAPE_SELECT, 0};
+        break;
+      default:
+        return false;
+    }
+  }
+  return depth == 0 && acc.kind == SHAPE_SELECT;
+}
+
+/**
+ * @brief 命令の並びを実行しなくても結果が変わらないか。
+ *
+ * 状態を読み書きせず、エラー (オーバーフロー・0 除算・呼び出し先の E) にも
+ * ならない命令だけなら省ける。
+ */
+static bool fold_discardable(const IrInst* insts, size_t begin, size_t end, bool callee_known) {
+  for (size_t j = begin; j < end; j++) {
+    if (inst_effects(&insts[j], callee_known) != 0) {
+      return false;
+    }
+    switch (insts[j].op) {
+      case IR_TERM_CLEAR:
+      case IR_ACC_CLEAR:
+      case IR_TERM_CONST:
+      case IR_ACC_CONST:
+      case IR_NEST_BEGIN:
+      case IR_NEST_END:
+      case IR_LOAD_ARG:
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief 選択の関数 (find_selector) の呼び出しを、選ばれる引数だけを評価する
+ * $if に書き換える。
+ * @param st 変換中の状態。out の末尾が呼び出しの IR_CALL_BEGIN からの命令。
+ * @param call 呼び出しの IR_CALL_BEGIN の位置と引数。
+ * @param args 引数。
+ * @param inst 呼び出しの IR_CALL。
+ * @param callee_known 呼び出し先の effects を使えるか。
+ * @return 書き換えたら true。
+ *
+ * 選ばれない引数は評価しないので、その中のエラーや終わらない再帰は起こらなく
+ * なる。変数かメモリに書き込む引数は評価を省けないので書き換えない。条件が
+ * わかっていれば選ばれる引数の評価だけを残す (条件の評価も、エラーか副作用の
+ * ありうるときは残す)。
+ */
+static bool fold_select(FoldState* st, FoldCall call, const FoldArg* args, IrInst inst,
+                        bool callee_known) {
+  int then_arg = 0;
+  int else_arg = 0;
+  if (!find_selector(&ctx->functions[inst.a], &then_arg, &else_arg)) {
+    return false;
+  }
+  // 引数 k の評価は [args[k].begin + 1, ends[k]) (IR_ARG_BEGIN と IR_PUSH_ARG を除く)
+  size_t ends[3];
+  for (int k = 0; k < 3; k++) {
+    ends[k] = (k + 1 < 3 ? args[k + 1].begin : st->out.count) - 1;
+  }
+  for (int k = 1; k < 3; k++) {
+    for (size_t j = args[k].begin + 1; j < ends[k]; j++) {
+      if (inst_effects(&st->out.insts[j], callee_known) &
+          (EFFECT_WRITE_VAR | EFFECT_WRITE_MEMORY)) {
+        return false;
+      }
+    }
+  }
+  IrInst* insts = malloc(st->out.count * sizeof(IrInst));
+  if (!insts) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  memcpy(insts, st->out.insts, st->out.count * sizeof(IrInst));
+  st->out.count = call.begin;
+  if (args[0].known) {
+    if (!fold_discardable(insts, args[0].begin + 1, ends[0], callee_known)) {
+      for (size_t j = args[0].begin + 1; j < ends[0]; j++) {
+        ir_append(&st->out, insts[j].op, insts[j].a, insts[j].b);
+      }
+    }
+    const FoldArg* chosen = &args[args[0].value != 0 ? then_arg - 1 : else_arg - 1];
+    for (size_t j = chosen->begin + 1; j < ends[chosen - args]; j++) {
+      ir_append(&st->out, insts[j].op, insts[j].a, insts[j].b);
+    }
+    // 引数の評価の終わりでは値が %eax に入っている
+    st->term = chosen->known ? fold_known(chosen->value) : fold_unknown();
+    st->term.held = true;
+  } else {
+    int id = ctx->if_counter++;
+    const int order[3] = {1, then_arg, else_arg};
+    const IrOp marks[3] = {IR_IF_TEST, IR_IF_ELSE, IR_IF_END};
+    for (int m = 0; m < 3; m++) {
+      const FoldArg* arg = &args[order[m] - 1];
+      for (size_t j = arg->begin + 1; j < ends[order[m] - 1]; j++) {
+        ir_append(&st->out, insts[j].op, insts[j].a, insts[j].b);
+      }
+      ir_append(&st->out, marks[m], id, 0);
+    }
+    st->term = fold_unknown();
+  }
+  free(insts);
+  return true;
+}
+
+/**
+ * @brief 引数の一部を定数にした関数の複製を作る (同じ組み合わせなら作ったものを使う)。
+ * @param f 複製元の関数番号。
+ * @param constant 引数ごとに、定数にするか。
+ * @param values 定数にする引数の値。
+ * @return 複製の関数番号。作れなければ -1。
+ *
+ * 複製は定数の引数の参照を IR_TERM_CONST に置き換えた本体を持ち、finalize が
+ * ほかの関数と同じく畳み込む。名前は clamp__0_x_10 のように引数ごとの値
+ * (負の値は m を前に付け、定数でない引数は x) を並べる。数字は識別子に
+ * 使えないので利用者の関数とは重ならない。複製の命令数の合計は
+ * CLONE_INST_LIMIT までに抑える。
+ */
+static int specialize_function(int f, const bool* constant, const int* values) {
+  const FunctionInfo* src = &ctx->functions[f];
+  int n = src->arg_count;
+  for (size_t i = 0; i < ctx->clone_count; i++) {
+    const CloneInfo* c = &ctx->clones[i];
+    bool same = c->function == f;
+    for (int k = 0; same && k < n; k++) {
+      same = c->constant[k] == constant[k] && (!constant[k] || c->values[k] == values[k]);
+    }
+    if (same) {
+      return c->clone;
+    }
+  }
+  if (ctx->function_count >= MAX_FUNC || ctx->clone_insts + src->ir.count > CLONE_INST_LIMIT) {
+    return -1;
+  }
+  // 引数レジスタを直接読むビルトインと、範囲外の引数を読む本体は複製しない
+  int renumber[MAX_ARGUMENTS + 1];
+  int kept = 0;
+  for (int k = 0; k < n; k++) {
+    renumber[k + 1] = constant[k] ? 0 : ++kept;
+  }
+  for (size_t j = 0; j < src->ir.count; j++) {
+    const IrInst* inst = &src->ir.insts[j];
+    if (inst->op == IR_STEP ||
+        (inst->op == IR_LOAD_ARG && (inst->a < 1 || inst->a > n || inst->b != n))) {
+      return -1;
+    }
+  }
+  int index = ctx->function_count++;
+  FunctionInfo* clone = &ctx->functions[index];
+  char name[MAX_IDENTIFIER_LEN + 16 * MAX_ARGUMENTS];
+  int length = snprintf(name, sizeof(name), "%s_", src->name);
+  for (int k = 0; k < n; k++) {
+    if (!constant[k]) {
+      length += snprintf(name + length, sizeof(name) - length, "_x");
+    } else if (values[k] < 0) {
+      length += snprintf(name + length, sizeof(name) - length, "_m%u", 0u - (unsigned)values[k]);
+    } else {
+      length += snprintf(name + length, sizeof(name) - length, "_%d", values[k]);
+    }
+  }
+  if (length >= (int)sizeof(clone->name)) {
+    // 長すぎる名前は複製の通し番号で区別する (s で始まる部分は上の形に現れない)
+    char suffix[24];
+    int size = snprintf(suffix, sizeof(suffix), "__s%zu", ctx->clone_count);
+    snprintf(name, sizeof(name), "%.*s%s", (int)(sizeof(clone->name) - 1 - size), src->name,
+             suffix);
+  }
+  strcpy(clone->name, name);
+  clone->arg_count = kept;
+  clone->arg_clobbers = 0;
+  clone->effects = src->effects;
+  clone->value_slots = 0;
+  clear_func_code(clone);
+  // $if のラベルは関数をまたいで一意なので、複製では番号を取り直す
+  int* ifs = NULL;
+  size_t if_count = 0, if_capacity = 0;
+  for (size_t j = 0; j < src->ir.count; j++) {
+    IrInst inst = src->ir.insts[j];
+    if (inst.op == IR_LOAD_ARG && constant[inst.a - 1]) {
+      inst = (IrInst){IR_TERM_CONST, values[inst.a - 1], 0};
+    } else if (inst.op == IR_LOAD_ARG) {
+      inst = (IrInst){IR_LOAD_ARG, renumber[inst.a], kept};
+    } else if (inst.op == IR_IF_TEST) {
+      ifs = grow_array(ifs, if_count, &if_capacity, sizeof(int));
+      ifs[if_count++] = inst.a = ctx->if_counter++;
+    } else if ((inst.op == IR_IF_ELSE || inst.op == IR_IF_END) && if_count > 0) {
+      inst.a = inst.op == IR_IF_ELSE ? ifs[if_count - 1] : ifs[--if_count];
+    }
+    ir_append(&clone->ir, inst.op, inst.a, inst.b);
+  }
+  free(ifs);
+  ctx->clone_insts += src->ir.count;
+  ctx->clones = grow_array(ctx->clones, ctx->clone_count, &ctx->clone_capacity, sizeof(CloneInfo));
+  CloneInfo* c = &ctx->clones[ctx->clone_count++];
+  c->function = f;
+  c->clone = index;
+  memcpy(c->constant, constant, n * sizeof(bool));
+  memcpy(c->values, values, n * sizeof(int));
+  return index;
+}
+
+/**
+ * @brief 引数の一部が定数の呼び出しを、定数を埋め込んだ複製の呼び出しにする。
+ * @param st 変換中の状態。out の末尾が呼び出しの IR_CALL_BEGIN からの命令。
+ * @param call 呼び出しの IR_CALL_BEGIN の位置と引数。
+ * @param args 引数。
+ * @param inst 呼び出しの IR_CALL。複製にしたら複製の呼び出しに書き換える。
+ *
+ * 定数の引数は評価を取り除き、残りの引数を詰めて複製 (specialize_function) に渡す。
+ * 詰め直す命令が SPECIALIZE_MOVE_LIMIT を超える呼び出しはそのままにする。
+ */
+static void fold_specialize(FoldState* st, FoldCall call, const FoldArg* args, IrInst* inst) {
+  int n = inst->b;
+  bool constant[MAX_ARGUMENTS];
+  int values[MAX_ARGUMENTS];
+  int kept = 0;
+  for (int k = 0; k < n; k++) {
+    size_t end = k + 1 < n ? args[k + 1].begin : st->out.count;
+    constant[k] = args[k].known && fold_loads_only(&st->out, args[k].begin, end);
+    values[k] = args[k].value;
+    kept += !constant[k];
+  }
+  if (kept == n || kept == 0) {
+    return;
+  }
+  size_t moved = 0;
+  for (int k = 0; k < n; k++) {
+    if (constant[k]) {
+      moved = st->out.count - (k + 1 < n ? args[k + 1].begin : st->out.count);
+      break;
+    }
+  }
+  if (moved > SPECIALIZE_MOVE_LIMIT) {
+    return;
+  }
+  int clone = specialize_function(inst->a, constant, values);
+  if (clone < 0) {
+    return;
+  }
+  // 残す引数の評価を前に詰め、番号を付け直す
+  size_t to = call.begin;
+  st->out.insts[to++] = (IrInst){IR_CALL_BEGIN, clone, kept};
+  int index = 0;
+  for (int k = 0; k < n; k++) {
+    size_t end = k + 1 < n ? args[k + 1].begin : st->out.count;
+    if (constant[k]) {
+      continue;
+    }
+    index++;
+    size_t from = to;
+    if (to != args[k].begin) {
+      memmove(&st->out.insts[to], &st->out.insts[args[k].begin],
+              (end - args[k].begin) * sizeof(IrInst));
+    }
+    to += end - args[k].begin;
+    st->out.insts[from].a = index;
+    st->out.insts[to - 1].a = index;
+  }
+  st->out.count = to;
+  inst->a = clone;
+  inst->b = kept;
+}
+
+/**
+ * @brief 定数の計算をコンパイル時に済ませ、恒等的な演算を取り除く。
+ * @param ir 書き換える命令列 (関数本体か最上位の文 1 つ)。
+ * @param in_function 関数本体か。本体の始めでは項も累積も 0 で、メモリと変数は
+ * わからない。最上位の文は前の文の後の値 (main の始めはすべて 0) から始める。
+ * @param cold プロファイルで一度も呼ばれなかった関数か。呼び出しを評価・選択は
+ * するが、コードが増えるだけなので特殊化した複製は作らない。
+ *
+ * 項・累積・メモリ・変数の値がわかっている間は命令を出さずに計算し、わからない
+ * 命令に渡すときに IR_TERM_CONST・IR_ACC_CONST・IR_MEM_CONST で読み込む。
+ * わかっている項の適用は IR_APPLY_CONST に、値のわかっている変数の読み込みは
+ * 定数にする (書き込みは関数が読むかもしれないので残す)。値がわかっている
+ * 入れ子は丸ごと消し、条件がわかっている $if は通らない節を消す。変数に
+ * 書き込みうる呼び出しの後は変数の値を、メモリに触れる呼び出しの後はメモリの
+ * 値を忘れる。計算がオーバーフローするか 0 で割るなら、そこを IR_ERROR にする。
+ * x+0・x-0・x*0・0*x・x-x (同じ引数・変数) は常に、x*1・x/1・x%1 は
+ * 直後に項を 0 にするとき (乗除算は結果を %eax にも残すので) 取り除く。
+ * レジスタの値は実行時と同じになるよう、`->` の後のように項を読み直す
+ * 式でも結果は変わらない。
+ */
+static void fold_constants(IrBuffer* ir, bool in_function, bool cold) {
+  FoldState* st = calloc(1, sizeof(FoldState));
+  size_t* partner = match_ifs(ir);
+  FoldValue* saved = NULL;  // 入れ子・呼び出しの外の累積
+  size_t* begins = NULL;    // 入れ子を始めた out の位置 (呼び出しは SIZE_MAX)
+  size_t saved_count = 0, saved_capacity = 0, begin_capacity = 0;
+  FoldCall* calls = NULL;   // 引数を評価中の呼び出し
+  FoldArg* args = NULL;     // 呼び出しの引数
+  size_t call_count = 0, call_capacity = 0, arg_count = 0, arg_capacity = 0;
+  // 関数の定義が出揃っていれば、呼び出し先の本体は変わらない
+  bool evaluable = in_function || ctx->functions_final;
+  if (!st) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  if (in_function) {
+    st->term = fold_known(0);
+    st->term.held = true;
+    st->acc = st->term;
+    st->memory = fold_unknown();
+  } else {
+    st->term = ctx->main_term;
+    st->acc = ctx->main_acc;
+    st->memory = ctx->main_memory;
+    memcpy(st->vars, ctx->main_vars, sizeof(st->vars));
+  }
+  for (size_t i = 0; i < ir->count;) {
+    IrInst inst = ir->insts[i];
+    size_t next = i + 1;
+    bool clears_term = next < ir->count && ir->insts[next].op == IR_TERM_CLEAR;
+    switch (inst.op) {
+      case IR_TERM_CLEAR:
+        st->term = fold_known(0);
+        break;
+      case IR_ACC_CLEAR:
+        st->acc = fold_known(0);
+        break;
+      case IR_DIGIT: {
+        int value;
+        int unused;
+        if (!st->term.known) {
+          ir_append(&st->out, inst.op, inst.a, inst.b);
+          st->term.sourced = false;
+        } else if (fold_op(MUL, st->term.value, inst.a, &value, &unused) &&
+                   fold_op(PLUS, value, inst.b, &value, &unused)) {
+          st->term = fold_known(value);
+        } else {
+          fold_error(st);
+        }
+        break;
+      }
+      case IR_APPLY:
+        fold_apply(st, (Op)inst.a, inst.b == S_MINUS, clears_term);
+        break;
+      // 畳み込み済みの本体 (特殊化の複製元) を畳み込み直すときに現れる
+      case IR_TERM_CONST:
+        st->term = fold_known(inst.a);
+        break;
+      case IR_ACC_CONST:
+        st->acc = fold_known(inst.a);
+        break;
+      case IR_MEM_CONST:
+        st->memory = fold_known(inst.a);
+        break;
+      case IR_APPLY_CONST: {
+        FoldValue term = st->term;
+        st->term = fold_known(inst.b);
+        fold_apply(st, (Op)inst.a, false, clears_term);
+        if (inst.a == PLUS || inst.a == MINUS) {
+          st->term = term;  // 加減算は %eax を変えない
+        }
+        break;
+      }
+      case IR_MEM_CLEAR:
+      case IR_MEM_RECALL:
+      case IR_MEM_ADD:
+      case IR_MEM_SUB:
+        fold_memory(st, inst);
+        break;
+      case IR_LOAD_VAR:
+        if (st->vars[inst.a].known) {
+          st->term = fold_known(st->vars[inst.a].value);
+          break;
+        }
+        ir_append(&st->out, inst.op, inst.a, inst.b);
+        st->term = fold_unknown();
+        st->term.sourced = true;
+        st->term.source = inst;
+        st->term.epoch = st->var_epoch;
+        break;
+      case IR_LOAD_ARG:
+        ir_append(&st->out, inst.op, inst.a, inst.b);
+        st->term = fold_unknown();
+        st->term.sourced = true;
+        st->term.source = inst;
+        break;
+      case IR_STORE_VAR:
+        fold_materialize(&st->out, &st->acc, IR_ACC_CONST);
+        ir_append(&st->out, inst.op, inst.a, inst.b);
+        fold_set_var(st, inst.a, (FoldVar){st->acc.known, st->acc.value});
+        st->var_epoch++;
+        break;
+      case IR_NEST_BEGIN:
+      case IR_CALL_BEGIN:
+        saved = grow_array(saved, saved_count, &saved_capacity, sizeof(FoldValue));
+        begins = grow_array(begins, saved_count, &begin_capacity, sizeof(size_t));
+        saved[saved_count] = st->acc;
+        begins[saved_count++] = inst.op == IR_NEST_BEGIN ? st->out.count : SIZE_MAX;
+        if (inst.op == IR_CALL_BEGIN) {
+          calls = grow_array(calls, call_count, &call_capacity, sizeof(FoldCall));
+          calls[call_count++] = (FoldCall){st->out.count, arg_count};
+        }
+        ir_append(&st->out, inst.op, inst.a, inst.b);
+        if (inst.op == IR_NEST_BEGIN) {
+          st->term = st->acc = fold_known(0);
+          st->term.held = st->acc.held = true;
+        }
+        break;
+      case IR_NEST_END:
+        if (saved_count == 0 || begins[saved_count - 1] == SIZE_MAX) {
+          // 対応しない ) (入力の誤り) はそのまま出す
+          fold_materialize(&st->out, &st->acc, IR_ACC_CONST);
+          ir_append(&st->out, inst.op, inst.a, inst.b);
+          st->term = st->acc = fold_unknown();
+          break;
+        }
+        st->term = st->acc;
+        st->term.sourced = false;
+        st->acc = saved[--saved_count];
+        if (st->out.count == begins[saved_count] + 1) {
+          // 中身をすべて計算できた入れ子は積み下ろしごと消す
+          st->out.count--;
+          st->term.held = false;
+        } else {
+          ir_append(&st->out, inst.op, inst.a, inst.b);
+        }
+        break;
+      case IR_ARG_BEGIN:
+        args = grow_array(args, arg_count, &arg_capacity, sizeof(FoldArg));
+        args[arg_count++] = (FoldArg){st->out.count, false, 0};
+        ir_append(&st->out, inst.op, inst.a, inst.b);
+        break;
+      case IR_PUSH_ARG:
+        if (call_count > 0 && arg_count > calls[call_count - 1].arg_base) {
+          args[arg_count - 1].known = st->term.known;
+          args[arg_count - 1].value = st->term.value;
+        }
+        fold_materialize(&st->out, &st->term, IR_TERM_CONST);
+        ir_append(&st->out, inst.op, inst.a, inst.b);
+        break;
+      case IR_CALL: {
+        FoldCall call = call_count > 0 ? calls[--call_count] : (FoldCall){0, arg_count};
+        bool complete = arg_count - call.arg_base == (size_t)inst.b;
+        arg_count = call.arg_base;
+        if (evaluable && complete && saved_count > 0) {
+          if (fold_evaluate(st, call, &args[call.arg_base], inst) ||
+              fold_select(st, call, &args[call.arg_base], inst, evaluable)) {
+            st->acc = saved[--saved_count];
+            break;
+          }
+          if (!cold) {
+            fold_specialize(st, call, &args[call.arg_base], &inst);
+          }
+        }
+        unsigned effects = inst_effects(&inst, in_function);
+        if (effects & (EFFECT_READ_MEMORY | EFFECT_WRITE_MEMORY)) {
+          fold_materialize(&st->out, &st->memory, IR_MEM_CONST);
+        }
+        ir_append(&st->out, inst.op, inst.a, inst.b);
+        if (effects & EFFECT_WRITE_VAR) {
+          st->var_epoch++;
+          fold_forget_vars(st);
+        }
+        if (effects & EFFECT_WRITE_MEMORY) {
+          st->memory = fold_unknown();
+        }
+        st->term = fold_unknown();
+        if (saved_count > 0) {
+          st->acc = saved[--saved_count];
+        }
+        break;
+      }
+      case IR_IF_TEST:
+      case IR_IF_ELSE:
+      case IR_IF_END:
+        next = fold_if(st, ir, i, partner);
+        break;
+      case IR_STEP:
+        ir_append(&st->out, inst.op, inst.a, inst.b);
+        st->acc = fold_unknown();
+        break;
+      default:
+        fold_materialize(&st->out, &st->term, IR_TERM_CONST);
+        fold_materialize(&st->out, &st->acc, IR_ACC_CONST);
+        fold_materialize(&st->out, &st->memory, IR_MEM_CONST);
+        ir_append(&st->out, inst.op, inst.a, inst.b);
+        st->term = st->acc = st->memory = fold_unknown();
+        break;
+    }
+    i = next;
+  }
+  // 関数は累積とメモリを返す。最上位の文は値を次の文に引き継ぐ
+  if (in_function) {
+    fold_materialize(&st->out, &st->acc, IR_ACC_CONST);
+    fold_materialize(&st->out, &st->memory, IR_MEM_CONST);
+  } else {
+    ctx->main_term = st->term;
+    ctx->main_acc = st->acc;
+    ctx->main_memory = st->memory;
+    ctx->main_term.sourced = ctx->main_acc.sourced = false;
+    memcpy(ctx->main_vars, st->vars, sizeof(st->vars));
+  }
+  free(ir->insts);
+  *ir = st->out;
+  free(st->log);
+  free(st->branch_vars);
+  free(st->ifs);
+  free(st);
+  free(partner);
+  free(saved);
+  free(begins);
+  free(calls);
+  free(args);
+}
+
+/**
+ * share_values が値番号ごとに覚えておく、式の形とその性質。
+ */
+typedef struct {
+  uint64_t hash;
+  size_t offset;  // 式の並びの keys での位置
+  size_t length;
+  unsigned reads;  // 値が依存する状態 (EFFECT_READ_*)
+  bool pure;       // 変数・メモリに書き込まない
+  bool costly;     // 桁・乗除算・呼び出しを含み、読み直した方が速い
+  int available;   // 今読み直せる、最後に計算した箇所 (なければ -1)
+} ValueInfo;
+
+/**
+ * 値を計算した箇所 (入れ子か呼び出し 1 つ分の IR の範囲)。
+ */
+typedef struct {
+  int value;
+  size_t begin;
+  size_t end;
+  int uses;  // 読み直す箇所の数
+  int slot;
+  int var_epoch;  // 計算したときの書き込みの回数 (変わっていれば読み直せない)
+  int memory_epoch;
+} ValueSite;
+
+/**
+ * 読み直しに置き換える範囲。
+ */
+typedef struct {
+  size_t begin;
+  size_t end;
+  int site;
+} ValueReuse;
+
+/**
+ * 解析中の入れ子か呼び出しと、それを始めたときの各表の大きさ。
+ */
+typedef struct {
+  size_t begin;
+  size_t token_base;
+  size_t site_base;
+  size_t reuse_base;
+  size_t live_base;
+} OpenValue;
+
+/**
+ * @brief 式の並びのハッシュ値を求める (FNV-1a)。
+ */
+static uint64_t hash_tokens(const IrInst* tokens, size_t count) {
+  uint64_t h = 14695981039346656037u;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t words[3] = {(uint32_t)tokens[i].op, (uint32_t)tokens[i].a, (uint32_t)tokens[i].b};
+    for (int k = 0; k < 3; k++) {
+      h = (h ^ words[k]) * 1099511628211u;
+    }
+  }
+  return h;
+}
+
+/**
+ * @brief 共通部分式をまとめ、2 度目以降の計算を退避した値の読み直しに置き換える。
+ * @param ir 書き換える命令列 (関数本体か最上位の文 1 つ)。
+ * @param in_function 関数本体か。
+ * @return 使う退避領域の数。
+ *
+ * 入れ子 (NEST_BEGIN〜NEST_END) と呼び出し (CALL_BEGIN〜CALL) は項を値にし、
+ * 累積は元に戻すので、同じ形のものは同じ値番号にまとめる。形は直接の命令と
+ * 内側の入れ子・呼び出しの値番号の並びで比べるので、全体を 1 度辿るだけで済む。
+ * 変数・メモリへの書き込みと副作用のある呼び出しを含むものはまとめない。
+ * 変数を読む式は `->` と副作用のある呼び出しの後、メモリを読む式は C/P/M と
+ * 副作用のある呼び出しの後には読み直さない。$if の節の中で計算した値は
+ * その節の中でだけ読み直す。最初の計算の後に IR_SAVE_VALUE で値を退避し、
+ * 同じ値の入れ子・呼び出しを丸ごと IR_LOAD_VALUE に置き換える。
+ */
+static int share_values(IrBuffer* ir, bool in_function) {
+  IrBuffer tokens = {NULL, 0, 0};  // 解析中の入れ子の形 (内側は IR_LOAD_VALUE の値番号)
+  IrBuffer keys = {NULL, 0, 0};    // 値番号ごとの形
+  ValueInfo* values = NULL;
+  size_t value_count = 0, value_capacity = 0;
+  int* buckets = NULL;  // 値番号 + 1 (0 は空き)
+  size_t bucket_count = 0;
+  ValueSite* sites = NULL;
+  size_t site_count = 0, site_capacity = 0;
+  ValueReuse* reuses = NULL;
+  size_t reuse_count = 0, reuse_capacity = 0;
+  OpenValue* opens = NULL;
+  size_t open_count = 0, open_capacity = 0;
+  int* live = NULL;  // 今の $if の節までに計算した箇所 (計算順)
+  size_t live_count = 0, live_capacity = 0;
+  size_t* if_marks = NULL;  // $if ごとの、条件を計算し終えたときの live_count
+  size_t if_count = 0, if_capacity = 0;
+  int var_epoch = 0;
+  int memory_epoch = 0;
+
+  for (size_t i = 0; i < ir->count; i++) {
+    IrInst inst = ir->insts[i];
+    unsigned effects = inst_effects(&inst, in_function);
+    if (effects & EFFECT_WRITE_VAR) {
+      var_epoch++;
+    }
+    if (effects & EFFECT_WRITE_MEMORY) {
+      memory_epoch++;
+    }
+    // ラベル番号と入れ子レベルは形に含めない
+    if (inst.op == IR_NEST_BEGIN || inst.op == IR_IF_TEST || inst.op == IR_IF_ELSE ||
+        inst.op == IR_IF_END) {
+      inst.a = 0;
+    }
+    if (inst.op == IR_NEST_BEGIN || inst.op == IR_CALL_BEGIN) {
+      opens = grow_array(opens, open_count, &open_capacity, sizeof(OpenValue));
+      opens[open_count++] = (OpenValue){i, tokens.count, site_count, reuse_count, live_count};
+    }
+    if (inst.op == IR_IF_TEST) {
+      if_marks = grow_array(if_marks, if_count, &if_capacity, sizeof(size_t));
+      if_marks[if_count++] = live_count;
+    } else if ((inst.op == IR_IF_ELSE || inst.op == IR_IF_END) && if_count > 0) {
+      // 節の中で計算した値は、節を出たら読み直せない
+      size_t mark = if_marks[inst.op == IR_IF_END ? --if_count : if_count - 1];
+      while (live_count > mark) {
+        int k = live[--live_count];
+        if (values[sites[k].value].available == k) {
+          values[sites[k].value].available = -1;
+        }
+      }
+    }
+    if (open_count > 0) {
+      ir_append(&tokens, inst.op, inst.a, inst.b);
+    }
+    if ((inst.op != IR_NEST_END && inst.op != IR_CALL) || open_count == 0) {
+      continue;
+    }
+    OpenValue open = opens[--open_count];
+    const IrInst* shape = &tokens.insts[open.token_base];
+    size_t length = tokens.count - open.token_base;
+    // 形の性質を、直接の命令と内側の値番号から求める
+    unsigned reads = 0;
+    bool pure = true;
+    bool costly = false;
+    for (size_t k = 0; k < length; k++) {
+      if (shape[k].op == IR_LOAD_VALUE) {
+        reads |= values[shape[k].a].reads;
+        pure = pure && values[shape[k].a].pure;
+        costly = costly || values[shape[k].a].costly;
+        continue;
+      }
+      unsigned e = inst_effects(&shape[k], in_function);
+      reads |= e & (EFFECT_READ_VAR | EFFECT_READ_MEMORY);
+      if ((e & (EFFECT_WRITE_VAR | EFFECT_WRITE_MEMORY)) || shape[k].op == IR_ERROR) {
+        pure = false;
+      }
+      if (shape[k].op == IR_DIGIT || shape[k].op == IR_CALL ||
+          ((shape[k].op == IR_APPLY || shape[k].op == IR_APPLY_CONST) && shape[k].a != PLUS &&
+           shape[k].a != MINUS)) {
+        costly = true;
+      }
+    }
+    // 同じ形の値番号を探し、なければ作る
+    uint64_t hash = hash_tokens(shape, length);
+    if (value_count * 2 >= bucket_count) {
+      free(buckets);
+      bucket_count = bucket_count ? bucket_count * 2 : 256;
+      buckets = calloc(bucket_count, sizeof(int));
+      if (!buckets) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+      }
+      for (size_t v = 0; v < value_count; v++) {
+        size_t b = values[v].hash & (bucket_count - 1);
+        while (buckets[b]) {
+          b = (b + 1) & (bucket_count - 1);
+        }
+        buckets[b] = (int)v + 1;
+      }
+    }
+    size_t b = hash & (bucket_count - 1);
+    int value = -1;
+    for (; buckets[b]; b = (b + 1) & (bucket_count - 1)) {
+      const ValueInfo* v = &values[buckets[b] - 1];
+      if (v->hash == hash && v->length == length &&
+          memcmp(&keys.insts[v->offset], shape, length * sizeof(IrInst)) == 0) {
+        value = buckets[b] - 1;
+        break;
+      }
+    }
+    if (value < 0) {
+      values = grow_array(values, value_count, &value_capacity, sizeof(ValueInfo));
+      value = (int)value_count++;
+      values[value] = (ValueInfo){hash, keys.count, length, reads, pure, costly, -1};
+      buckets[b] = value + 1;
+      for (size_t k = 0; k < length; k++) {
+        ir_append(&keys, shape[k].op, shape[k].a, shape[k].b);
+      }
+    }
+    tokens.count = open.token_base;
+    if (open_count > 0) {
+      ir_append(&tokens, IR_LOAD_VALUE, value, 0);
+    }
+    ValueInfo* v = &values[value];
+    if (!v->pure || !v->costly) {
+      continue;
+    }
+    int k = v->available;
+    if (k >= 0 && (!(v->reads & EFFECT_READ_VAR) || sites[k].var_epoch == var_epoch) &&
+        (!(v->reads & EFFECT_READ_MEMORY) || sites[k].memory_epoch == memory_epoch)) {
+      // 内側でまとめた計算と読み直しは、範囲ごと消えるので取り消す
+      for (size_t r = open.reuse_base; r < reuse_count; r++) {
+        sites[reuses[r].site].uses--;
+      }
+      reuse_count = open.reuse_base;
+      for (size_t s = open.site_base; s < site_count; s++) {
+        if (values[sites[s].value].available == (int)s) {
+          values[sites[s].value].available = -1;
+        }
+      }
+      site_count = open.site_base;
+      live_count = open.live_base;
+      sites[k].uses++;
+      reuses = grow_array(reuses, reuse_count, &reuse_capacity, sizeof(ValueReuse));
+      reuses[reuse_count++] = (ValueReuse){open.begin, i, k};
+      continue;
+    }
+    sites = grow_array(sites, site_count, &site_capacity, sizeof(ValueSite));
+    sites[site_count] = (ValueSite){value, open.begin, i, 0, -1, var_epoch, memory_epoch};
+    v->available = (int)site_count;
+    live = grow_array(live, live_count, &live_capacity, sizeof(int));
+    live[live_count++] = (int)site_count++;
+  }
+
+  int slots = 0;
+  if (reuse_count > 0) {
+    for (size_t s = 0; s < site_count; s++) {
+      if (sites[s].uses > 0) {
+        sites[s].slot = slots++;
+      }
+    }
+    IrBuffer out = {NULL, 0, 0};
+    size_t s = 0;
+    size_t r = 0;
+    for (size_t i = 0; i < ir->count; i++) {
+      if (r < reuse_count && reuses[r].begin == i) {
+        ir_append(&out, IR_LOAD_VALUE, sites[reuses[r].site].slot, 0);
+        i = reuses[r++].end;
+        continue;
+      }
+      const IrInst* inst = &ir->insts[i];
+      ir_append(&out, inst->op, inst->a, inst->b);
+      while (s < site_count && sites[s].end < i) {
+        s++;
+      }
+      if (s < site_count && sites[s].end == i && sites[s].uses > 0) {
+        ir_append(&out, IR_SAVE_VALUE, sites[s].slot, 0);
+      }
+    }
+    free(ir->insts);
+    *ir = out;
+  }
+  free(tokens.insts);
+  free(keys.insts);
+  free(values);
+  free(buckets);
+  free(sites);
+  free(reuses);
+  free(opens);
+  free(live);
+  free(if_marks);
+  return slots;
+}
+
+/**
+ * 呼び出しグラフの強連結成分を求める Tarjan 法の作業領域。
+ */
+typedef struct {
+  int index[MAX_FUNC];  // 訪問順 (0 は未訪問)
+  int low[MAX_FUNC];
+  int stack[MAX_FUNC];
+  bool on_stack[MAX_FUNC];
+  int* component;  // 関数番号ごとの成分番号 (結果)
+  int next_index;
+  int depth;
+  int component_count;
+} SccState;
+
+/**
+ * @brief 関数 f から Tarjan 法で強連結成分を求める。
+ */
+static void scc_visit(SccState* st, int f) {
+  st->index[f] = st->low[f] = ++st->next_index;
+  st->stack[st->depth++] = f;
+  st->on_stack[f] = true;
+  const IrBuffer* ir = &ctx->functions[f].ir;
+  for (size_t i = 0; i < ir->count; i++) {
+    if (ir->insts[i].op != IR_CALL) {
+      continue;
+    }
+    int g = ir->insts[i].a;
+    if (!st->index[g]) {
+      scc_visit(st, g);
+      if (st->low[g] < st->low[f]) {
+        st->low[f] = st->low[g];
+      }
+    } else if (st->on_stack[g] && st->index[g] < st->low[f]) {
+      st->low[f] = st->index[g];
+    }
+  }
+  if (st->low[f] == st->index[f]) {
+    int g;
+    do {
+      g = st->stack[--st->depth];
+      st->on_stack[g] = false;
+      st->component[g] = st->component_count;
+    } while (g != f);
+    st->component_count++;
+  }
+}
+
+/**
+ * @brief 呼び出しグラフの強連結成分を求める。
+ * @param component 関数番号ごとの成分番号を受け取る配列。
+ *
+ * f が g を呼ぶとき、g から呼び出しを辿って f に戻れるのは f と g が同じ成分に
+ * あるときに限る。関数ごとに呼び出しを辿り直すと関数の数の 2 乗かかるので、
+ * 全体を 1 度だけ辿る。
+ */
+static void call_graph_components(int* component) {
+  SccState* st = calloc(1, sizeof(SccState));
+  st->component = component;
+  for (int f = 0; f < ctx->function_count; f++) {
+    if (!st->index[f]) {
+      scc_visit(st, f);
+    }
+  }
+  free(st);
+}
+
+/**
+ * @brief 関数本体で隣り合う独立な呼び出しを fork-join に書き換える。
+ *
+ * `@f(...) op @g(...)` の形で、f がメモリにも変数にも触れず、g の呼び出し
+ * (引数を含む) が変数に書き込まない場合、f の呼び出しをタスクとして積み
+ * (IR_SPAWN)、g を評価してから f を待ち合わせる (IR_JOIN)。f の結果の適用は
+ * 待ち合わせの後に移すが、エラーはどの順で起きても E になるだけなので結果は
+ * 変わらない。タスクの管理には呼び出し 1 回よりずっと大きな手間がかかるので、
+ * f の呼び出しが書き換え中の関数に戻ってくる (木構造の再帰になる) 場合に限る。
+ * 最上位の式は即時出力するため対象にしない。
+ */
+void parallelize_calls() {
+  int component[MAX_FUNC];
+  call_graph_components(component);
+  for (int f = 0; f < ctx->function_count; f++) {
+    IrBuffer* ir = &ctx->functions[f].ir;
+    for (size_t i = 0; i + 2 < ir->count; i++) {
+      if (ir->insts[i].op != IR_CALL ||
+          (ctx->functions[ir->insts[i].a].effects & ~EFFECT_READ_VAR) ||
+          ir->insts[i + 1].op != IR_APPLY) {
+        continue;
+      }
+      if (component[ir->insts[i].a] != component[f]) {
+        continue;
+      }
+      size_t begin = i + 2;
+      if (ir->insts[begin].op == IR_TERM_CLEAR) {
+        begin++;
+      }
+      if (begin >= ir->count || ir->insts[begin].op != IR_CALL_BEGIN) {
+        continue;
+      }
+      // 後の兄弟の呼び出しの終わりを探し、変数への書き込みがないことを確かめる
+      size_t end = begin;
+      int depth = 0;
+      bool independent = true;
+      for (; end < ir->count; end++) {
+        const IrInst* inst = &ir->insts[end];
+        if (inst_effects(inst, true) & EFFECT_WRITE_VAR) {
+          independent = false;
+        }
+        if (inst->op == IR_CALL_BEGIN) {
+          depth++;
+        } else if (inst->op == IR_CALL && --depth == 0) {
+          break;
+        }
+      }
+      if (!independent || end == ir->count) {
+        continue;
+      }
+      IrInst call = ir->insts[i];
+      IrInst apply = ir->insts[i + 1];
+      ir->insts[i] = (IrInst){IR_SPAWN, call.a, call.b};
+      ir_remove(ir, i + 1);
+      end--;
+      ir_insert(ir, end + 1, IR_JOIN, call.b, 0);
+      ir_insert(ir, end + 2, apply.op, apply.a, apply.b);
+      ir_insert(ir, end + 3, IR_JOIN_END, call.b, 0);
+      ctx->fork_join_sites++;
+    }
+  }
+}
+
+/**
+ * @brief fork-join の実行時ライブラリを出力する。
+ *
+ * 最初の calc_fj_spawn でオンラインの CPU 数 (環境変数 CALC_FJ_THREADS で変更
+ * できる) のワーカーを用意し、主スレッド以外はスレッドとして起動する。各ワーカーは
+ * Chase-Lev の両端キューを持ち、自分で積んだタスクは底から、他のワーカーのタスクは
+ * 頂上から盗む。待ち合わせ中のワーカーも他のタスクを盗んで実行する。
+ * 入れ子の深さが CALC_FJ_CUTOFF 以上の呼び出しと、ワーカーが 1 つの場合は
+ * タスクを積まずにその場で実行する。
+ *
+ * ワーカー (128 バイト): 0 頂上, 64 底, 72 キューの配列, 80 番号, 88 入れ子の深さ
+ * タスク (FJ_TASK_HEADER バイト + 引数): 0 関数, 8 引数数, 16 状態 (2 で完了),
+ * 24 結果, 28 キューに積んだか, 32 実行時の深さ, 40 呼び出し元の退避領域
+ */
+void finalize_fork_join() {
+  static const char* const lines[] = {
+      ".extern " ASM_EXTERN_GETENV "\n",
+      ".extern " ASM_EXTERN_ATOI "\n",
+      ".extern " ASM_EXTERN_SYSCONF "\n",
+      ".extern " ASM_EXTERN_CALLOC "\n",
+      ".extern " ASM_EXTERN_PTHREAD_CREATE "\n",
+      ".extern " ASM_EXTERN_PTHREAD_KEY_CREATE "\n",
+      ".extern " ASM_EXTERN_PTHREAD_GETSPECIFIC "\n",
+      ".extern " ASM_EXTERN_PTHREAD_SETSPECIFIC "\n",
+      ".extern " ASM_EXTERN_SCHED_YIELD "\n",
+      ".set CALC_FJ_CUTOFF, 16\n",
+      ".set CALC_FJ_CAPACITY, 1024\n",
+      ASM_CSTRING_SECTION "\n",
+      "L_fj_threads_env:\n",
+      ".asciz \"CALC_FJ_THREADS\"\n",
+      ASM_DATA_SECTION "\n",
+      ".p2align 3\n",
+      "L_fj_ready:\n",
+      ".quad 0\n",
+      "L_fj_failed:\n",
+      ".quad 0\n",
+      "L_fj_key:\n",
+      ".quad 0\n",
+      "L_fj_count:\n",
+      ".quad 0\n",
+      "L_fj_workers:\n",
+      ".quad 0\n",
+      ASM_TEXT_SECTION "\n",
+      "L_fj_halt:\n",
+      "pause\n",
+      "jmp L_fj_halt\n",
+      " # ワーカーを用意する (主スレッドから 1 度だけ呼ばれる)\n",
+      "calc_fj_init:\n",
+      "pushq %rbp\n",
+      "movq %rsp, %rbp\n",
+      "pushq %rbx\n",
+      "pushq %r12\n",
+      "movq $1, L_fj_ready(%rip)\n",
+      "leaq L_fj_threads_env(%rip), %rdi\n",
+      "callq " ASM_EXTERN_GETENV "\n",
+      "testq %rax, %rax\n",
+      "je .Lfj_init_default\n",
+      "movq %rax, %rdi\n",
+      "callq " ASM_EXTERN_ATOI "\n",
+      "movslq %eax, %rax\n",
+      "jmp .Lfj_init_count\n",
+      ".Lfj_init_default:\n",
+      "movl $" ASM_SC_NPROCESSORS_ONLN ", %edi\n",
+      "callq " ASM_EXTERN_SYSCONF "\n",
+      ".Lfj_init_count:\n",
+      "movl $1, %ecx\n",
+      "testq %rax, %rax\n",
+      "cmovle %rcx, %rax\n",
+      "movq %rax, L_fj_count(%rip)\n",
+      "movq %rax, %rdi\n",
+      "movl $128, %esi\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je L_overflow\n",
+      "movq %rax, L_fj_workers(%rip)\n",
+      "leaq L_fj_key(%rip), %rdi\n",
+      "xorl %esi, %esi\n",
+      "callq " ASM_EXTERN_PTHREAD_KEY_CREATE "\n",
+      "xorl %ebx, %ebx\n",
+      ".Lfj_init_worker:\n",
+      "cmpq L_fj_count(%rip), %rbx\n",
+      "jae .Lfj_init_done\n",
+      "movq %rbx, %r12\n",
+      "shlq $7, %r12\n",
+      "addq L_fj_workers(%rip), %r12\n",
+      "movq %rbx, 80(%r12)\n",
+      "movl $CALC_FJ_CAPACITY, %edi\n",
+      "movl $8, %esi\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je L_overflow\n",
+      "movq %rax, 72(%r12)\n",
+      "testq %rbx, %rbx\n",
+      "jne .Lfj_init_thread\n",
+      "movq L_fj_key(%rip), %rdi\n",
+      "movq %r12, %rsi\n",
+      "callq " ASM_EXTERN_PTHREAD_SETSPECIFIC "\n",
+      "jmp .Lfj_init_next\n",
+      ".Lfj_init_thread:\n",
+      "subq $16, %rsp\n",
+      "movq %rsp, %rdi\n",
+      "xorl %esi, %esi\n",
+      "leaq calc_fj_worker(%rip), %rdx\n",
+      "movq %r12, %rcx\n",
+      "callq " ASM_EXTERN_PTHREAD_CREATE "\n",
+      "addq $16, %rsp\n",
+      "testl %eax, %eax\n",
+      "jne L_overflow\n",
+      ".Lfj_init_next:\n",
+      "incq %rbx\n",
+      "jmp .Lfj_init_worker\n",
+      ".Lfj_init_done:\n",
+      "popq %r12\n",
+      "popq %rbx\n",
+      "popq %rbp\n",
+      "ret\n",
+      " # 主スレッド以外のワーカー: タスクを盗み続ける\n",
+      "calc_fj_worker:\n",
+      "pushq %rbp\n",
+      "movq %rsp, %rbp\n",
+      "pushq %rbx\n",
+      "subq $8, %rsp\n",
+      "movq %rdi, %rbx\n",
+      "movq L_fj_key(%rip), %rdi\n",
+      "movq %rbx, %rsi\n",
+      "callq " ASM_EXTERN_PTHREAD_SETSPECIFIC "\n",
+      ".Lfj_worker_loop:\n",
+      "movq %rbx, %rdi\n",
+      "callq calc_fj_help\n",
+      "testl %eax, %eax\n",
+      "jnz .Lfj_worker_loop\n",
+      "pause\n",
+      "callq " ASM_EXTERN_SCHED_YIELD "\n",
+      "jmp .Lfj_worker_loop\n",
+      " # タスク %rdi をワーカー %rsi 上で実行し、結果を書いて完了にする\n",
+      "calc_fj_run_task:\n",
+      "pushq %rbp\n",
+      "movq %rsp, %rbp\n",
+      "pushq %rbx\n",
+      "pushq %r12\n",
+      "pushq %r13\n",
+      "pushq %r14\n",
+      " # 引数レジスタは呼び出し先で上書きされるので、タスク・ワーカー・深さは\n",
+      " # -40(%rbp) 以下にも置く\n",
+      "subq $32, %rsp\n",
+      "movq %rdi, %rbx\n",
+      "movq %rsi, %r12\n",
+      "movq 88(%r12), %r13\n",
+      "movq %rbx, -40(%rbp)\n",
+      "movq %r12, -48(%rbp)\n",
+      "movq %r13, -56(%rbp)\n",
+      "movq 32(%rbx), %rax\n",
+      "movq %rax, 88(%r12)\n",
+      " # 引数を呼び出し元が積んだときと同じ並びで積み直す\n",
+      "movq 8(%rbx), %rcx\n",
+      "testb $1, %cl\n",
+      "jz .Lfj_run_aligned\n",
+      "subq $8, %rsp\n",
+      ".Lfj_run_aligned:\n",
+      "leaq 0(,%rcx,8), %rax\n",
+      "subq %rax, %rsp\n",
+      "xorl %edx, %edx\n",
+      ".Lfj_run_copy:\n",
+      "cmpq %rcx, %rdx\n",
+      "jae .Lfj_run_call\n",
+      "movq 48(%rbx,%rdx,8), %rax\n",
+      "movq %rax, (%rsp,%rdx,8)\n",
+      "incq %rdx\n",
+      "jmp .Lfj_run_copy\n",
+      ".Lfj_run_call:\n",
+      " # 先頭の引数はレジスタでも渡す (%rax は第 1 引数の写し)\n",
+      "movq (%rbx), %rsi\n",
+      "leaq -8(%rsp,%rcx,8), %rax\n",
+      "cmpq $1, %rcx\n",
+      "jb .Lfj_run_jump\n",
+      "movl (%rax), " ARG_REGISTER_1 "\n",
+      "cmpq $2, %rcx\n",
+      "jb .Lfj_run_jump\n",
+      "movl -8(%rax), " ARG_REGISTER_2 "\n",
+      "cmpq $3, %rcx\n",
+      "jb .Lfj_run_jump\n",
+      "movl -16(%rax), " ARG_REGISTER_3 "\n",
+      "cmpq $4, %rcx\n",
+      "jb .Lfj_run_jump\n",
+      "movl -24(%rax), " ARG_REGISTER_4 "\n",
+      "cmpq $5, %rcx\n",
+      "jb .Lfj_run_jump\n",
+      "movl -32(%rax), " ARG_REGISTER_5 "\n",
+      "cmpq $6, %rcx\n",
+      "jb .Lfj_run_jump\n",
+      "movl -40(%rax), " ARG_REGISTER_6 "\n",
+      ".Lfj_run_jump:\n",
+      "callq *%rsi\n",
+      "movq -40(%rbp), %rbx\n",
+      "movq -48(%rbp), %r12\n",
+      "movq -56(%rbp), %r13\n",
+      "movl %eax, 24(%rbx)\n",
+      "movq $2, 16(%rbx)\n",
+      "movq %r13, 88(%r12)\n",
+      "leaq -32(%rbp), %rsp\n",
+      "popq %r14\n",
+      "popq %r13\n",
+      "popq %r12\n",
+      "popq %rbx\n",
+      "popq %rbp\n",
+      "ret\n",
+      " # 他のワーカー (ワーカー %rdi の次から順に) のキューの頂上からタスクを盗んで実行する\n",
+      " # 実行したら 1、盗めなければ 0 を返す\n",
+      "calc_fj_help:\n",
+      "pushq %rbp\n",
+      "movq %rsp, %rbp\n",
+      "pushq %rbx\n",
+      "pushq %r12\n",
+      "pushq %r13\n",
+      "pushq %r14\n",
+      "movq %rdi, %r12\n",
+      "movq 80(%r12), %r13\n",
+      "movl $1, %r14d\n",
+      ".Lfj_help_next:\n",
+      "cmpq L_fj_count(%rip), %r14\n",
+      "jae .Lfj_help_none\n",
+      "incq %r14\n",
+      "incq %r13\n",
+      "cmpq L_fj_count(%rip), %r13\n",
+      "jb .Lfj_help_victim\n",
+      "xorl %r13d, %r13d\n",
+      ".Lfj_help_victim:\n",
+      "movq %r13, %rbx\n",
+      "shlq $7, %rbx\n",
+      "addq L_fj_workers(%rip), %rbx\n",
+      "movq (%rbx), %rax\n",
+      "movq 64(%rbx), %rcx\n",
+      "cmpq %rcx, %rax\n",
+      "jge .Lfj_help_next\n",
+      "movq 72(%rbx), %rdx\n",
+      "movq %rax, %rcx\n",
+      "andq $CALC_FJ_CAPACITY - 1, %rcx\n",
+      "movq (%rdx,%rcx,8), %rdi\n",
+      "leaq 1(%rax), %rcx\n",
+      "lock cmpxchgq %rcx, (%rbx)\n",
+      "jne .Lfj_help_next\n",
+      "movq %r12, %rsi\n",
+      "callq calc_fj_run_task\n",
+      "movl $1, %eax\n",
+      "jmp .Lfj_help_done\n",
+      ".Lfj_help_none:\n",
+      "xorl %eax, %eax\n",
+      ".Lfj_help_done:\n",
+      "popq %r14\n",
+      "popq %r13\n",
+      "popq %r12\n",
+      "popq %rbx\n",
+      "popq %rbp\n",
+      "ret\n",
+      " # タスク %rdi を自分のキューの底に積む (打ち切る場合はその場で実行する)\n",
+      "calc_fj_spawn:\n",
+      "pushq %rbp\n",
+      "movq %rsp, %rbp\n",
+      "pushq %rbx\n",
+      "pushq %r11\n",
+      "pushq %r12\n",
+      "pushq %rcx\n",  // ACC_SAVE_REGISTER
+      "movq %rdi, %rbx\n",
+      "movq $0, 16(%rbx)\n",
+      "movl $0, 28(%rbx)\n",
+      "cmpq $0, L_fj_ready(%rip)\n",
+      "jne .Lfj_spawn_ready\n",
+      "callq calc_fj_init\n",
+      ".Lfj_spawn_ready:\n",
+      "movq L_fj_key(%rip), %rdi\n",
+      "callq " ASM_EXTERN_PTHREAD_GETSPECIFIC "\n",
+      "movq %rax, %r12\n",
+      "movq 88(%r12), %rax\n",
+      "movq %rax, 32(%rbx)\n",
+      "cmpq $1, L_fj_count(%rip)\n",
+      "jbe .Lfj_spawn_inline\n",
+      "cmpq $CALC_FJ_CUTOFF, %rax\n",
+      "jae .Lfj_spawn_inline\n",
+      "movq 64(%r12), %rcx\n",
+      "movq %rcx, %rdx\n",
+      "subq (%r12), %rdx\n",
+      "cmpq $CALC_FJ_CAPACITY, %rdx\n",
+      "jae .Lfj_spawn_inline\n",
+      "incq %rax\n",
+      "movq %rax, 32(%rbx)\n",
+      "movq %rax, 88(%r12)\n",
+      "movl $1, 28(%rbx)\n",
+      "movq 72(%r12), %rdx\n",
+      "movq %rcx, %rax\n",
+      "andq $CALC_FJ_CAPACITY - 1, %rax\n",
+      "movq %rbx, (%rdx,%rax,8)\n",
+      "incq %rcx\n",
+      "movq %rcx, 64(%r12)\n",
+      "jmp .Lfj_spawn_done\n",
+      ".Lfj_spawn_inline:\n",
+      "movq %rbx, %rdi\n",
+      "movq %r12, %rsi\n",
+      "callq calc_fj_run_task\n",
+      ".Lfj_spawn_done:\n",
+      "popq %rcx\n",
+      "popq %r12\n",
+      "popq %r11\n",
+      "popq %rbx\n",
+      "popq %rbp\n",
+      "ret\n",
+      " # タスク %rdi の完了を待ち、結果を %eax に返す\n",
+      "calc_fj_join:\n",
+      "pushq %rbp\n",
+      "movq %rsp, %rbp\n",
+      "pushq %rbx\n",
+      "pushq %r11\n",
+      "pushq %r12\n",
+      "pushq %rcx\n",  // ACC_SAVE_REGISTER
+      "movq %rdi, %rbx\n",
+      "cmpl $0, 28(%rbx)\n",
+      "je .Lfj_join_done\n",
+      "movq L_fj_key(%rip), %rdi\n",
+      "callq " ASM_EXTERN_PTHREAD_GETSPECIFIC "\n",
+      "movq %rax, %r12\n",
+      "decq 88(%r12)\n",
+      " # 底から取り出す (盗まれていなければ自分のタスクが出てくる)\n",
+      "movq 64(%r12), %rcx\n",
+      "decq %rcx\n",
+      "movq %rcx, 64(%r12)\n",
+      "mfence\n",
+      "movq (%r12), %rax\n",
+      "cmpq %rcx, %rax\n",
+      "jg .Lfj_join_empty\n",
+      "movq 72(%r12), %rdx\n",
+      "movq %rcx, %rdi\n",
+      "andq $CALC_FJ_CAPACITY - 1, %rdi\n",
+      "movq (%rdx,%rdi,8), %rdi\n",
+      "cmpq %rcx, %rax\n",
+      "jl .Lfj_join_run\n",
+      " # 最後の 1 つは盗みと競合するので頂上を進めて取る\n",
+      "leaq 1(%rax), %rcx\n",
+      "lock cmpxchgq %rcx, (%r12)\n",
+      "movq %rcx, 64(%r12)\n",
+      "jne .Lfj_join_wait\n",
+      ".Lfj_join_run:\n",
+      "movq %r12, %rsi\n",
+      "callq calc_fj_run_task\n",
+      "jmp .Lfj_join_wait\n",
+      ".Lfj_join_empty:\n",
+      "movq %rax, 64(%r12)\n",
+      " # 盗まれたタスクの完了を、他のタスクを手伝いながら待つ\n",
+      ".Lfj_join_wait:\n",
+      "cmpq $2, 16(%rbx)\n",
+      "je .Lfj_join_done\n",
+      "movq %r12, %rdi\n",
+      "callq calc_fj_help\n",
+      "testl %eax, %eax\n",
+      "jnz .Lfj_join_wait\n",
+      "pause\n",
+      "callq " ASM_EXTERN_SCHED_YIELD "\n",
+      "jmp .Lfj_join_wait\n",
+      ".Lfj_join_done:\n",
+      "movl 24(%rbx), %eax\n",
+      "popq %rcx\n",
+      "popq %r12\n",
+      "popq %r11\n",
+      "popq %rbx\n",
+      "popq %rbp\n",
+      "ret\n",
+  };
+  emit_lines(lines, sizeof(lines) / sizeof(lines[0]));
+}
+
+/**
+ * @brief プロファイルの行を種類・持ち主・番号の順に比べる (qsort・bsearch 用)。
+ */
+static int compare_profile_entries(const void* a, const void* b) {
+  const ProfileEntry* x = a;
+  const ProfileEntry* y = b;
+  if (x->kind != y->kind) {
+    return x->kind < y->kind ? -1 : 1;
+  }
+  int c = strcmp(x->owner, y->owner);
+  if (c != 0) {
+    return c;
+  }
+  return (x->ordinal > y->ordinal) - (x->ordinal < y->ordinal);
+}
+
+/**
+ * @brief --profile-generate の実行結果を読み込み、c->profile に置く。
+ * @param c 読み込む先のコンテキスト (前に読み込んだものは捨てる)。
+ * @param path プロファイルのパス。
+ * @return 読めれば true。ファイルがないか、知らない形式の行があれば false。
+ *
+ * 行は `func <関数> <回数>`・`if <持ち主> <番号> <then> <else>`・
+ * `call <持ち主> <番号> <呼び出し先> <回数>` で、# で始まる行は読み飛ばす。
+ * 複数回の実行のプロファイルを連結したファイルも読めるよう、同じ箇所の回数は足す。
+ */
+static bool profile_load(CalcContext* c, const char* path) {
+  free(c->profile);
+  c->profile = NULL;
+  c->profile_count = 0;
+  FILE* in = fopen(path, "r");
+  if (!in) {
+    return false;
+  }
+  size_t capacity = 0;
+  char* line = NULL;
+  size_t line_capacity = 0;
+  bool ok = true;
+  while (getline(&line, &line_capacity, in) >= 0) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '#' || line[0] == '\0') {
+      continue;
+    }
+    ProfileEntry e = {0};
+    char owner[64];
+    if (sscanf(line, "func %63s %ld", owner, &e.counts[0]) == 2) {
+      e.kind = 'f';
+    } else if (sscanf(line, "if %63s %d %ld %ld", owner, &e.ordinal, &e.counts[0],
+                      &e.counts[1]) == 4) {
+      e.kind = 'i';
+    } else if (sscanf(line, "call %63s %d %*s %ld", owner, &e.ordinal, &e.counts[0]) == 3) {
+      e.kind = 'c';
+    } else {
+      ok = false;
+      break;
+    }
+    // 長すぎる名前はどの関数とも一致しない
+    if (strlen(owner) > MAX_IDENTIFIER_LEN) {
+      continue;
+    }
+    strcpy(e.owner, owner);
+    c->profile = grow_array(c->profile, c->profile_count, &capacity, sizeof(ProfileEntry));
+    c->profile[c->profile_count++] = e;
+  }
+  free(line);
+  fclose(in);
+  if (c->profile_count > 0) {
+    qsort(c->profile, c->profile_count, sizeof(ProfileEntry), compare_profile_entries);
+    size_t kept = 1;
+    for (size_t i = 1; i < c->profile_count; i++) {
+      ProfileEntry* last = &c->profile[kept - 1];
+      if (compare_profile_entries(last, &c->profile[i]) == 0) {
+        last->counts[0] += c->profile[i].counts[0];
+        last->counts[1] += c->profile[i].counts[1];
+      } else {
+        c->profile[kept++] = c->profile[i];
+      }
+    }
+    c->profile_count = kept;
+  }
+  return ok;
+}
+
+/**
+ * @brief 読み込んだプロファイルから箇所 1 つの回数を引く。
+ * @return 見つからなければ NULL。
+ */
+static const ProfileEntry* profile_find(char kind, const char* owner, int ordinal) {
+  if (ctx->profile_count == 0) {
+    return NULL;
+  }
+  ProfileEntry key = {kind, "", ordinal, {0, 0}};
+  snprintf(key.owner, sizeof(key.owner), "%s", owner);
+  return bsearch(&key, ctx->profile, ctx->profile_count, sizeof(ProfileEntry),
+                 compare_profile_entries);
+}
+
+/**
+ * @brief プロファイルを取った実行で、関数が一度も呼ばれなかったか。
+ *
+ * プロファイルに載っていない関数 (計測した後に加えたものなど) はわからないので
+ * 呼ばれたものとみなす。
+ */
+static bool profile_is_cold(const FunctionInfo* f) {
+  const ProfileEntry* e = ctx->is_profile_use ? profile_find('f', f->name, 0) : NULL;
+  return e && e->counts[0] == 0;
+}
+
+/**
+ * @brief --profile-generate で数える箇所を 1 つ加え、そのカウンタを割り当てる。
+ * @param width 使うカウンタの数。
+ * @return 最初のカウンタの番号。
+ */
+static int add_profile_site(char kind, int owner, int ordinal, int callee, int width) {
+  ctx->profile_sites = grow_array(ctx->profile_sites, ctx->profile_site_count,
+                                  &ctx->profile_site_capacity, sizeof(ProfileSite));
+  int slot = ctx->profile_slots;
+  ctx->profile_sites[ctx->profile_site_count++] = (ProfileSite){kind, owner, ordinal, callee, slot};
+  ctx->profile_slots += width;
+  return slot;
+}
+
+/**
+ * @brief 変換する直前の命令列の $if と呼び出しを、数える箇所として順に加える。
+ * @param ir 対象の命令列。
+ * @param owner 命令列のある関数番号 (最上位の文なら -1)。
+ * @param ifs 持ち主の中で次に振る $if の番号。加えた分だけ進める。
+ * @param calls 持ち主の中で次に振る呼び出しの番号。加えた分だけ進める。
+ * @return 最初に割り当てたカウンタの番号 (lower_scalar はここから順に使う)。
+ */
+static int record_profile_sites(const IrBuffer* ir, int owner, int* ifs, int* calls) {
+  int base = ctx->profile_slots;
+  for (size_t i = 0; i < ir->count; i++) {
+    const IrInst* inst = &ir->insts[i];
+    if (inst->op == IR_IF_TEST) {
+      add_profile_site('i', owner, (*ifs)++, -1, 2);
+    } else if (inst->op == IR_CALL) {
+      add_profile_site('c', owner, (*calls)++, inst->a, 1);
+    }
+  }
+  return base;
+}
+
+/**
+ * @brief プロファイルで else 節を多く通った $if の節を入れ替える。
+ * @param ir 変換する直前の命令列。
+ * @param owner 命令列のある関数名 (最上位の文なら "-")。
+ * @param ifs 持ち主の中で次に振る $if の番号。命令列の $if の数だけ進める。
+ *
+ * よく通る節を条件判定のすぐ後に置き、分岐せずに進めるようにする。入れ替えた
+ * $if は IF_TEST の b を 1 にし、lower_scalar が飛ぶ条件を逆にする。後ろの
+ * $if から入れ替えるので、入れ子の内側を動かしても外側の位置は変わらない。
+ */
+static void layout_ifs(IrBuffer* ir, const char* owner, int* ifs) {
+  size_t* partner = match_ifs(ir);
+  size_t* tests = NULL;
+  size_t test_count = 0, test_capacity = 0;
+  for (size_t i = 0; i < ir->count; i++) {
+    if (ir->insts[i].op == IR_IF_TEST) {
+      tests = grow_array(tests, test_count, &test_capacity, sizeof(size_t));
+      tests[test_count++] = i;
+    }
+  }
+  int first = *ifs;
+  *ifs += (int)test_count;
+  IrInst* arms = NULL;
+  size_t arm_capacity = 0;
+  for (size_t k = test_count; k-- > 0;) {
+    size_t test = tests[k];
+    size_t mid = partner[test];
+    if (mid == SIZE_MAX || partner[mid] == SIZE_MAX) {
+      continue;
+    }
+    const ProfileEntry* e = profile_find('i', owner, first + (int)k);
+    if (!e || e->counts[1] <= e->counts[0]) {
+      continue;
+    }
+    // then 節・IF_ELSE・else 節を else 節・IF_ELSE・then 節に並べ替える
+    size_t then_count = mid - test - 1;
+    size_t else_count = partner[mid] - mid - 1;
+    size_t count = then_count + 1 + else_count;
+    arms = grow_array(arms, count, &arm_capacity, sizeof(IrInst));
+    memcpy(arms, &ir->insts[test + 1], count * sizeof(IrInst));
+    memcpy(&ir->insts[test + 1], &arms[then_count + 1], else_count * sizeof(IrInst));
+    ir->insts[test + 1 + else_count] = arms[then_count];
+    memcpy(&ir->insts[test + 2 + else_count], arms, then_count * sizeof(IrInst));
+    ir->insts[test].b = 1;
+  }
+  free(arms);
+  free(tests);
+  free(partner);
+}
+
+/**
+ * @brief アセンブリの文字列リテラルとしてそのまま書けるよう、文字列を .asciz で出力する。
+ */
+static void emit_asciz(const char* s) {
+  mprintf(".asciz \"");
+  for (; *s; s++) {
+    unsigned char ch = (unsigned char)*s;
+    if (ch == '"' || ch == '\\') {
+      mprintf("\\%c", ch);
+    } else if (ch < 0x20 || ch >= 0x7f) {
+      mprintf("\\%03o", ch);
+    } else {
+      mprintf("%c", ch);
+    }
+  }
+  mprintf("\"\n");
+}
+
+/**
+ * @brief --profile-generate のカウンタと、それを書き出す calc_profile_write を出力する。
+ *
+ * calc_profile_write は正常に終了するときに main から呼ばれ、数えた箇所ごとに
+ * 1 行を fprintf する (書式の文字列に箇所の名前と番号を埋め込んでおく)。
+ * ファイルを開けなければ何も書かない。E で終了したときは書き出さない。
+ */
+static void finalize_profile() {
+  static const char* const open_lines[] = {
+      ASM_TEXT_SECTION "\n",
+      "calc_profile_write:\n",
+      "pushq %rbx\n",
+      "leaq L_prof_path(%rip), %rdi\n",
+      "leaq L_prof_mode(%rip), %rsi\n",
+      "callq " ASM_EXTERN_FOPEN "\n",
+      "testq %rax, %rax\n",
+      "jz .L_prof_done\n",
+      "movq %rax, %rbx\n",
+      "movq %rbx, %rdi\n",
+      "leaq L_prof_head(%rip), %rsi\n",
+      "xorl %eax, %eax\n",
+      "callq " ASM_EXTERN_FPRINTF "\n",
+  };
+  static const char* const close_lines[] = {
+      "movq %rbx, %rdi\n",
+      "callq " ASM_EXTERN_FCLOSE "\n",
+      ".L_prof_done:\n",
+      "popq %rbx\n",
+      "ret\n",
+  };
+  emit_lines(open_lines, sizeof(open_lines) / sizeof(open_lines[0]));
+  for (size_t i = 0; i < ctx->profile_site_count; i++) {
+    const ProfileSite* site = &ctx->profile_sites[i];
+    mprintf("movq %%rbx, %%rdi\n");
+    mprintf("leaq L_prof_fmt_%zu(%%rip), %%rsi\n", i);
+    mprintf("movq L_prof_counts+%d(%%rip), %%rdx\n", site->slot * 8);
+    if (site->kind == 'i') {
+      mprintf("movq L_prof_counts+%d(%%rip), %%rcx\n", (site->slot + 1) * 8);
+    }
+    mprintf("xorl %%eax, %%eax\n");
+    mprintf("callq " ASM_EXTERN_FPRINTF "\n");
+  }
+  emit_lines(close_lines, sizeof(close_lines) / sizeof(close_lines[0]));
+
+  mprintf(ASM_CSTRING_SECTION "\n");
+  mprintf("L_prof_mode:\n.asciz \"w\"\n");
+  mprintf("L_prof_path:\n");
+  emit_asciz(ctx->profile_generate);
+  mprintf("L_prof_head:\n.asciz \"# calc profile\\n\"\n");
+  for (size_t i = 0; i < ctx->profile_site_count; i++) {
+    const ProfileSite* site = &ctx->profile_sites[i];
+    const char* owner = site->owner < 0 ? "-" : ctx->functions[site->owner].name;
+    mprintf("L_prof_fmt_%zu:\n", i);
+    switch (site->kind) {
+      case 'f':
+        mprintf(".asciz \"func %s %%ld\\n\"\n", owner);
+        break;
+      case 'i':
+        mprintf(".asciz \"if %s %d %%ld %%ld\\n\"\n", owner, site->ordinal);
+        break;
+      default:
+        mprintf(".asciz \"call %s %d %s %%ld\\n\"\n", owner, site->ordinal,
+                ctx->functions[site->callee].name);
+        break;
+    }
+  }
+  mprintf(ASM_DATA_SECTION "\n");
+  mprintf(".p2align 3\n");
+  mprintf("L_prof_counts:\n .space %d\n", (ctx->profile_slots > 0 ? ctx->profile_slots : 1) * 8);
+}
+
+/**
+ * @brief 補助ルーチン (mul32 など) を 1 つ出力する。
+ * @param name ルーチン名。
+ * @param body 本体。最後に ret を付ける。
+ * @param count body の行数。
+ *
+ * 補助ルーチンは積んだ値を自分で戻し、スタックの整列も要らないので、
+ * --keep-frames のときだけフレームを作る。
+ */
+static void emit_routine(const char* name, const char* const* body, size_t count) {
+  mprintf(".globl %s\n", name);
+  mprintf("%s:\n", name);
+  if (ctx->is_keep_frames) {
+    mprintf("pushq %%rbp\n");
+    mprintf("movq %%rsp, %%rbp\n");
+  }
+  emit_lines(body, count);
+  if (ctx->is_keep_frames) {
+    mprintf("leave\n");
+  }
+  mprintf("ret\n");
+}
+
+/**
+ * @brief 計算結果およびエラー表示、サポート関数定義まで含めた終端コードを生成する。
+ */
+void finalize() {
+  static const char* const exit_lines[] = {
+      "movl %edx, %esi\n",
+      "leaq L_fmt(%rip), %rdi\n",
+      "movl $0, %eax\n",
+      "callq " ASM_EXTERN_PRINTF "\n",
+      "xorl %eax, %eax\n",
+      "movq -8(%rbp), %rbx\n",
+      "movq -16(%rbp), %r12\n",
+      "movq -24(%rbp), %r13\n",
+      "movq -32(%rbp), %r14\n",
+      "movq -40(%rbp), %r15\n",
+      "leave\n",
+      "ret\n",
+      "L_overflow:\n",
+  };
+  // libc を使わず、結果を 10 進に変換して write し、exit_group で終了する
+  static const char* const freestanding_lines[] = {
+      "movl %edx, %edi\n",
+      "callq calc_print_int\n",
+      "xorl %edi, %edi\n",
+      "movl $" ASM_SYS_EXIT_GROUP ", %eax\n",
+      "syscall\n",
+      "L_overflow:\n",
+      "movl $1, %edi\n",
+      "leaq L_err(%rip), %rsi\n",
+      "movl $2, %edx\n",
+      "movl $" ASM_SYS_WRITE ", %eax\n",
+      "syscall\n",
+      "movl $1, %edi\n",
+      "movl $" ASM_SYS_EXIT_GROUP ", %eax\n",
+      "syscall\n",
+      " # %edi を 10 進で改行付きで書き出す (桁は div32 で取り出す)\n",
+      "calc_print_int:\n",
+      "pushq %rbp\n",
+      "movq %rsp, %rbp\n",
+      "pushq %rbx\n",
+      "pushq %r12\n",
+      "subq $32, %rsp\n",
+      "leaq -17(%rbp), %rbx\n",
+      "movb $10, (%rbx)\n",
+      "movl %edi, %r12d\n",
+      " # INT_MIN も扱えるよう負の値のまま割っていく\n",
+      "testl %edi, %edi\n",
+      "jle .Lprint_int_loop\n",
+      "negl %edi\n",
+      ".Lprint_int_loop:\n",
+      "movl $10, %esi\n",
+      "callq div32\n",
+      "negl %edx\n",
+      "addb $48, %dl\n",
+      "decq %rbx\n",
+      "movb %dl, (%rbx)\n",
+      "movl %eax, %edi\n",
+      "testl %eax, %eax\n",
+      "jnz .Lprint_int_loop\n",
+      "testl %r12d, %r12d\n",
+      "jns .Lprint_int_write\n",
+      "decq %rbx\n",
+      "movb $45, (%rbx)\n",
+      ".Lprint_int_write:\n",
+      "movl $1, %edi\n",
+      "movq %rbx, %rsi\n",
+      "leaq -16(%rbp), %rdx\n",
+      "subq %rbx, %rdx\n",
+      "movl $" ASM_SYS_WRITE ", %eax\n",
+      "syscall\n",
+      "leaq -16(%rbp), %rsp\n",
+      "popq %r12\n",
+      "popq %rbx\n",
+      "popq %rbp\n",
+      "ret\n",
+  };
+  // 結果を %ebx (main が退避して最後に戻す) に置いたまま、プロファイルを書き出す
+  static const char* const profile_exit_lines[] = {
+      "movl %edx, %ebx\n",
+      "callq calc_profile_write\n",
+      "movl %ebx, %edx\n",
+  };
+  // 複数のスレッドが同時にエラーになっても E は 1 度だけ出力する
+  static const char* const fork_join_guard_lines[] = {
+      "lock btsl $0, L_fj_failed(%rip)\n",
+      "jc L_fj_halt\n",
+  };
+  static const char* const overflow_lines[] = {
+      "andq $-16, %rsp\n",  // フレームのない関数や補助ルーチンからも飛んでくる
+      "leaq L_err(%rip), %rdi\n",
+      "movl $0, %eax\n",
+      "callq " ASM_EXTERN_PRINTF "\n",
+      "leave\n",
+      "movl $1, %edi\n",
+      "callq " ASM_EXTERN_EXIT "\n",
+  };
+  static const char* const div32_lines[] = {
+      "pushq %rdi\n",
+      "pushq %rsi\n", // 割る数
+      "testl %esi, %esi\n",
+      "je L_overflow\n",
+      "cmpl $0x80000000, %edi\n",
+      "jne .L_div32_safe\n",
+      "cmpl $-1, %esi\n",
+      "je L_overflow\n",
+      ".L_div32_safe:\n",
+      "callq abs32\n",
+      "movq %rax, %r8\n",
+      "movq %rsi, %rdi\n",
+      "callq abs32\n",
+      "movq %rax, %r9\n",
+      "xorq %rax, %rax\n",
+      "xorq %rdx, %rdx\n",
+      "movl $32, %esi\n",  // 割る数は退避してあるので、回数に使う (%rcx は呼び出し元に残す)
+      ".p2align 4\n",  // 前に出力する本体の長さで速さが変わらないよう、ループを揃える
+      ".L_div32_loop:\n",
+      "shll $1, %eax\n",
+      "shll $1, %r8d\n",
+      "rcll %edx\n",
+      "cmpl %edx, %r9d\n",
+      "ja .L_div32_skip\n",  // 絶対値は INT_MIN の 0x80000000 もあるので符号なしで比べる
+      "addl $1, %eax\n",
+      "subl %r9d, %edx\n",
+      ".L_div32_skip:\n",
+      "decl %esi\n",
+      "jnz .L_div32_loop\n",
+      "popq %rsi\n",
+      "popq %rdi\n",
+      "testl $0x80000000, %edi\n",
+      "jz .L_div32_quotient_neg\n",
       "negq %rdx\n",
       ".L_div32_quotient_neg:\n",
       "xorl %edi, %esi\n",
@@ -906,12 +5399,8 @@ void finalize() {
       "jz .L_div32_end\n",
       "negq %rax\n",
       ".L_div32_end:\n",
-      "leave\n",
-      "ret\n",
-      ".globl mul32\n",
-      "mul32:\n",
-      "pushq %rbp\n",
-      "movq %rsp, %rbp\n",
+  };
+  static const char* const mul32_lines[] = {
       "pushq %rdi\n",
       "pushq %rsi\n",
       "callq abs32\n",
@@ -920,7 +5409,8 @@ void finalize() {
       "callq abs32\n",
       "movq %rax, %r9\n",
       "xorq %rax, %rax\n",
-      "movl $32, %ecx\n",
+      "movl $32, %esi\n",  // div32 と同じく %rcx は使わない
+      ".p2align 4\n",  // div32 と同じくループを揃える
       ".L_mul32_loop:\n",
       "clc\n",
       "rcrl %r9d\n",
@@ -928,7 +5418,7 @@ void finalize() {
       "addq %r8, %rax\n",
       ".L_mul32_skip:\n",
       "shlq $1, %r8\n",
-      "decl %ecx\n",
+      "decl %esi\n",
       "jnz .L_mul32_loop\n",
       "popq %rsi\n",
       "popq %rdi\n",
@@ -937,48 +5427,1678 @@ void finalize() {
       "jz .L_mul32_end\n",
       "negq %rax\n",
       ".L_mul32_end:\n",
-      "movslq %eax, %rdx\n",
-      "cmpq %rdx, %rax\n",
+      "movslq %eax, %r8\n",  // 呼び出し元の %rdx・%rcx を残すため %r8 で比べる
+      "cmpq %r8, %rax\n",
       "jne L_overflow\n",
-      "leave\n",
-      "ret\n",
-      ".globl abs32\n",
-      "abs32:\n",
-      "pushq %rbp\n",
-      "movq %rsp, %rbp\n",
+  };
+  static const char* const abs32_lines[] = {
       "movl %edi, %eax\n",
       "sarl $31, %edi\n",
       "xorl %edi, %eax\n",
       "subl %edi, %eax\n",
-      "leave\n",
-      "ret\n",
   };
-  emit_lines(lines, sizeof(lines) / sizeof(lines[0]));
+  // 最後の文は ; で終わらないので、ここで変換する。関数の定義はもう変わらないので、
+  // 呼び出しの性質を先に求めておけば定数の引数での呼び出しを評価できる
+  analyze_side_effects();
+  ctx->functions_final = true;
+  flush_statement(true);
+  // 評価する呼び出し先に退避領域が現れないよう、すべて畳み込んでからまとめる
+  for (int i = 0; i < ctx->function_count; i++) {
+    FunctionInfo* f = &ctx->functions[i];
+    f->cold = profile_is_cold(f);
+    fold_constants(&f->ir, true, f->cold);
+  }
+  for (int i = 0; i < ctx->function_count; i++) {
+    ctx->functions[i].value_slots = share_values(&ctx->functions[i].ir, true);
+  }
+  if (ctx->is_freestanding) {
+    // fork-join の実行時ライブラリは pthread を使うので並列化しない
+    emit_lines(freestanding_lines, sizeof(freestanding_lines) / sizeof(freestanding_lines[0]));
+  } else {
+    // 計測するときは実行回数を数え漏らさないよう、呼び出しをタスクにしない
+    if (ctx->profile_generate) {
+      emit_lines(profile_exit_lines, sizeof(profile_exit_lines) / sizeof(profile_exit_lines[0]));
+    } else {
+      parallelize_calls();
+    }
+    emit_lines(exit_lines, sizeof(exit_lines) / sizeof(exit_lines[0]));
+    if (ctx->fork_join_sites > 0) {
+      emit_lines(fork_join_guard_lines,
+                 sizeof(fork_join_guard_lines) / sizeof(fork_join_guard_lines[0]));
+    }
+    emit_lines(overflow_lines, sizeof(overflow_lines) / sizeof(overflow_lines[0]));
+  }
+  emit_routine("div32", div32_lines, sizeof(div32_lines) / sizeof(div32_lines[0]));
+  emit_routine("mul32", mul32_lines, sizeof(mul32_lines) / sizeof(mul32_lines[0]));
+  emit_routine("abs32", abs32_lines, sizeof(abs32_lines) / sizeof(abs32_lines[0]));
+  for (int i = 0; i < ctx->function_count; i++) {
+    FunctionInfo* f = &ctx->functions[i];
+    int ifs = 0, calls = 0;
+    if (ctx->profile_generate) {
+      f->profile_base = add_profile_site('f', i, 0, -1, 1);
+      record_profile_sites(&f->ir, i, &ifs, &calls);
+    } else if (ctx->is_profile_use) {
+      layout_ifs(&f->ir, f->name, &ifs);
+    }
+  }
+  analyze_clobbers();
+  for (int i = 0; i < ctx->function_count; i++) {
+    assign_arg_registers(&ctx->functions[i].ir, true);
+  }
   finalize_functions();
+  if (ctx->fork_join_sites > 0) {
+    finalize_fork_join();
+  }
+  if (ctx->profile_generate) {
+    finalize_profile();
+  }
   finalize_variables();
 }
 
+static const VecIsa VEC_AVX2 = {"avx2", "ymm", 8, 32, true};
+static const VecIsa VEC_SSE41 = {"sse41", "xmm", 4, 16, false};
+
+/**
+ * @brief ベクタ命令を dst = src1 op src2 の形で出力する。
+ * @param isa 出力する命令セット。
+ * @param op 先頭の "v" を除いた命令名。
+ * @param src2 第 2 ソースのレジスタ番号。
+ * @param src1 第 1 ソースのレジスタ番号。
+ * @param dst 出力先のレジスタ番号。
+ *
+ * SSE4.1 では 2 オペランド形式に展開する。dst と src2 が同じレジスタの場合は
+ * オペランドを入れ替えるので、可換な命令でだけそう呼び出すこと。
+ */
+static void vop(const VecIsa* isa, const char* op, int src2, int src1, int dst) {
+  if (isa->vex) {
+    mprintf("v%s %%%s%d, %%%s%d, %%%s%d\n", op, isa->reg, src2, isa->reg, src1, isa->reg, dst);
+    return;
+  }
+  if (dst == src2 && dst != src1) {
+    src2 = src1;
+    src1 = dst;
+  }
+  if (dst != src1) {
+    mprintf("movdqa %%%s%d, %%%s%d\n", isa->reg, src1, isa->reg, dst);
+  }
+  mprintf("%s %%%s%d, %%%s%d\n", op, isa->reg, src2, isa->reg, dst);
+}
+
+/**
+ * @brief 即値シフト命令を dst = src op imm の形で出力する。
+ */
+static void vshift(const VecIsa* isa, const char* op, int imm, int src, int dst) {
+  if (isa->vex) {
+    mprintf("v%s $%d, %%%s%d, %%%s%d\n", op, imm, isa->reg, src, isa->reg, dst);
+    return;
+  }
+  if (dst != src) {
+    mprintf("movdqa %%%s%d, %%%s%d\n", isa->reg, src, isa->reg, dst);
+  }
+  mprintf("%s $%d, %%%s%d\n", op, imm, isa->reg, dst);
+}
+
+/**
+ * @brief レジスタ間でベクタをコピーする。
+ */
+static void vmov(const VecIsa* isa, int src, int dst) {
+  if (src != dst) {
+    mprintf("%smovdqa %%%s%d, %%%s%d\n", isa->vex ? "v" : "", isa->reg, src, isa->reg, dst);
+  }
+}
+
+/**
+ * @brief メモリからベクタを読み込む。
+ * @param mem アドレス指定部分の文字列。
+ */
+static void vload(const VecIsa* isa, const char* mem, int dst) {
+  mprintf("%smovdqu %s, %%%s%d\n", isa->vex ? "v" : "", mem, isa->reg, dst);
+}
+
+/**
+ * @brief ベクタをメモリに書き込む。
+ * @param mem アドレス指定部分の文字列。
+ */
+static void vstore(const VecIsa* isa, int src, const char* mem) {
+  mprintf("%smovdqu %%%s%d, %s\n", isa->vex ? "v" : "", isa->reg, src, mem);
+}
+
+/**
+ * @brief ベクタをスタックに積む。
+ */
+static void vpush(const VecIsa* isa, int src) {
+  mprintf("subq $%d, %%rsp\n", isa->bytes);
+  vstore(isa, src, "(%rsp)");
+}
+
+/**
+ * @brief スタックからベクタを取り出す。
+ */
+static void vpop(const VecIsa* isa, int dst) {
+  vload(isa, "(%rsp)", dst);
+  mprintf("addq $%d, %%rsp\n", isa->bytes);
+}
+
+/**
+ * @brief 32 ビット定数を全レーンに複製する。%eax を作業用に使う。
+ */
+static void vbroadcast(const VecIsa* isa, int value, int dst) {
+  mprintf("movl $%d, %%eax\n", value);
+  if (isa->vex) {
+    mprintf("vmovd %%eax, %%xmm%d\n", dst);
+    mprintf("vpbroadcastd %%xmm%d, %%ymm%d\n", dst, dst);
+  } else {
+    mprintf("movd %%eax, %%xmm%d\n", dst);
+    mprintf("pshufd $0, %%xmm%d, %%xmm%d\n", dst, dst);
+  }
+}
+
+/**
+ * @brief mask のうち実行中のレーンをエラーとして記録する。mask は破壊される。
+ */
+static void vrecord_error(const VecIsa* isa, int mask) {
+  vop(isa, "pand", VR_ACTIVE, mask, mask);
+  vop(isa, "por", mask, VR_ERR, VR_ERR);
+}
+
+/**
+ * @brief レーンごとに dst = mask ? a : b を計算する。
+ *
+ * VR_TMP2・VR_TMP3 を作業用に使うので、引数にそれらを渡してはいけない。
+ */
+static void vblend(const VecIsa* isa, int mask, int a, int b, int dst) {
+  vop(isa, "pand", mask, a, VR_TMP2);
+  vop(isa, "pandn", b, mask, VR_TMP3);
+  vop(isa, "por", VR_TMP3, VR_TMP2, dst);
+}
+
+/**
+ * @brief オーバーフロー検出付きで dst = lhs + rhs (sub なら lhs - rhs) を計算する。
+ *
+ * オーバーフローしたレーンはエラーとして記録する。VR_TMP0〜VR_TMP2 を作業用に使う。
+ */
+static void vadd_checked(const VecIsa* isa, bool sub, int lhs, int rhs, int dst) {
+  vop(isa, sub ? "psubd" : "paddd", rhs, lhs, VR_TMP0);
+  if (sub) {
+    // 符号の異なる数の差で、結果の符号が lhs と異なればオーバーフロー
+    vop(isa, "pxor", rhs, lhs, VR_TMP1);
+    vop(isa, "pxor", VR_TMP0, lhs, VR_TMP2);
+  } else {
+    // 結果の符号が両方の入力と異なればオーバーフロー
+    vop(isa, "pxor", VR_TMP0, lhs, VR_TMP1);
+    vop(isa, "pxor", VR_TMP0, rhs, VR_TMP2);
+  }
+  vop(isa, "pand", VR_TMP2, VR_TMP1, VR_TMP1);
+  vshift(isa, "psrad", 31, VR_TMP1, VR_TMP1);
+  vrecord_error(isa, VR_TMP1);
+  vmov(isa, VR_TMP0, dst);
+}
+
+/**
+ * @brief IR 命令列を SIMD 版のアセンブリに変換して出力する。
+ * @param isa 出力する命令セット。
+ * @param ir 変換する命令列。
+ *
+ * 各レーンが 1 行分の計算を受け持つ。$if は両方の節をレーンマスク付きで
+ * 実行し (該当レーンが無ければ飛ばす)、メモリ・変数への書き込みとエラーの
+ * 記録は VR_ACTIVE のレーンだけに行う。
+ */
+static void lower_vector(const VecIsa* isa, const IrBuffer* ir) {
+  char mem[64];
+  for (size_t i = 0; i < ir->count; i++) {
+    const IrInst* inst = &ir->insts[i];
+    switch (inst->op) {
+      case IR_TERM_CLEAR:
+        vop(isa, "pxor", VR_TERM, VR_TERM, VR_TERM);
+        break;
+      case IR_ACC_CLEAR:
+        vop(isa, "pxor", VR_ACC, VR_ACC, VR_ACC);
+        break;
+      case IR_DIGIT: {
+        IrOp prev = i > 0 ? ir->insts[i - 1].op : IR_TERM_CLEAR;
+        if (prev == IR_TERM_CLEAR || prev == IR_NEST_BEGIN) {
+          // 項が 0 から始まる数字はコンパイル時に値を求めて全レーンに配る
+          long long value = 0;
+          bool overflow = false;
+          for (; i < ir->count && ir->insts[i].op == IR_DIGIT; i++) {
+            value = value * ir->insts[i].a + ir->insts[i].b;
+            if (value > 0x7fffffff) {
+              overflow = true;
+            }
+          }
+          i--;
+          if (overflow) {
+            vop(isa, "por", VR_ACTIVE, VR_ERR, VR_ERR);
+          } else {
+            vbroadcast(isa, (int)value, VR_TERM);
+          }
+          break;
+        }
+        vmov(isa, VR_TERM, VR_ARG0);
+        vbroadcast(isa, inst->a, VR_ARG1);
+        mprintf("callq vmul32_%s\n", isa->name);
+        vrecord_error(isa, VR_ARG2);
+        vbroadcast(isa, inst->b, VR_ARG1);
+        vadd_checked(isa, false, VR_ARG0, VR_ARG1, VR_TERM);
+        break;
+      }
+      case IR_APPLY:
+        vmov(isa, VR_TERM, VR_ARG1);
+        if (inst->b == S_MINUS) {
+          // INT_MIN の符号反転はオーバーフロー
+          vop(isa, "pcmpeqd", VR_TMP0, VR_TMP0, VR_TMP0);
+          vshift(isa, "pslld", 31, VR_TMP0, VR_TMP0);
+          vop(isa, "pcmpeqd", VR_ARG1, VR_TMP0, VR_TMP0);
+          vrecord_error(isa, VR_TMP0);
+          vop(isa, "pxor", VR_TMP0, VR_TMP0, VR_TMP0);
+          vop(isa, "psubd", VR_ARG1, VR_TMP0, VR_TMP1);
+          vmov(isa, VR_TMP1, VR_ARG1);
+        }
+        switch (inst->a) {
+          case PLUS:
+          case MINUS:
+            vadd_checked(isa, inst->a == MINUS, VR_ACC, VR_ARG1, VR_ACC);
+            break;
+          case MUL:
+          case DIV:
+          case MOD:
+            vmov(isa, VR_ACC, VR_ARG0);
+            mprintf("callq %s_%s\n", inst->a == MUL ? "vmul32" : "vdiv32", isa->name);
+            vrecord_error(isa, VR_ARG2);
+            vmov(isa, inst->a == MOD ? VR_ARG1 : VR_ARG0, VR_ACC);
+            // スカラー版の mul32・div32 と同じく、積・商を項にも残す
+            vmov(isa, VR_ARG0, VR_TERM);
+            break;
+        }
+        break;
+      case IR_MEM_CLEAR:
+        vop(isa, "pxor", VR_ACC, VR_ACC, VR_ACC);
+        vop(isa, "pandn", VR_MEM, VR_ACTIVE, VR_TMP0);
+        vmov(isa, VR_TMP0, VR_MEM);
+        break;
+      case IR_MEM_RECALL:
+        vmov(isa, VR_MEM, VR_ACC);
+        break;
+      case IR_MEM_ADD:
+      case IR_MEM_SUB:
+        vadd_checked(isa, inst->op == IR_MEM_SUB, VR_MEM, VR_ACC, VR_ARG0);
+        vblend(isa, VR_ACTIVE, VR_ARG0, VR_MEM, VR_MEM);
+        vmov(isa, VR_ARG0, VR_TERM);
+        vop(isa, "pxor", VR_ACC, VR_ACC, VR_ACC);
+        break;
+      case IR_NEST_BEGIN:
+        vpush(isa, VR_ACC);
+        vop(isa, "pxor", VR_ACC, VR_ACC, VR_ACC);
+        vop(isa, "pxor", VR_TERM, VR_TERM, VR_TERM);
+        break;
+      case IR_NEST_END:
+        vmov(isa, VR_ACC, VR_TERM);
+        vpop(isa, VR_ACC);
+        break;
+      case IR_LOAD_VAR:
+        snprintf(mem, sizeof(mem), "%d(%%r12)", inst->a * isa->bytes);
+        vload(isa, mem, VR_TERM);
+        break;
+      case IR_STORE_VAR:
+        snprintf(mem, sizeof(mem), "%d(%%r12)", inst->a * isa->bytes);
+        vload(isa, mem, VR_ARG0);
+        vblend(isa, VR_ACTIVE, VR_ACC, VR_ARG0, VR_ARG0);
+        vstore(isa, VR_ARG0, mem);
+        break;
+      case IR_LOAD_ARG:
+        snprintf(mem, sizeof(mem), "%d(%%rbp)", 16 + (inst->b - inst->a) * isa->bytes);
+        vload(isa, mem, VR_TERM);
+        break;
+      case IR_LOAD_COLUMN:
+        mprintf("movq %d(%%r13), %%rax\n", (inst->a - 1) * 8);
+        vload(isa, "(%rax,%rbx,4)", VR_TERM);
+        break;
+      case IR_CALL_BEGIN:
+        vpush(isa, VR_ACC);
+        break;
+      case IR_ARG_BEGIN:
+        break;
+      case IR_PUSH_ARG:
+        vpush(isa, VR_TERM);
+        break;
+      case IR_CALL:
+        mprintf("callq vfunc_%s_%s\n", isa->name, ctx->functions[inst->a].name);
+        if (inst->b > 0) {
+          mprintf("addq $%d, %%rsp\n", inst->b * isa->bytes);
+        }
+        vpop(isa, VR_ACC);
+        break;
+      case IR_IF_TEST:
+        // 条件が 0 のレーンは else 節、それ以外は then 節を実行する
+        vop(isa, "pxor", VR_TMP0, VR_TMP0, VR_TMP0);
+        vop(isa, "pcmpeqd", VR_TMP0, VR_TERM, VR_TMP0);
+        vop(isa, "pandn", VR_ACTIVE, VR_ERR, VR_TMP1);
+        vop(isa, "pand", VR_TMP0, VR_TMP1, VR_TMP2);
+        vop(isa, "pandn", VR_TMP1, VR_TMP0, VR_TMP3);
+        vpush(isa, VR_ACTIVE);
+        vpush(isa, VR_TMP2);
+        vmov(isa, VR_TMP3, VR_ACTIVE);
+        mprintf("%sptest %%%s%d, %%%s%d\n", isa->vex ? "v" : "", isa->reg, VR_ACTIVE, isa->reg,
+                VR_ACTIVE);
+        mprintf("jz .Lv_%s_then_%d\n", isa->name, inst->a);
+        break;
+      case IR_IF_ELSE:
+        mprintf(".Lv_%s_then_%d:\n", isa->name, inst->a);
+        vpush(isa, VR_TERM);
+        snprintf(mem, sizeof(mem), "%d(%%rsp)", isa->bytes);
+        vload(isa, mem, VR_ACTIVE);
+        mprintf("%sptest %%%s%d, %%%s%d\n", isa->vex ? "v" : "", isa->reg, VR_ACTIVE, isa->reg,
+                VR_ACTIVE);
+        mprintf("jz .Lv_%s_else_%d\n", isa->name, inst->a);
+        break;
+      case IR_IF_END:
+        mprintf(".Lv_%s_else_%d:\n", isa->name, inst->a);
+        vpop(isa, VR_TMP0);
+        vpop(isa, VR_TMP1);
+        vpop(isa, VR_ACTIVE);
+        vblend(isa, VR_TMP1, VR_TERM, VR_TMP0, VR_TERM);
+        break;
+      case IR_ERROR:
+        vop(isa, "por", VR_ACTIVE, VR_ERR, VR_ERR);
+        break;
+      case IR_STEP:
+        vload(isa, "16(%rbp)", VR_ARG0);
+        vop(isa, "pxor", VR_TMP0, VR_TMP0, VR_TMP0);
+        vop(isa, "pcmpgtd", VR_TMP0, VR_ARG0, VR_ACC);
+        vshift(isa, "psrld", 31, VR_ACC, VR_ACC);
+        break;
+      case IR_SPAWN:
+      case IR_JOIN:
+      case IR_JOIN_END:
+        // タスク並列化はスカラー版の関数にだけ行う
+        break;
+      case IR_SAVE_VALUE:
+      case IR_LOAD_VALUE:
+      case IR_TERM_CONST:
+      case IR_ACC_CONST:
+      case IR_APPLY_CONST:
+      case IR_MEM_CONST:
+        // 定数の畳み込みと共通部分式の削除もスカラー版にだけ行う
+        break;
+    }
+  }
+}
+
+/**
+ * @brief 呼び出しを辿り、バッチ評価で使われる関数に印を付ける。
+ * @param ir 調べる命令列。
+ * @param reachable 関数番号ごとの印。
+ */
+static void mark_reachable(const IrBuffer* ir, bool* reachable) {
+  for (size_t i = 0; i < ir->count; i++) {
+    const IrInst* inst = &ir->insts[i];
+    if (inst->op == IR_CALL && !reachable[inst->a]) {
+      reachable[inst->a] = true;
+      mark_reachable(&ctx->functions[inst->a].ir, reachable);
+    }
+  }
+}
+
+/**
+ * @brief 集計モードで、1 反復分の結果を和・最小値・最大値・エラーの行数に畳み込む。
+ *
+ * 和は符号拡張して 64 ビットのレーンで足す (1 かたまりの行数ではあふれない)。
+ * 実行中でないレーンとエラーになったレーンは集計に含めない。
+ */
+static void emit_aggregate_step(const VecIsa* isa) {
+  vop(isa, "pandn", VR_ACTIVE, VR_ERR, VR_TMP0);
+  vop(isa, "pand", VR_TMP0, VR_ACC, VR_TMP1);
+  if (isa->vex) {
+    mprintf("vpmovsxdq %%xmm%d, %%ymm%d\n", VR_TMP1, VR_TMP2);
+    mprintf("vpaddq %%ymm%d, %%ymm%d, %%ymm%d\n", VR_TMP2, VR_SUM0, VR_SUM0);
+    mprintf("vextracti128 $1, %%ymm%d, %%xmm%d\n", VR_TMP1, VR_TMP1);
+    mprintf("vpmovsxdq %%xmm%d, %%ymm%d\n", VR_TMP1, VR_TMP1);
+    mprintf("vpaddq %%ymm%d, %%ymm%d, %%ymm%d\n", VR_TMP1, VR_SUM1, VR_SUM1);
+  } else {
+    mprintf("pmovsxdq %%xmm%d, %%xmm%d\n", VR_TMP1, VR_TMP2);
+    mprintf("paddq %%xmm%d, %%xmm%d\n", VR_TMP2, VR_SUM0);
+    mprintf("pshufd $0xee, %%xmm%d, %%xmm%d\n", VR_TMP1, VR_TMP1);
+    mprintf("pmovsxdq %%xmm%d, %%xmm%d\n", VR_TMP1, VR_TMP1);
+    mprintf("paddq %%xmm%d, %%xmm%d\n", VR_TMP1, VR_SUM1);
+  }
+  vblend(isa, VR_TMP0, VR_ACC, VR_MIN, VR_TMP1);
+  vop(isa, "pminsd", VR_TMP1, VR_MIN, VR_MIN);
+  vblend(isa, VR_TMP0, VR_ACC, VR_MAX, VR_TMP1);
+  vop(isa, "pmaxsd", VR_TMP1, VR_MAX, VR_MAX);
+  // エラーのレーンはまれなので、立っているビットを 1 つずつ数える
+  mprintf("%smovmskps %%%s%d, %%eax\n", isa->vex ? "v" : "", isa->reg, VR_ERR);
+  mprintf("testl %%eax, %%eax\n");
+  mprintf("je .Lk_%s_counted\n", isa->name);
+  mprintf(".Lk_%s_count:\n", isa->name);
+  mprintf("incq %%r15\n");
+  mprintf("leal -1(%%rax), %%ecx\n");
+  mprintf("andl %%ecx, %%eax\n");
+  mprintf("jne .Lk_%s_count\n", isa->name);
+  mprintf(".Lk_%s_counted:\n", isa->name);
+}
+
+/**
+ * @brief フィルタモードで、結果が 0 でない (かつエラーでない) レーンの行番号を
+ * %r14 に左詰めで書き、%r14 を書いた数だけ進める。
+ *
+ * マスクのビット列ごとに、詰めた並びを作る表 (AVX2 は vpermd の添字 L_pack8、
+ * SSE4.1 は pshufb の並べ替え L_pack4) と件数の表 (L_pack_count) を引いて、
+ * 分岐せずにレーン分をまとめて書く。書き込み位置は処理済みの行数を超えないので、
+ * はみ出した分は後で上書きされる同じかたまりの領域に収まる。
+ */
+static void emit_filter_step(const VecIsa* isa) {
+  vop(isa, "pxor", VR_TMP0, VR_TMP0, VR_TMP0);
+  vop(isa, "pcmpeqd", VR_ACC, VR_TMP0, VR_TMP0);
+  vop(isa, "pandn", VR_ACTIVE, VR_TMP0, VR_TMP1);
+  vop(isa, "pandn", VR_TMP1, VR_ERR, VR_TMP0);
+  mprintf("%smovmskps %%%s%d, %%eax\n", isa->vex ? "v" : "", isa->reg, VR_TMP0);
+  mprintf("%smovd %%ebx, %%xmm%d\n", isa->vex ? "v" : "", VR_TMP1);
+  if (isa->vex) {
+    mprintf("vpbroadcastd %%xmm%d, %%ymm%d\n", VR_TMP1, VR_TMP1);
+  } else {
+    mprintf("pshufd $0, %%xmm%d, %%xmm%d\n", VR_TMP1, VR_TMP1);
+  }
+  vload(isa, "L_vlane(%rip)", VR_TMP2);
+  vop(isa, "paddd", VR_TMP2, VR_TMP1, VR_TMP1);
+  mprintf("movl %%eax, %%ecx\n");
+  if (isa->vex) {
+    mprintf("shll $5, %%ecx\n");
+    mprintf("leaq L_pack8(%%rip), %%rdx\n");
+    mprintf("vmovdqa (%%rdx,%%rcx), %%ymm%d\n", VR_TMP2);
+    mprintf("vpermd %%ymm%d, %%ymm%d, %%ymm%d\n", VR_TMP1, VR_TMP2, VR_TMP1);
+  } else {
+    mprintf("shll $4, %%ecx\n");
+    mprintf("leaq L_pack4(%%rip), %%rdx\n");
+    mprintf("pshufb (%%rdx,%%rcx), %%xmm%d\n", VR_TMP1);
+  }
+  vstore(isa, VR_TMP1, "(%r14)");
+  mprintf("leaq L_pack_count(%%rip), %%rdx\n");
+  mprintf("movzbl (%%rdx,%%rax), %%eax\n");
+  mprintf("leaq (%%r14,%%rax,4), %%r14\n");
+}
+
+/**
+ * @brief 集計モードで、レーンごとの集計をまとめてかたまりの部分集計 (%r14) に書く。
+ *
+ * 部分集計は 32 バイトで、和 (int64)、最小値 (int32)、最大値 (int32)、
+ * エラーの行数 (int64) の順に並ぶ。
+ */
+static void emit_aggregate_store(const VecIsa* isa) {
+  static const char* const reduce_ops[] = {"paddq", "pminsd", "pmaxsd"};
+  static const int reduce_regs[] = {VR_SUM0, VR_MIN, VR_MAX};
+  const char* v = isa->vex ? "v" : "";
+  vop(isa, "paddq", VR_SUM1, VR_SUM0, VR_SUM0);
+  for (int i = 0; i < 3; i++) {
+    int r = reduce_regs[i];
+    if (isa->vex) {
+      mprintf("vextracti128 $1, %%ymm%d, %%xmm%d\n", r, VR_TMP0);
+      mprintf("v%s %%xmm%d, %%xmm%d, %%xmm%d\n", reduce_ops[i], VR_TMP0, r, r);
+    }
+    mprintf("%spshufd $0xee, %%xmm%d, %%xmm%d\n", v, r, VR_TMP0);
+    if (isa->vex) {
+      mprintf("v%s %%xmm%d, %%xmm%d, %%xmm%d\n", reduce_ops[i], VR_TMP0, r, r);
+    } else {
+      mprintf("%s %%xmm%d, %%xmm%d\n", reduce_ops[i], VR_TMP0, r);
+    }
+    if (r != VR_SUM0) {
+      mprintf("%spshufd $0x55, %%xmm%d, %%xmm%d\n", v, r, VR_TMP0);
+      if (isa->vex) {
+        mprintf("v%s %%xmm%d, %%xmm%d, %%xmm%d\n", reduce_ops[i], VR_TMP0, r, r);
+      } else {
+        mprintf("%s %%xmm%d, %%xmm%d\n", reduce_ops[i], VR_TMP0, r);
+      }
+    }
+  }
+  mprintf("%smovq %%xmm%d, (%%r14)\n", v, VR_SUM0);
+  mprintf("%smovd %%xmm%d, 8(%%r14)\n", v, VR_MIN);
+  mprintf("%smovd %%xmm%d, 12(%%r14)\n", v, VR_MAX);
+  mprintf("movq %%r15, 16(%%r14)\n");
+}
+
+/**
+ * @brief 最上位の式を SIMD カーネルとして出力する。
+ * @param isa 出力する命令セット。
+ *
+ * calc_kernel_<isa>(cols, out, errbits, begin, end) は begin 行目から end 行目の手前までを
+ * 処理し (begin は 8 の倍数、配列は 8 の倍数の行数分確保しておく)、結果を out に、
+ * エラーになった行のビットを errbits に立てる。列 k の入力は cols[k - 1] が指す
+ * int32 配列。変数は行ごとに 0 から始まるので、スタック上の領域 (%r12) に
+ * レーン分ずつ置く。書き込む状態はすべてスタックとレジスタにあるので、
+ * 別々の行範囲なら複数のスレッドから同時に呼び出せる。
+ */
+static void emit_batch_kernel(const VecIsa* isa) {
+  mprintf(ASM_TEXT_SECTION "\n");
+  mprintf("calc_kernel_%s:\n", isa->name);
+  mprintf("pushq %%rbp\n");
+  mprintf("movq %%rsp, %%rbp\n");
+  mprintf("pushq %%rbx\n");
+  mprintf("pushq %%r12\n");
+  mprintf("pushq %%r13\n");
+  mprintf("pushq %%r14\n");
+  mprintf("pushq %%r15\n");
+  mprintf("pushq %%r8\n");  // -48(%rbp): 処理を終える行
+  // 関数の SIMD 版はこれより深くスタックを使わない (%r11 はカーネルの中で他に使わない)
+  mprintf("movq %%rsp, %%r11\n");
+  mprintf("subq $CALC_BATCH_STACK_LIMIT, %%r11\n");
+  mprintf("movq %%rdi, %%r13\n");
+  mprintf("movq %%rsi, %%r14\n");
+  mprintf("movq %%rdx, %%r15\n");
+  mprintf("movq %%rcx, %%rbx\n");
+  if (ctx->is_aggregate) {
+    // out はかたまりごとの部分集計の配列、%r15 はエラーの行数にする
+    mprintf("shrq $CALC_BATCH_CHUNK_SHIFT, %%rcx\n");
+    mprintf("shlq $5, %%rcx\n");
+    mprintf("addq %%rcx, %%r14\n");
+    mprintf("xorl %%r15d, %%r15d\n");
+    vop(isa, "pxor", VR_SUM0, VR_SUM0, VR_SUM0);
+    vop(isa, "pxor", VR_SUM1, VR_SUM1, VR_SUM1);
+    vbroadcast(isa, 0x7fffffff, VR_MIN);
+    vbroadcast(isa, -0x7fffffff - 1, VR_MAX);
+  }
+  if (ctx->is_filter) {
+    // out の begin 行目からを通った行番号の書き込み先 (%r14) に、errbits を
+    // かたまりごとの通った行数の配列 (%r15 はこのかたまりの要素) にする
+    mprintf("leaq (%%r14,%%rcx,4), %%r14\n");
+    mprintf("pushq %%r14\n");  // -56(%rbp): 書き込みの開始位置
+    mprintf("shrq $CALC_BATCH_CHUNK_SHIFT, %%rcx\n");
+    mprintf("leaq (%%r15,%%rcx,8), %%r15\n");
+  }
+  mprintf("subq $%d, %%rsp\n", ctx->variable_count * isa->bytes);
+  mprintf("movq %%rsp, %%r12\n");
+  mprintf(".Lk_%s_loop:\n", isa->name);
+  mprintf("cmpq -48(%%rbp), %%rbx\n");
+  mprintf("jae .Lk_%s_done\n", isa->name);
+  // 末尾の埋め草のレーンは実行しない (0 を入れた再帰関数が止まらないことがある)
+  mprintf("movl -48(%%rbp), %%eax\n");
+  mprintf("subl %%ebx, %%eax\n");
+  mprintf("%smovd %%eax, %%xmm%d\n", isa->vex ? "v" : "", VR_TMP0);
+  if (isa->vex) {
+    mprintf("vpbroadcastd %%xmm%d, %%ymm%d\n", VR_TMP0, VR_TMP0);
+  } else {
+    mprintf("pshufd $0, %%xmm%d, %%xmm%d\n", VR_TMP0, VR_TMP0);
+  }
+  vload(isa, "L_vlane(%rip)", VR_TMP1);
+  vop(isa, "pcmpgtd", VR_TMP1, VR_TMP0, VR_ACTIVE);
+  vop(isa, "pxor", VR_ERR, VR_ERR, VR_ERR);
+  vop(isa, "pxor", VR_MEM, VR_MEM, VR_MEM);
+  vop(isa, "pxor", VR_TERM, VR_TERM, VR_TERM);
+  vop(isa, "pxor", VR_ACC, VR_ACC, VR_ACC);
+  for (int i = 0; i < ctx->variable_count; i++) {
+    char mem[32];
+    snprintf(mem, sizeof(mem), "%d(%%r12)", i * isa->bytes);
+    vstore(isa, VR_ERR, mem);
+  }
+  lower_vector(isa, &ctx->main_ir);
+  if (ctx->is_aggregate) {
+    emit_aggregate_step(isa);
+  } else if (ctx->is_filter) {
+    emit_filter_step(isa);
+  } else {
+    vstore(isa, VR_ACC, "(%r14,%rbx,4)");
+    // エラーになったレーンを errbits の対応するビットに立てる
+    mprintf("%smovmskps %%%s%d, %%eax\n", isa->vex ? "v" : "", isa->reg, VR_ERR);
+    if (isa->lanes < 8) {
+      mprintf("movl %%ebx, %%ecx\n");
+      mprintf("andl $7, %%ecx\n");
+      mprintf("shll %%cl, %%eax\n");
+    }
+    mprintf("movq %%rbx, %%rcx\n");
+    mprintf("shrq $3, %%rcx\n");
+    mprintf("orb %%al, (%%r15,%%rcx)\n");
+  }
+  mprintf("addq $%d, %%rbx\n", isa->lanes);
+  mprintf("jmp .Lk_%s_loop\n", isa->name);
+  mprintf(".Lk_%s_done:\n", isa->name);
+  if (ctx->is_aggregate) {
+    emit_aggregate_store(isa);
+  }
+  if (ctx->is_filter) {
+    mprintf("movq %%r14, %%rax\n");
+    mprintf("subq -56(%%rbp), %%rax\n");
+    mprintf("shrq $2, %%rax\n");
+    mprintf("movq %%rax, (%%r15)\n");
+  }
+  if (isa->vex) {
+    mprintf("vzeroupper\n");
+  }
+  mprintf("leaq -40(%%rbp), %%rsp\n");
+  mprintf("popq %%r15\n");
+  mprintf("popq %%r14\n");
+  mprintf("popq %%r13\n");
+  mprintf("popq %%r12\n");
+  mprintf("popq %%rbx\n");
+  mprintf("popq %%rbp\n");
+  mprintf("ret\n");
+}
+
+/**
+ * @brief 関数の SIMD 版を出力する。引数は 1 本ずつベクタでスタックに積まれる。
+ *
+ * 再帰がカーネルの決めた限度 (%r11) より深くスタックを使うと、実行中のレーンを
+ * エラーにしてそれ以上呼ばずに戻る。
+ */
+static void emit_vector_function(const VecIsa* isa, const FunctionInfo* f) {
+  mprintf(ASM_TEXT_SECTION "\n");
+  mprintf("vfunc_%s_%s:\n", isa->name, f->name);
+  mprintf("pushq %%rbp\n");
+  mprintf("movq %%rsp, %%rbp\n");
+  mprintf("cmpq %%r11, %%rsp\n");
+  mprintf("jb .Lv_%s_deep_%s\n", isa->name, f->name);
+  vop(isa, "pxor", VR_TERM, VR_TERM, VR_TERM);
+  vop(isa, "pxor", VR_ACC, VR_ACC, VR_ACC);
+  lower_vector(isa, &f->ir);
+  vmov(isa, VR_ACC, VR_TERM);
+  mprintf("leave\n");
+  mprintf("ret\n");
+  mprintf(".Lv_%s_deep_%s:\n", isa->name, f->name);
+  vop(isa, "por", VR_ACTIVE, VR_ERR, VR_ERR);
+  vop(isa, "pxor", VR_TERM, VR_TERM, VR_TERM);
+  mprintf("leave\n");
+  mprintf("ret\n");
+}
+
+/**
+ * @brief バッチモードの実行時ライブラリ、SIMD カーネル、関数の SIMD 版を出力する。
+ *
+ * 生成されるプログラムは標準入力から 1 行に列数分の整数 (空白・改行・カンマ区切り)
+ * を読み、各行について式を評価した結果 (またはエラーの E) を 1 行ずつ出力する。
+ * カーネルは AVX2 (8 レーン) と SSE4.1 (4 レーン) の両方を出力し、実行時に
+ * CPU に合わせて選ぶ。環境変数 CALC_BATCH_ISA=sse41 で SSE4.1 版を強制できる。
+ * 入力は read(2) でまとめて読んで SSE で数字を分類しながら解析し、出力も
+ * 1 つのバッファに 10 進数を並べてから write(2) でまとめて書く。
+ *
+ * 行は CALC_BATCH_CHUNK 行ずつのかたまりに分け、オンラインの CPU 数 (環境変数
+ * CALC_BATCH_THREADS で変更できる) のスレッドがカウンタを lock xadd で進めながら
+ * 取り合う。結果は行番号の位置に書くので、全スレッドを join してから順に出力する。
+ *
+ * `prog 入力 出力` と 2 つのファイルを渡すと、入力を 1 行に列数分の int32 が並ぶ
+ * バイナリとして mmap し、出力ファイルを「int32 の結果 × 行数」と「エラーの行の
+ * ビットマップ ((行数 + 7) / 8 バイト)」の大きさに揃えて mmap して、カーネルが
+ * 直接書き込む (1 列なら入力も並べ替えずにそのまま渡す)。ベクタの末尾のはみ出しは
+ * ページの切り上げの範囲に収まり、ビットマップは全カーネルの終了後に書き写す。
+ *
+ * --aggregate (CALC_BATCH_AGGREGATE) では行ごとの結果を配列に書かず、カーネルが
+ * かたまりごとに和・最小値・最大値・エラーの行数を部分集計に畳み込み、join 後に
+ * それらをまとめて出力する。和は 64 ビットで、あふれたら E を出す。mmap モードは
+ * `prog 入力` の 1 引数になる。
+ *
+ * --filter / --filter-index (CALC_BATCH_FILTER) では式を行の選択条件として使い、
+ * 結果が 0 でなくエラーでもない行だけを、入力の形 (カンマ区切り) か行番号で出す。
+ * カーネルは通った行番号を表引きの並べ替えで分岐せずに左詰めし、かたまりごとに
+ * 件数を残す。mmap モードは集計と同じく `prog 入力` になる。
+ */
+void finalize_batch() {
+  static const char* const runtime_lines[] = {
+      ".extern " ASM_EXTERN_READ "\n",
+      ".extern " ASM_EXTERN_WRITE "\n",
+      ".extern " ASM_EXTERN_CALLOC "\n",
+      ".extern " ASM_EXTERN_REALLOC "\n",
+      ".extern " ASM_EXTERN_GETENV "\n",
+      ".extern " ASM_EXTERN_ATOI "\n",
+      ".extern " ASM_EXTERN_SYSCONF "\n",
+      ".extern " ASM_EXTERN_PTHREAD_CREATE "\n",
+      ".extern " ASM_EXTERN_PTHREAD_JOIN "\n",
+      ".extern " ASM_EXTERN_PTHREAD_ATTR_INIT "\n",
+      ".extern " ASM_EXTERN_PTHREAD_ATTR_SETSTACKSIZE "\n",
+      ".extern " ASM_EXTERN_OPEN "\n",
+      ".extern " ASM_EXTERN_LSEEK "\n",
+      ".extern " ASM_EXTERN_MMAP "\n",
+      ".extern " ASM_EXTERN_FTRUNCATE "\n",
+      ".set CALC_BATCH_CHUNK_SHIFT, 12\n",
+      ".set CALC_BATCH_CHUNK, 1 << CALC_BATCH_CHUNK_SHIFT\n",
+      // ワーカーのスタックの大きさと、関数の SIMD 版が使ってよい深さ (残りはカーネルと実行時ライブラリの分)
+      ".set CALC_BATCH_STACK, 1 << 26\n",
+      ".set CALC_BATCH_STACK_LIMIT, CALC_BATCH_STACK - (1 << 20)\n",
+      ASM_CSTRING_SECTION "\n",
+      "L_isa_env:\n",
+      ".asciz \"CALC_BATCH_ISA\"\n",
+      "L_threads_env:\n",
+      ".asciz \"CALC_BATCH_THREADS\"\n",
+      ".if CALC_BATCH_AGGREGATE\n",
+      "L_agg_sum:\n",
+      ".asciz \"sum %ld\\n\"\n",
+      "L_agg_sum_error:\n",
+      ".asciz \"sum E\\n\"\n",
+      "L_agg_min_max:\n",
+      ".asciz \"min %d\\nmax %d\\n\"\n",
+      "L_agg_min_max_error:\n",
+      ".asciz \"min E\\nmax E\\n\"\n",
+      "L_agg_errors:\n",
+      ".asciz \"errors %ld\\n\"\n",
+      ".endif\n",
+      ASM_DATA_SECTION "\n",
+      ".p2align 3\n",
+      " # ワーカースレッドに渡す情報\n",
+      "L_batch_kernel:\n",
+      ".quad 0\n",
+      "L_batch_cols:\n",
+      ".quad 0\n",
+      "L_batch_out:\n",
+      ".quad 0\n",
+      "L_batch_err:\n",
+      ".quad 0\n",
+      "L_batch_rows:\n",
+      ".quad 0\n",
+      "L_batch_next:\n",
+      ".quad 0\n",
+      ASM_CONST_SECTION "\n",
+      ".p2align 3\n",
+      "L_vmul_max:\n",
+      ".quad 0x41dfffffffc00000\n",  // 2147483647.0
+      "L_vmul_min:\n",
+      ".quad 0xc1e0000000000000\n",  // -2147483648.0
+      ".p2align 5\n",
+      "L_vlane:\n",
+      ".long 0, 1, 2, 3, 4, 5, 6, 7\n",
+      " # テキストの入力の解析に使う定数\n",
+      ".p2align 4\n",
+      "L_parse_space:\n",
+      ".fill 16, 1, 32\n",
+      "L_parse_comma:\n",
+      ".fill 16, 1, 44\n",
+      "L_parse_zero:\n",
+      ".fill 16, 1, 48\n",
+      "L_parse_nine:\n",
+      ".fill 16, 1, 9\n",
+      "L_parse_mul10:\n",
+      ".byte 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1\n",
+      "L_parse_mul100:\n",
+      ".short 100, 1, 100, 1, 100, 1, 100, 1\n",
+      "L_parse_mul10000:\n",
+      ".short 10000, 1, 10000, 1, 10000, 1, 10000, 1\n",
+      ASM_TEXT_SECTION "\n",
+      ".globl " ASM_GLOBAL_MAIN "\n",
+      ASM_GLOBAL_MAIN ":\n",
+      "pushq %rbp\n",
+      "movq %rsp, %rbp\n",
+      "pushq %rbx\n",
+      "pushq %r12\n",
+      "pushq %r13\n",
+      "pushq %r14\n",
+      "pushq %r15\n",
+      "subq $56, %rsp\n",
+      " # -48(%rbp): 命令セット, -56(%rbp): 行数, -64(%rbp): 8 の倍数に揃えた行数\n",
+      " # -72(%rbp): スレッド数, -80(%rbp): スレッド ID の配列\n",
+      " # -88(%rbp): mmap モードなら argv (それ以外は 0), -96(%rbp): 出力の mmap 領域\n",
+      "movq $0, -88(%rbp)\n",
+      "movq $0, -96(%rbp)\n",
+      "cmpl $2 + CALC_BATCH_OUTPUT_FILE, %edi\n",
+      "jne .Lb_read_text\n",
+      "movq %rsi, -88(%rbp)\n",
+      "jmp .Lb_map_input\n",
+      ".Lb_read_text:\n",
+      " # 解析に SSE4.1 を使うので、先に命令セットを確かめておく\n",
+      "callq calc_batch_isa\n",
+      "testl %eax, %eax\n",
+      "je .Lb_fail\n",
+      " # 標準入力をすべてバッファに読む (%r12: バッファ, %r13: 容量, %r14: 読んだバイト数)\n",
+      "xorl %r12d, %r12d\n",
+      "xorl %r13d, %r13d\n",
+      "xorl %r14d, %r14d\n",
+      ".Lb_read_more:\n",
+      "leaq 64(%r14), %rax\n",
+      "cmpq %r13, %rax\n",
+      "jb .Lb_read_room\n",
+      "leaq 65536(%r13,%r13), %r13\n",
+      "movq %r12, %rdi\n",
+      "movq %r13, %rsi\n",
+      "callq " ASM_EXTERN_REALLOC "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, %r12\n",
+      ".Lb_read_room:\n",
+      " # 末尾の 32 バイトは解析のはみ出し読みのための 0 埋めに残す\n",
+      "xorl %edi, %edi\n",
+      "leaq (%r12,%r14), %rsi\n",
+      "leaq -32(%r13), %rdx\n",
+      "subq %r14, %rdx\n",
+      "callq " ASM_EXTERN_READ "\n",
+      "testq %rax, %rax\n",
+      "js .Lb_fail\n",
+      "je .Lb_read_eof\n",
+      "addq %rax, %r14\n",
+      "jmp .Lb_read_more\n",
+      ".Lb_read_eof:\n",
+      "pxor %xmm0, %xmm0\n",
+      "movdqu %xmm0, (%r12,%r14)\n",
+      "movdqu %xmm0, 16(%r12,%r14)\n",
+      " # 値は 2 バイトに 1 つより多くは現れない\n",
+      "movq %r14, %rdi\n",
+      "shrq $1, %rdi\n",
+      "addq $2, %rdi\n",
+      "movl $4, %esi\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, %r15\n",
+      "movq %r12, %rdi\n",
+      "leaq (%r12,%r14), %rsi\n",
+      "movq %r15, %rdx\n",
+      "callq calc_batch_parse\n",
+      "xorl %edx, %edx\n",
+      "movl $CALC_BATCH_COLUMNS, %ecx\n",
+      "divq %rcx\n",
+      "movq %rax, -56(%rbp)\n",
+      "movq %r15, %r12\n",
+      ".Lb_read_done:\n",
+      "movq -56(%rbp), %rax\n",
+      "testq %rax, %rax\n",
+      ".if CALC_BATCH_AGGREGATE\n",
+      "je .Lb_aggregate\n",
+      ".else\n",
+      "je .Lb_exit\n",
+      ".endif\n",
+      "addq $7, %rax\n",
+      "andq $-8, %rax\n",
+      "movq %rax, -64(%rbp)\n",
+      " # 行優先で読んだ値を列ごとの配列に並べ替える (%r15: 列の配列)\n",
+      "movl $CALC_BATCH_COLUMNS, %edi\n",
+      "movl $8, %esi\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, %r15\n",
+      "xorl %ebx, %ebx\n",
+      ".if CALC_BATCH_COLUMNS == 1\n",
+      "cmpq $0, -88(%rbp)\n",
+      "je .Lb_column\n",
+      "movq %r12, (%r15)\n",
+      "jmp .Lb_column_done\n",
+      ".endif\n",
+      ".Lb_column:\n",
+      "movq -64(%rbp), %rdi\n",
+      "movl $4, %esi\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, (%r15,%rbx,8)\n",
+      "leaq (%r12,%rbx,4), %rsi\n",
+      "xorl %ecx, %ecx\n",
+      ".Lb_column_copy:\n",
+      "cmpq -56(%rbp), %rcx\n",
+      "jae .Lb_column_next\n",
+      "movl (%rsi), %edx\n",
+      "movl %edx, (%rax,%rcx,4)\n",
+      "addq $CALC_BATCH_COLUMNS*4, %rsi\n",
+      "incq %rcx\n",
+      "jmp .Lb_column_copy\n",
+      ".Lb_column_next:\n",
+      "incl %ebx\n",
+      "cmpl $CALC_BATCH_COLUMNS, %ebx\n",
+      "jb .Lb_column\n",
+      ".Lb_column_done:\n",
+      ".if CALC_BATCH_AGGREGATE\n",
+      " # かたまりごとの部分集計の配列 (%r13)。結果の配列とビットマップは作らない\n",
+      "movq -56(%rbp), %rdi\n",
+      "addq $CALC_BATCH_CHUNK - 1, %rdi\n",
+      "shrq $CALC_BATCH_CHUNK_SHIFT, %rdi\n",
+      "movl $32, %esi\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, %r13\n",
+      "xorl %r14d, %r14d\n",
+      ".else\n",
+      " # 出力配列 (%r13) とエラービットマップ (%r14)\n",
+      " # (フィルタモードでは通った行番号の配列と、かたまりごとの通った行数の配列)\n",
+      "movq -96(%rbp), %r13\n",
+      "testq %r13, %r13\n",
+      "jne .Lb_out_ready\n",
+      "movq -64(%rbp), %rdi\n",
+      "movl $4, %esi\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, %r13\n",
+      ".Lb_out_ready:\n",
+      ".if CALC_BATCH_FILTER\n",
+      "movq -56(%rbp), %rdi\n",
+      "addq $CALC_BATCH_CHUNK - 1, %rdi\n",
+      "shrq $CALC_BATCH_CHUNK_SHIFT, %rdi\n",
+      "movl $8, %esi\n",
+      ".else\n",
+      "movq -64(%rbp), %rdi\n",
+      "shrq $3, %rdi\n",
+      "movl $1, %esi\n",
+      ".endif\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, %r14\n",
+      ".endif\n",
+      " # 命令セットを選ぶ\n",
+      "callq calc_batch_isa\n",
+      "movl %eax, -48(%rbp)\n",
+      "leaq L_isa_env(%rip), %rdi\n",
+      "callq " ASM_EXTERN_GETENV "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_isa_chosen\n",
+      "cmpb $115, (%rax)\n",  // 's' で始まれば SSE4.1
+      "jne .Lb_isa_chosen\n",
+      "cmpl $2, -48(%rbp)\n",
+      "jne .Lb_isa_chosen\n",
+      "movl $1, -48(%rbp)\n",
+      ".Lb_isa_chosen:\n",
+      "leaq calc_kernel_avx2(%rip), %rax\n",
+      "cmpl $2, -48(%rbp)\n",
+      "je .Lb_kernel_chosen\n",
+      "leaq calc_kernel_sse41(%rip), %rax\n",
+      "cmpl $1, -48(%rbp)\n",
+      "jne .Lb_fail\n",
+      ".Lb_kernel_chosen:\n",
+      "movq %rax, L_batch_kernel(%rip)\n",
+      "movq %r15, L_batch_cols(%rip)\n",
+      "movq %r13, L_batch_out(%rip)\n",
+      "movq %r14, L_batch_err(%rip)\n",
+      "movq -56(%rbp), %rax\n",
+      "movq %rax, L_batch_rows(%rip)\n",
+      " # スレッド数を決める (1 以上、かたまりの数以下)\n",
+      "leaq L_threads_env(%rip), %rdi\n",
+      "callq " ASM_EXTERN_GETENV "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_threads_default\n",
+      "movq %rax, %rdi\n",
+      "callq " ASM_EXTERN_ATOI "\n",
+      "movslq %eax, %rax\n",
+      "jmp .Lb_threads_clamp\n",
+      ".Lb_threads_default:\n",
+      "movl $" ASM_SC_NPROCESSORS_ONLN ", %edi\n",
+      "callq " ASM_EXTERN_SYSCONF "\n",
+      ".Lb_threads_clamp:\n",
+      "movl $1, %ecx\n",
+      "testq %rax, %rax\n",
+      "cmovle %rcx, %rax\n",
+      "movq -56(%rbp), %rcx\n",
+      "addq $CALC_BATCH_CHUNK - 1, %rcx\n",
+      "shrq $CALC_BATCH_CHUNK_SHIFT, %rcx\n",
+      "cmpq %rcx, %rax\n",
+      "cmova %rcx, %rax\n",
+      "movq %rax, -72(%rbp)\n",
+      "movq %rax, %rdi\n",
+      "movl $8, %esi\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, -80(%rbp)\n",
+      " # 関数の SIMD 版はフレームが大きく、深い再帰にはスタックの大きさが要るので、\n",
+      " # ワーカーはすべて CALC_BATCH_STACK のスタックで起動し、自分は join だけをする\n",
+      "subq $64, %rsp\n",  // pthread_attr_t
+      "movq %rsp, %rdi\n",
+      "callq " ASM_EXTERN_PTHREAD_ATTR_INIT "\n",
+      "movq %rsp, %rdi\n",
+      "movq $CALC_BATCH_STACK, %rsi\n",
+      "callq " ASM_EXTERN_PTHREAD_ATTR_SETSTACKSIZE "\n",
+      "xorl %ebx, %ebx\n",
+      ".Lb_spawn:\n",
+      "cmpq -72(%rbp), %rbx\n",
+      "jae .Lb_spawned\n",
+      "movq -80(%rbp), %rax\n",
+      "leaq (%rax,%rbx,8), %rdi\n",
+      "movq %rsp, %rsi\n",
+      "leaq calc_batch_worker(%rip), %rdx\n",
+      "xorl %ecx, %ecx\n",
+      "callq " ASM_EXTERN_PTHREAD_CREATE "\n",
+      "testl %eax, %eax\n",
+      "jne .Lb_fail\n",
+      "incq %rbx\n",
+      "jmp .Lb_spawn\n",
+      ".Lb_spawned:\n",
+      "addq $64, %rsp\n",
+      "xorl %ebx, %ebx\n",
+      ".Lb_join:\n",
+      "cmpq -72(%rbp), %rbx\n",
+      "jae .Lb_print_start\n",
+      "movq -80(%rbp), %rax\n",
+      "movq (%rax,%rbx,8), %rdi\n",
+      "xorl %esi, %esi\n",
+      "callq " ASM_EXTERN_PTHREAD_JOIN "\n",
+      "incq %rbx\n",
+      "jmp .Lb_join\n",
+      ".Lb_print_start:\n",
+      ".if CALC_BATCH_AGGREGATE\n",
+      "jmp .Lb_aggregate\n",
+      ".endif\n",
+      ".if CALC_BATCH_FILTER\n",
+      "jmp .Lb_filter_print\n",
+      ".endif\n",
+      "cmpq $0, -88(%rbp)\n",
+      "je .Lb_print_text\n",
+      " # エラービットマップを出力ファイルの結果の後ろに書き写す\n",
+      "movq -56(%rbp), %rcx\n",
+      "leaq (%r13,%rcx,4), %rdi\n",
+      "addq $7, %rcx\n",
+      "shrq $3, %rcx\n",
+      "movq %r14, %rsi\n",
+      "rep movsb\n",
+      "jmp .Lb_exit\n",
+      ".Lb_print_text:\n",
+      " # 1 行は最長で \"-2147483648\\n\" の 12 バイト (%r12: 出力バッファ, %r15: 書き込み位置)\n",
+      "movq -56(%rbp), %rax\n",
+      "leaq (%rax,%rax,2), %rdi\n",
+      "leaq 16(,%rdi,4), %rdi\n",
+      "movl $1, %esi\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, %r12\n",
+      "movq %rax, %r15\n",
+      "xorl %ebx, %ebx\n",
+      ".Lb_print:\n",
+      "cmpq -56(%rbp), %rbx\n",
+      "jae .Lb_write\n",
+      "movq %rbx, %rcx\n",
+      "shrq $3, %rcx\n",
+      "movzbl (%r14,%rcx), %eax\n",
+      "movl %ebx, %ecx\n",
+      "andl $7, %ecx\n",
+      "btl %ecx, %eax\n",
+      "jc .Lb_print_error\n",
+      "movq %r15, %rdi\n",
+      "movl (%r13,%rbx,4), %esi\n",
+      "callq calc_batch_itoa\n",
+      "movq %rax, %r15\n",
+      "jmp .Lb_print_next\n",
+      ".Lb_print_error:\n",
+      "movw $0x0a45, (%r15)\n",  // "E\n"
+      "addq $2, %r15\n",
+      ".Lb_print_next:\n",
+      "incq %rbx\n",
+      "jmp .Lb_print\n",
+      ".Lb_write:\n",
+      "cmpq %r15, %r12\n",
+      "jae .Lb_exit\n",
+      "movl $1, %edi\n",
+      "movq %r12, %rsi\n",
+      "movq %r15, %rdx\n",
+      "subq %r12, %rdx\n",
+      "callq " ASM_EXTERN_WRITE "\n",
+      "testq %rax, %rax\n",
+      "jle .Lb_fail\n",
+      "addq %rax, %r12\n",
+      "jmp .Lb_write\n",
+      ".Lb_exit:\n",
+      "xorl %eax, %eax\n",
+      "leaq -40(%rbp), %rsp\n",
+      "popq %r15\n",
+      "popq %r14\n",
+      "popq %r13\n",
+      "popq %r12\n",
+      "popq %rbx\n",
+      "popq %rbp\n",
+      "ret\n",
+      " # mmap モード: argv[1] の int32 の行を読み、argv[2] に結果を書く領域を用意する\n",
+      ".Lb_map_input:\n",
+      "movq 8(%rsi), %rdi\n",
+      "xorl %esi, %esi\n",
+      "xorl %eax, %eax\n",
+      "callq " ASM_EXTERN_OPEN "\n",
+      "testl %eax, %eax\n",
+      "js .Lb_fail\n",
+      "movl %eax, %ebx\n",
+      "movl %eax, %edi\n",
+      "xorl %esi, %esi\n",
+      "movl $2, %edx\n",  // SEEK_END
+      "callq " ASM_EXTERN_LSEEK "\n",
+      "testq %rax, %rax\n",
+      "js .Lb_fail\n",
+      "movq %rax, %r12\n",
+      "xorl %edx, %edx\n",
+      "movl $CALC_BATCH_COLUMNS*4, %ecx\n",
+      "divq %rcx\n",
+      "movq %rax, -56(%rbp)\n",
+      "testq %rax, %rax\n",
+      "je .Lb_map_output\n",
+      "xorl %edi, %edi\n",
+      "movq %r12, %rsi\n",
+      "movl $1, %edx\n",  // PROT_READ
+      "movl $2, %ecx\n",  // MAP_PRIVATE
+      "movl %ebx, %r8d\n",
+      "xorl %r9d, %r9d\n",
+      "callq " ASM_EXTERN_MMAP "\n",
+      "cmpq $-1, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, %r12\n",
+      ".Lb_map_output:\n",
+      ".if CALC_BATCH_OUTPUT_FILE == 0\n",
+      "jmp .Lb_read_done\n",
+      ".endif\n",
+      "movq -88(%rbp), %rax\n",
+      "movq 16(%rax), %rdi\n",
+      "movl $" ASM_OPEN_CREATE_FLAGS ", %esi\n",
+      "movl $0644, %edx\n",
+      "xorl %eax, %eax\n",
+      "callq " ASM_EXTERN_OPEN "\n",
+      "testl %eax, %eax\n",
+      "js .Lb_fail\n",
+      "movl %eax, %ebx\n",
+      " # 出力ファイルのバイト数 = 行数 * 4 + (行数 + 7) / 8\n",
+      "movq -56(%rbp), %rax\n",
+      "leaq 7(%rax), %rsi\n",
+      "shrq $3, %rsi\n",
+      "leaq (%rsi,%rax,4), %rsi\n",
+      "movq %rsi, -96(%rbp)\n",
+      "movl %ebx, %edi\n",
+      "callq " ASM_EXTERN_FTRUNCATE "\n",
+      "testl %eax, %eax\n",
+      "jne .Lb_fail\n",
+      "cmpq $0, -96(%rbp)\n",
+      "je .Lb_exit\n",
+      "xorl %edi, %edi\n",
+      "movq -96(%rbp), %rsi\n",
+      "movl $3, %edx\n",  // PROT_READ | PROT_WRITE
+      "movl $1, %ecx\n",  // MAP_SHARED
+      "movl %ebx, %r8d\n",
+      "xorl %r9d, %r9d\n",
+      "callq " ASM_EXTERN_MMAP "\n",
+      "cmpq $-1, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, -96(%rbp)\n",
+      "jmp .Lb_read_done\n",
+      ".if CALC_BATCH_AGGREGATE\n",
+      " # 部分集計をまとめる (%r12: 和, %r14: エラーの行数, %r15b: 和があふれたか)\n",
+      " # -72(%rbp): 最小値, -80(%rbp): 最大値\n",
+      ".Lb_aggregate:\n",
+      "xorl %r12d, %r12d\n",
+      "xorl %r14d, %r14d\n",
+      "xorl %r15d, %r15d\n",
+      "movl $0x7fffffff, -72(%rbp)\n",
+      "movl $0x80000000, -80(%rbp)\n",
+      "movq -56(%rbp), %rcx\n",
+      "addq $CALC_BATCH_CHUNK - 1, %rcx\n",
+      "shrq $CALC_BATCH_CHUNK_SHIFT, %rcx\n",
+      "xorl %ebx, %ebx\n",
+      ".Lb_fold:\n",
+      "cmpq %rcx, %rbx\n",
+      "jae .Lb_fold_done\n",
+      "movq %rbx, %rax\n",
+      "shlq $5, %rax\n",
+      "addq %r13, %rax\n",
+      "addq (%rax), %r12\n",
+      "seto %dl\n",
+      "orb %dl, %r15b\n",
+      "movl -72(%rbp), %edx\n",
+      "cmpl %edx, 8(%rax)\n",
+      "cmovll 8(%rax), %edx\n",
+      "movl %edx, -72(%rbp)\n",
+      "movl -80(%rbp), %edx\n",
+      "cmpl %edx, 12(%rax)\n",
+      "cmovgl 12(%rax), %edx\n",
+      "movl %edx, -80(%rbp)\n",
+      "addq 16(%rax), %r14\n",
+      "incq %rbx\n",
+      "jmp .Lb_fold\n",
+      ".Lb_fold_done:\n",
+      "leaq L_agg_sum(%rip), %rdi\n",
+      "movq %r12, %rsi\n",
+      "testb %r15b, %r15b\n",
+      "je .Lb_print_sum\n",
+      "leaq L_agg_sum_error(%rip), %rdi\n",
+      ".Lb_print_sum:\n",
+      "xorl %eax, %eax\n",
+      "callq " ASM_EXTERN_PRINTF "\n",
+      " # エラーでない行が無ければ最小値・最大値は無い\n",
+      "leaq L_agg_min_max_error(%rip), %rdi\n",
+      "cmpq -56(%rbp), %r14\n",
+      "jae .Lb_print_min_max\n",
+      "leaq L_agg_min_max(%rip), %rdi\n",
+      "movl -72(%rbp), %esi\n",
+      "movl -80(%rbp), %edx\n",
+      ".Lb_print_min_max:\n",
+      "xorl %eax, %eax\n",
+      "callq " ASM_EXTERN_PRINTF "\n",
+      "leaq L_agg_errors(%rip), %rdi\n",
+      "movq %r14, %rsi\n",
+      "xorl %eax, %eax\n",
+      "callq " ASM_EXTERN_PRINTF "\n",
+      "jmp .Lb_exit\n",
+      ".endif\n",
+      ".if CALC_BATCH_FILTER\n",
+      " # 通った行 (--filter-index なら行番号) を出力する\n",
+      " # -48(%rbp): 出力バッファ, -64(%rbp): かたまりの数, -72(%rbp): 次のかたまり,\n",
+      " # -80(%rbp): かたまりの行番号の終わり, -88(%rbp): 列, %rbx: 行番号の読み出し位置\n",
+      ".Lb_filter_print:\n",
+      "movq -56(%rbp), %rcx\n",
+      "addq $CALC_BATCH_CHUNK - 1, %rcx\n",
+      "shrq $CALC_BATCH_CHUNK_SHIFT, %rcx\n",
+      "movq %rcx, -64(%rbp)\n",
+      "xorl %eax, %eax\n",
+      "xorl %ebx, %ebx\n",
+      ".Lb_filter_total:\n",
+      "cmpq %rcx, %rbx\n",
+      "jae .Lb_filter_alloc\n",
+      "addq (%r14,%rbx,8), %rax\n",
+      "incq %rbx\n",
+      "jmp .Lb_filter_total\n",
+      ".Lb_filter_alloc:\n",
+      ".if CALC_BATCH_FILTER == 1\n",
+      "imulq $12 * CALC_BATCH_COLUMNS, %rax, %rdi\n",
+      ".else\n",
+      "imulq $12, %rax, %rdi\n",
+      ".endif\n",
+      "addq $16, %rdi\n",
+      "movl $1, %esi\n",
+      "callq " ASM_EXTERN_CALLOC "\n",
+      "testq %rax, %rax\n",
+      "je .Lb_fail\n",
+      "movq %rax, -48(%rbp)\n",
+      "movq %rax, %r15\n",
+      "movq $0, -72(%rbp)\n",
+      ".Lb_filter_chunk:\n",
+      "movq -72(%rbp), %rax\n",
+      "cmpq -64(%rbp), %rax\n",
+      "jae .Lb_filter_write\n",
+      "movq %rax, %rbx\n",
+      "shlq $CALC_BATCH_CHUNK_SHIFT + 2, %rbx\n",
+      "addq %r13, %rbx\n",
+      "movq (%r14,%rax,8), %rcx\n",
+      "leaq (%rbx,%rcx,4), %rcx\n",
+      "movq %rcx, -80(%rbp)\n",
+      "incq -72(%rbp)\n",
+      ".Lb_filter_row:\n",
+      "cmpq -80(%rbp), %rbx\n",
+      "jae .Lb_filter_chunk\n",
+      ".if CALC_BATCH_FILTER == 1\n",
+      "movq $0, -88(%rbp)\n",
+      ".Lb_filter_column:\n",
+      "movl (%rbx), %eax\n",
+      "imulq $CALC_BATCH_COLUMNS, %rax, %rax\n",
+      "addq -88(%rbp), %rax\n",
+      "movl (%r12,%rax,4), %esi\n",
+      "movq %r15, %rdi\n",
+      "callq calc_batch_itoa\n",
+      "movq %rax, %r15\n",
+      "incq -88(%rbp)\n",
+      "cmpq $CALC_BATCH_COLUMNS, -88(%rbp)\n",
+      "jae .Lb_filter_next\n",
+      "movb $44, -1(%r15)\n",  // 列の間の改行をカンマにする
+      "jmp .Lb_filter_column\n",
+      ".else\n",
+      "movl (%rbx), %esi\n",
+      "movq %r15, %rdi\n",
+      "callq calc_batch_itoa\n",
+      "movq %rax, %r15\n",
+      ".endif\n",
+      ".Lb_filter_next:\n",
+      "addq $4, %rbx\n",
+      "jmp .Lb_filter_row\n",
+      ".Lb_filter_write:\n",
+      "movq -48(%rbp), %r12\n",
+      "jmp .Lb_write\n",
+      ".endif\n",
+      ".Lb_fail:\n",
+      "leaq L_err(%rip), %rdi\n",
+      "xorl %eax, %eax\n",
+      "callq " ASM_EXTERN_PRINTF "\n",
+      "movl $1, %edi\n",
+      "callq " ASM_EXTERN_EXIT "\n",
+      " # 残っている行のかたまりを取っては処理するスレッド関数\n",
+      "calc_batch_worker:\n",
+      "pushq %rbx\n",
+      ".Lw_next:\n",
+      "movl $CALC_BATCH_CHUNK, %ebx\n",
+      "lock xaddq %rbx, L_batch_next(%rip)\n",
+      "cmpq L_batch_rows(%rip), %rbx\n",
+      "jae .Lw_done\n",
+      "leaq CALC_BATCH_CHUNK(%rbx), %r8\n",
+      "cmpq L_batch_rows(%rip), %r8\n",
+      "cmova L_batch_rows(%rip), %r8\n",
+      "movq L_batch_cols(%rip), %rdi\n",
+      "movq L_batch_out(%rip), %rsi\n",
+      "movq L_batch_err(%rip), %rdx\n",
+      "movq %rbx, %rcx\n",
+      "callq *L_batch_kernel(%rip)\n",
+      "jmp .Lw_next\n",
+      ".Lw_done:\n",
+      "xorl %eax, %eax\n",
+      "popq %rbx\n",
+      "ret\n",
+      " # 使える命令セットを返す (2: AVX2, 1: SSE4.1, 0: どちらも無い)\n",
+      "calc_batch_isa:\n",
+      "pushq %rbx\n",
+      "xorl %r8d, %r8d\n",
+      "movl $1, %eax\n",
+      "cpuid\n",
+      "btl $19, %ecx\n",
+      "jnc .Lisa_done\n",
+      "movl $1, %r8d\n",
+      "movl %ecx, %r9d\n",
+      "andl $0x18000000, %r9d\n",  // OSXSAVE と AVX
+      "cmpl $0x18000000, %r9d\n",
+      "jne .Lisa_done\n",
+      "xorl %ecx, %ecx\n",
+      "xgetbv\n",
+      "andl $6, %eax\n",  // OS が XMM/YMM を保存するか
+      "cmpl $6, %eax\n",
+      "jne .Lisa_done\n",
+      "movl $7, %eax\n",
+      "xorl %ecx, %ecx\n",
+      "cpuid\n",
+      "btl $5, %ebx\n",
+      "jnc .Lisa_done\n",
+      "movl $2, %r8d\n",
+      ".Lisa_done:\n",
+      "movl %r8d, %eax\n",
+      "popq %rbx\n",
+      "ret\n",
+  };
+  // calc_batch_parse: [%rdi, %rsi) の整数を %rdx の配列に書き、個数を返す
+  //   16 バイトずつ区切り文字と数字を分類し、8 桁までは pshufb で右に寄せて
+  //   pmaddubsw/pmaddwd で 2 桁、4 桁、8 桁とまとめる。9 桁以上は 1 桁ずつ足す。
+  //   バッファの末尾には 0 埋めが 32 バイト以上あるものとする。
+  // calc_batch_itoa: %esi を 10 進数と改行にして %rdi に書き、次の書き込み位置を返す
+  //   10 での除算は逆数の乗算で行い、16 バイトまとめて書き写す。
+  static const char* const text_lines[] = {
+      ASM_TEXT_SECTION "\n",
+      "calc_batch_parse:\n",
+      "movq %rdx, %r8\n",
+      "movq %rdx, %r10\n",
+      ".Lp_skip:\n",
+      "cmpq %rsi, %rdi\n",
+      "jae .Lp_done\n",
+      " # 空白・制御文字・カンマを読み飛ばす\n",
+      "movdqu (%rdi), %xmm0\n",
+      "movdqa %xmm0, %xmm1\n",
+      "pminub L_parse_space(%rip), %xmm1\n",
+      "pcmpeqb %xmm0, %xmm1\n",
+      "pcmpeqb L_parse_comma(%rip), %xmm0\n",
+      "por %xmm0, %xmm1\n",
+      "pmovmskb %xmm1, %eax\n",
+      "notl %eax\n",
+      "bsfl %eax, %ecx\n",
+      "addq %rcx, %rdi\n",
+      "cmpl $16, %ecx\n",
+      "je .Lp_skip\n",
+      "cmpq %rsi, %rdi\n",
+      "jae .Lp_done\n",
+      "xorl %r9d, %r9d\n",
+      "movzbl (%rdi), %eax\n",
+      "cmpb $45, %al\n",  // '-'
+      "jne .Lp_plus\n",
+      "movl $1, %r9d\n",
+      "incq %rdi\n",
+      "jmp .Lp_digits\n",
+      ".Lp_plus:\n",
+      "cmpb $43, %al\n",  // '+'
+      "jne .Lp_digits\n",
+      "incq %rdi\n",
+      ".Lp_digits:\n",
+      " # 先頭から続く数字の桁数を数える\n",
+      "movdqu (%rdi), %xmm0\n",
+      "psubb L_parse_zero(%rip), %xmm0\n",
+      "movdqa %xmm0, %xmm1\n",
+      "pminub L_parse_nine(%rip), %xmm1\n",
+      "pcmpeqb %xmm0, %xmm1\n",
+      "pmovmskb %xmm1, %eax\n",
+      "notl %eax\n",
+      "bsfl %eax, %ecx\n",
+      "testl %ecx, %ecx\n",
+      "je .Lp_done\n",
+      "cmpl $8, %ecx\n",
+      "ja .Lp_long\n",
+      "movl %ecx, %eax\n",
+      "shll $4, %eax\n",
+      "leaq L_parse_shuffle(%rip), %rdx\n",
+      "pshufb (%rdx,%rax), %xmm0\n",
+      "pmaddubsw L_parse_mul10(%rip), %xmm0\n",
+      "pmaddwd L_parse_mul100(%rip), %xmm0\n",
+      "packusdw %xmm0, %xmm0\n",
+      "pmaddwd L_parse_mul10000(%rip), %xmm0\n",
+      "movd %xmm0, %eax\n",
+      "addq %rcx, %rdi\n",
+      "jmp .Lp_store\n",
+      ".Lp_long:\n",
+      " # 桁の多い値は 64 ビットで足し込んで下位 32 ビットを取る (strtol の範囲では scanf と同じ)\n",
+      "xorl %eax, %eax\n",
+      ".Lp_long_digit:\n",
+      "movzbl (%rdi), %edx\n",
+      "subl $48, %edx\n",
+      "cmpl $9, %edx\n",
+      "ja .Lp_store\n",
+      "leaq (%rax,%rax,4), %rax\n",
+      "leaq (%rdx,%rax,2), %rax\n",
+      "incq %rdi\n",
+      "jmp .Lp_long_digit\n",
+      ".Lp_store:\n",
+      "testl %r9d, %r9d\n",
+      "je .Lp_positive\n",
+      "negq %rax\n",
+      ".Lp_positive:\n",
+      "movl %eax, (%r10)\n",
+      "addq $4, %r10\n",
+      "jmp .Lp_skip\n",
+      ".Lp_done:\n",
+      "movq %r10, %rax\n",
+      "subq %r8, %rax\n",
+      "shrq $2, %rax\n",
+      "ret\n",
+      "calc_batch_itoa:\n",
+      " # 一時領域はレッドゾーンに取る (-24(%rsp) から 16 バイト、最後が改行)\n",
+      "leaq -24(%rsp), %r8\n",
+      "movb $10, 15(%r8)\n",
+      "leaq 15(%r8), %r9\n",
+      "movl %esi, %eax\n",
+      "testl %esi, %esi\n",
+      "jns .Li_digit\n",
+      "negl %eax\n",
+      ".Li_digit:\n",
+      "movl %eax, %edx\n",
+      "movl $0xcccccccd, %ecx\n",
+      "imulq %rcx, %rdx\n",
+      "shrq $35, %rdx\n",
+      "leal (%rdx,%rdx,4), %ecx\n",
+      "addl %ecx, %ecx\n",
+      "subl %ecx, %eax\n",
+      "addb $48, %al\n",
+      "decq %r9\n",
+      "movb %al, (%r9)\n",
+      "movl %edx, %eax\n",
+      "testl %eax, %eax\n",
+      "jne .Li_digit\n",
+      "testl %esi, %esi\n",
+      "jns .Li_copy\n",
+      "decq %r9\n",
+      "movb $45, (%r9)\n",
+      ".Li_copy:\n",
+      "movdqu (%r9), %xmm0\n",
+      "movdqu %xmm0, (%rdi)\n",
+      "leaq 16(%r8), %rax\n",
+      "subq %r9, %rax\n",
+      "addq %rdi, %rax\n",
+      "ret\n",
+  };
+  // vmul32_<isa>: %5 * %6 を %5 に、オーバーフローしたレーンを %7 に返す
+  // vdiv32_<isa>: %5 / %6 の商を %5、剰余を %6 に、0 除算などのレーンを %7 に返す
+  // 乗算の範囲判定と除算は double で行う (32 ビット整数同士なら正確)
+  static const char* const avx2_lines[] = {
+      "vmul32_avx2:\n",
+      "vcvtdq2pd %xmm5, %ymm8\n",
+      "vcvtdq2pd %xmm6, %ymm9\n",
+      "vmulpd %ymm9, %ymm8, %ymm8\n",
+      "vextracti128 $1, %ymm5, %xmm9\n",
+      "vcvtdq2pd %xmm9, %ymm9\n",
+      "vextracti128 $1, %ymm6, %xmm10\n",
+      "vcvtdq2pd %xmm10, %ymm10\n",
+      "vmulpd %ymm10, %ymm9, %ymm9\n",
+      "vpmulld %ymm6, %ymm5, %ymm5\n",
+      "vbroadcastsd L_vmul_max(%rip), %ymm10\n",
+      "vbroadcastsd L_vmul_min(%rip), %ymm11\n",
+      "vcmppd $0x1e, %ymm10, %ymm8, %ymm7\n",
+      "vcmppd $0x11, %ymm11, %ymm8, %ymm8\n",
+      "vorpd %ymm7, %ymm8, %ymm8\n",
+      "vcmppd $0x1e, %ymm10, %ymm9, %ymm7\n",
+      "vcmppd $0x11, %ymm11, %ymm9, %ymm9\n",
+      "vorpd %ymm7, %ymm9, %ymm9\n",
+      "vshufps $0x88, %ymm9, %ymm8, %ymm7\n",
+      "vpermq $0xd8, %ymm7, %ymm7\n",
+      "ret\n",
+      "vdiv32_avx2:\n",
+      "vpxor %ymm7, %ymm7, %ymm7\n",
+      "vpcmpeqd %ymm7, %ymm6, %ymm7\n",
+      "vpcmpeqd %ymm8, %ymm8, %ymm8\n",
+      "vpcmpeqd %ymm8, %ymm6, %ymm9\n",
+      "vpslld $31, %ymm8, %ymm8\n",
+      "vpcmpeqd %ymm8, %ymm5, %ymm8\n",
+      "vpand %ymm9, %ymm8, %ymm8\n",
+      "vpor %ymm8, %ymm7, %ymm7\n",
+      "vcvtdq2pd %xmm5, %ymm9\n",
+      "vcvtdq2pd %xmm6, %ymm10\n",
+      "vdivpd %ymm10, %ymm9, %ymm9\n",
+      "vcvttpd2dq %ymm9, %xmm9\n",
+      "vextracti128 $1, %ymm5, %xmm10\n",
+      "vcvtdq2pd %xmm10, %ymm10\n",
+      "vextracti128 $1, %ymm6, %xmm11\n",
+      "vcvtdq2pd %xmm11, %ymm11\n",
+      "vdivpd %ymm11, %ymm10, %ymm10\n",
+      "vcvttpd2dq %ymm10, %xmm10\n",
+      "vinserti128 $1, %xmm10, %ymm9, %ymm9\n",
+      "vpmulld %ymm6, %ymm9, %ymm10\n",
+      "vpsubd %ymm10, %ymm5, %ymm6\n",
+      "vmovdqa %ymm9, %ymm5\n",
+      "ret\n",
+  };
+  static const char* const sse41_lines[] = {
+      "vmul32_sse41:\n",
+      "cvtdq2pd %xmm5, %xmm8\n",
+      "cvtdq2pd %xmm6, %xmm9\n",
+      "mulpd %xmm9, %xmm8\n",
+      "pshufd $0xee, %xmm5, %xmm9\n",
+      "cvtdq2pd %xmm9, %xmm9\n",
+      "pshufd $0xee, %xmm6, %xmm10\n",
+      "cvtdq2pd %xmm10, %xmm10\n",
+      "mulpd %xmm10, %xmm9\n",
+      "pmulld %xmm6, %xmm5\n",
+      "movddup L_vmul_max(%rip), %xmm10\n",
+      "movddup L_vmul_min(%rip), %xmm11\n",
+      "movapd %xmm8, %xmm7\n",
+      "cmpnlepd %xmm10, %xmm7\n",
+      "cmpltpd %xmm11, %xmm8\n",
+      "orpd %xmm7, %xmm8\n",
+      "movapd %xmm9, %xmm7\n",
+      "cmpnlepd %xmm10, %xmm7\n",
+      "cmpltpd %xmm11, %xmm9\n",
+      "orpd %xmm7, %xmm9\n",
+      "shufps $0x88, %xmm9, %xmm8\n",
+      "movaps %xmm8, %xmm7\n",
+      "ret\n",
+      "vdiv32_sse41:\n",
+      "pxor %xmm7, %xmm7\n",
+      "pcmpeqd %xmm6, %xmm7\n",
+      "pcmpeqd %xmm8, %xmm8\n",
+      "movdqa %xmm8, %xmm9\n",
+      "pcmpeqd %xmm6, %xmm9\n",
+      "pslld $31, %xmm8\n",
+      "pcmpeqd %xmm5, %xmm8\n",
+      "pand %xmm9, %xmm8\n",
+      "por %xmm8, %xmm7\n",
+      "cvtdq2pd %xmm5, %xmm9\n",
+      "cvtdq2pd %xmm6, %xmm10\n",
+      "divpd %xmm10, %xmm9\n",
+      "cvttpd2dq %xmm9, %xmm9\n",
+      "pshufd $0xee, %xmm5, %xmm10\n",
+      "cvtdq2pd %xmm10, %xmm10\n",
+      "pshufd $0xee, %xmm6, %xmm11\n",
+      "cvtdq2pd %xmm11, %xmm11\n",
+      "divpd %xmm11, %xmm10\n",
+      "cvttpd2dq %xmm10, %xmm10\n",
+      "punpcklqdq %xmm10, %xmm9\n",
+      "movdqa %xmm9, %xmm10\n",
+      "pmulld %xmm6, %xmm10\n",
+      "movdqa %xmm5, %xmm6\n",
+      "psubd %xmm10, %xmm6\n",
+      "movdqa %xmm9, %xmm5\n",
+      "ret\n",
+  };
+  int columns = 1;
+  for (size_t i = 0; i < ctx->main_ir.count; i++) {
+    if (ctx->main_ir.insts[i].op == IR_LOAD_COLUMN && ctx->main_ir.insts[i].a > columns) {
+      columns = ctx->main_ir.insts[i].a;
+    }
+  }
+  bool reachable[MAX_FUNC] = {false};
+  mark_reachable(&ctx->main_ir, reachable);
+
+  mprintf(".set CALC_BATCH_COLUMNS, %d\n", columns);
+  mprintf(".set CALC_BATCH_AGGREGATE, %d\n", ctx->is_aggregate);
+  mprintf(".set CALC_BATCH_FILTER, %d\n", ctx->is_filter);
+  mprintf(".set CALC_BATCH_OUTPUT_FILE, %d\n", !ctx->is_aggregate && !ctx->is_filter);
+  emit_lines(runtime_lines, sizeof(runtime_lines) / sizeof(runtime_lines[0]));
+  emit_lines(text_lines, sizeof(text_lines) / sizeof(text_lines[0]));
+  // L_parse_shuffle + 16 * n: 先頭の n 桁を 8 バイトの右端に寄せる pshufb の表
+  mprintf("%s\n.p2align 4\nL_parse_shuffle:\n", ASM_CONST_SECTION);
+  for (int n = 0; n <= 8; n++) {
+    mprintf(".byte");
+    for (int i = 0; i < 16; i++) {
+      mprintf("%s%d", i == 0 ? " " : ", ", i < 8 && i >= 8 - n ? i - (8 - n) : 0x80);
+    }
+    mprintf("\n");
+  }
+  if (ctx->is_filter) {
+    // L_pack8 + 32 * mask: mask の立っているレーンを前に詰める vpermd の添字
+    // L_pack4 + 16 * mask: 同じことを 4 レーンで行う pshufb の並べ替え
+    // L_pack_count + mask: mask の立っているビットの数
+    mprintf(".p2align 5\nL_pack8:\n");
+    for (int mask = 0; mask < 256; mask++) {
+      mprintf(".long");
+      for (int lane = 0, n = 0; lane < 8 || n < 8; lane++) {
+        if (lane >= 8 || mask & (1 << lane)) {
+          mprintf("%s%d", n++ == 0 ? " " : ", ", lane < 8 ? lane : 0);
+        }
+      }
+      mprintf("\n");
+    }
+    mprintf(".p2align 4\nL_pack4:\n");
+    for (int mask = 0; mask < 16; mask++) {
+      mprintf(".byte");
+      for (int lane = 0, n = 0; lane < 4 || n < 16; lane++) {
+        if (lane >= 4 || mask & (1 << lane)) {
+          for (int b = 0; b < 4; b++) {
+            mprintf("%s%d", n++ == 0 ? " " : ", ", lane < 4 ? lane * 4 + b : 0x80);
+          }
+        }
+      }
+      mprintf("\n");
+    }
+    mprintf("L_pack_count:\n");
+    for (int mask = 0; mask < 256; mask++) {
+      mprintf("%s%d%s", mask % 16 == 0 ? ".byte " : "", __builtin_popcount(mask),
+             mask % 16 == 15 ? "\n" : ", ");
+    }
+  }
+  mprintf("%s\n", ASM_TEXT_SECTION);
+  emit_lines(avx2_lines, sizeof(avx2_lines) / sizeof(avx2_lines[0]));
+  emit_lines(sse41_lines, sizeof(sse41_lines) / sizeof(sse41_lines[0]));
+  const VecIsa* isas[] = {&VEC_AVX2, &VEC_SSE41};
+  for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+    emit_batch_kernel(isas[k]);
+    for (int i = 0; i < ctx->function_count; i++) {
+      if (reachable[i]) {
+        emit_vector_function(isas[k], &ctx->functions[i]);
+      }
+    }
+  }
+}
+
 /**
  * @brief 文字が数字かどうかを判定する。
  * @param c 判定対象の文字。
  * @return 数字であれば true。
  */
-bool is_digit(char c) { return c >= '0' && c <= '9'; }
+bool is_digit(char c) { return char_classes[(unsigned char)c] & CC_DIGIT; }
 /**
  * @brief 文字が四則演算子かどうかを判定する。
  * @param c 判定対象の文字。
  * @return 四則演算子であれば true。
  */
 bool is_operator(char c) {
-  /* enum `Op` のリテラル値を活用することで定義を一元化 */
-  return c == PLUS || c == MINUS || c == MUL || c == DIV || c == MOD;
+  /* enum `Op` のリテラル値で char_classes を引くことで定義を一元化 */
+  return char_classes[(unsigned char)c] & CC_OPERATOR;
 }
 /**
  * @brief 文字が符号反転トークンかどうかを判定する。
  * @param c 判定対象の文字。
  * @return 'S' であれば true。
  */
-bool is_sign_inversion(char c) { return c == 'S'; }
+bool is_sign_inversion(char c) { return char_classes[(unsigned char)c] & CC_SIGN_INVERSION; }
 /**
  * @brief 現在位置の次の文字を参照する。
  * @param p 入力文字列ポインタへのポインタ。
@@ -1015,17 +7135,68 @@ bool is_memory_sub(char c) { return c == 'M'; }
  * @param c 判定対象の文字。
  * @return 変数名に使用可能な文字であれば true。
  */
-bool is_identifier_char(char c) { return (c >= 'a' && c <= 'z') || (c == '_'); }
+bool is_identifier_char(char c) { return char_classes[(unsigned char)c] & CC_IDENTIFIER; }
+
+/**
+ * @brief 8 バイトを little endian の 64 ビット値として読む。
+ */
+static uint64_t load_word(const char* s) {
+  uint64_t w;
+  memcpy(&w, s, sizeof(w));
+  return w;
+}
+
+/**
+ * @brief 先頭から続く空白の数を数える。
+ * @param s 調べる文字列 (LEX_PADDING を持つこと)。
+ * @return 空白の数。
+ *
+ * 8 バイトずつ ' ' と XOR し、0 でないバイトがあればその位置までを数える (SWAR)。
+ */
+size_t scan_spaces(const char* s) {
+  size_t n = 0;
+  for (;;) {
+    uint64_t x = load_word(s + n) ^ 0x2020202020202020ull;
+    // 0 でないバイトの最上位ビットを立てる
+    uint64_t nonzero = (((x & 0x7f7f7f7f7f7f7f7full) + 0x7f7f7f7f7f7f7f7full) | x) & 0x8080808080808080ull;
+    if (nonzero) {
+      return n + __builtin_ctzll(nonzero) / 8;
+    }
+    n += 8;
+  }
+}
+
+/**
+ * @brief 先頭から続く数値の桁 (0-9 と a-f) の数を数える。
+ * @param s 調べる文字列 (LEX_PADDING を持つこと)。
+ * @return 桁の数。
+ *
+ * 10 進の桁は 8 バイトずつ '0' と XOR して 10 以上のバイトを探し (SWAR)、
+ * 止まった所が a-f なら表で 1 文字進めて続ける。
+ */
+size_t scan_number_digits(const char* s) {
+  size_t n = 0;
+  for (;;) {
+    uint64_t x = load_word(s + n) ^ 0x3030303030303030ull;
+    // 10 以上のバイト (数字でない文字) の最上位ビットを立てる
+    uint64_t other = (((x & 0x7f7f7f7f7f7f7f7full) + 0x7676767676767676ull) | x) & 0x8080808080808080ull;
+    if (!other) {
+      n += 8;
+      continue;
+    }
+    n += __builtin_ctzll(other) / 8;
+    if (!(char_classes[(unsigned char)s[n]] & CC_HEX_LETTER)) {
+      return n;
+    }
+    n++;
+  }
+}
 
 /**
  * @brief エラー処理を行い、アセンブリを生成して 'E' を表示し、終了する。
  * @param p 入力ポインタへのポインタ。
  */
 void error_exit(char** p) {
-  mprintf("leaq L_err(%%rip), %%rdi\n");
-  mprintf("movl $0, %%eax\n");
-  mprintf("callq " ASM_EXTERN_PRINTF "\n");
-  mprintf("movl $1, %%edi\n");
-  mprintf("callq " ASM_EXTERN_EXIT "\n");
+  emit(IR_ERROR, 0, 0);
   **p = '\0';
 }
@@ -0,0 +1,93 @@
+#ifndef CALC_H
+#define CALC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * @file calc.h
+ * @brief 電卓式コンパイラを他のプログラムに組み込むための API。
+ *
+ * calc.c を -DCALC_NO_MAIN 付きでコンパイルしてリンクする。コンパイラの状態は
+ * すべて CalcContext にあり、コンテキストを分ければ複数のスレッドで同時に
+ * コンパイルできる (1 つのコンテキストを同時に使うことはできない)。
+ *
+ * コンテキストの初期化中とコンパイル中にメモリが足りなくなったときは、
+ * 標準エラーに "out of memory" と出力してプロセスを終了する (呼び出し元には
+ * 戻らない)。
+ */
+
+typedef struct CalcContext CalcContext;
+
+/**
+ * @brief 生成したアセンブリを受け取るコールバック。
+ * @param user calc_compile に渡した値。
+ * @param data アセンブリの断片 (NUL 終端とは限らない)。
+ * @param size data のバイト数。
+ */
+typedef void (*CalcSink)(void* user, const char* data, size_t size);
+
+/**
+ * @brief コンテキストを作り、ビルトイン関数と前置きの関数を読み込む。
+ * @return 作ったコンテキスト。コンテキスト自体を確保できなければ NULL
+ * (関数の読み込み中に足りなくなればプロセスを終了する)。
+ */
+CalcContext* calc_context_new(void);
+
+/**
+ * @brief コンテキストを破棄する。
+ * @param c calc_context_new で作ったコンテキスト (NULL なら何もしない)。
+ */
+void calc_context_free(CalcContext* c);
+
+/**
+ * @brief "--batch" などのモードのオプションを有効にする。
+ * @param c 対象のコンテキスト。
+ * @param option コマンドラインと同じ綴りのオプション。
+ * @return 知っているオプションなら 1、そうでなければ 0。
+ *
+ * 有効にしたモードは calc_clear_options を呼ぶまで続く。
+ */
+int calc_set_option(CalcContext* c, const char* option);
+
+/**
+ * @brief モードのオプションをすべて無効に戻す。
+ * @param c 対象のコンテキスト。
+ */
+void calc_clear_options(CalcContext* c);
+
+/**
+ * @brief 有効にしたモードの組み合わせを確かめる。
+ * @param c 対象のコンテキスト。
+ * @return 使えない組み合わせならその理由、使えるなら NULL。
+ */
+const char* calc_check_options(const CalcContext* c);
+
+/**
+ * @brief 電卓式を 1 つコンパイルし、アセンブリを sink に渡す。
+ * @param c 対象のコンテキスト。
+ * @param src 電卓式。
+ * @param sink アセンブリを受け取るコールバック。
+ * @param user sink にそのまま渡す値。
+ * @return 成功時0、入力が不正な場合は1などのエラーコード。メモリが足りなく
+ * なったときはエラーコードを返さずにプロセスを終了する。
+ *
+ * 前回の呼び出しで定義した関数や変数は持ち越さない。関数が多い式では内部で
+ * スレッドを使って変換するが、sink は呼び出し元のスレッドからしか呼ばない。
+ */
+int calc_compile(CalcContext* c, const char* src, CalcSink sink, void* user);
+
+/**
+ * @brief ファイル (標準入力など) から電卓式を読みながらコンパイルする。
+ * @param c 対象のコンテキスト。
+ * @param in 電卓式を読むファイル。改行とタブは空白として扱う。
+ * @param sink アセンブリを受け取るコールバック。
+ * @param user sink にそのまま渡す値。
+ * @return 成功時0、入力が不正な場合は1などのエラーコード。
+ *
+ * 最上位の ; で区切られた文を少しずつ読んで解析するので、入力全体を
+ * メモリに置かない (関数定義の IR は最後まで保持する)。
+ */
+int calc_compile_file(CalcContext* c, FILE* in, CalcSink sink, void* user);
+
+#endif
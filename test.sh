@@ -21,11 +21,16 @@ fi
 set -euo pipefail
 
 if [[ $# -lt 2 ]]; then
-    echo "Usage: $0 <parser.c> <testcases.txt> [--makefile <path>]" >&2
+    echo "Usage: $0 <parser.c> <testcases.txt> [--makefile <path>] [--freestanding] [--keep-frames] [--server | --input | --profile]" >&2
     exit 1
 fi
 
 cli_makefile=""
+parser_flags=()
+program_target=program
+use_server=0
+use_input=0
+use_profile=0
 args=()
 
 while [[ $# -gt 0 ]]; do
@@ -38,6 +43,27 @@ while [[ $# -gt 0 ]]; do
 			cli_makefile=$2
 			shift 2
 			;;
+		--freestanding)
+			parser_flags+=("--freestanding")
+			program_target=program-freestanding
+			shift
+			;;
+		--keep-frames)
+			parser_flags+=("--keep-frames")
+			shift
+			;;
+		--server)
+			use_server=1
+			shift
+			;;
+		--input)
+			use_input=1
+			shift
+			;;
+		--profile)
+			use_profile=1
+			shift
+			;;
 		--)
 			shift
 			while [[ $# -gt 0 ]]; do
@@ -54,10 +80,15 @@ while [[ $# -gt 0 ]]; do
 done
 
 if (( ${#args[@]} != 2 )); then
-    echo "Usage: $0 <parser.c> <testcases.txt> [--makefile <path>]" >&2
+    echo "Usage: $0 <parser.c> <testcases.txt> [--makefile <path>] [--freestanding] [--server | --input | --profile]" >&2
     exit 1
 fi
 
+if (( use_profile )) && [[ $use_server == 1 || $use_input == 1 || $program_target == program-freestanding ]]; then
+	echo "--profile cannot be combined with --server, --input or --freestanding" >&2
+	exit 1
+fi
+
 parser_src=${args[0]}
 testcases_file=${args[1]}
 
@@ -82,6 +113,7 @@ mkdir -p "$output_dir"
 parser_bin="$output_dir/${parser_base}_compiler"
 asm_tmp="$output_dir/${parser_base}_test_temp.s"
 program_tmp="$output_dir/${parser_base}_test_temp_program"
+profile_tmp="$output_dir/${parser_base}_test_temp.profile"
 
 select_makefile() {
 	if [[ -n $cli_makefile ]]; then
@@ -111,19 +143,20 @@ fi
 
 make -s -f "$makefile" parser SRC="$parser_path" BIN="$parser_bin"
 
+server_prefix="$output_dir/${parser_base}_server_temp"
+
 cleanup() {
-	rm -f "$asm_tmp" "$program_tmp"
+	rm -f "$asm_tmp" "$program_tmp" "$profile_tmp" "$server_prefix".*
 }
 
 trap cleanup EXIT
 
-total=0
-failed=0
-
-while IFS= read -r raw_line || [[ -n $raw_line ]]; do
+# テストケースの 1 行から expression と expected を取り出す。飛ばす行なら 1 を返す。
+parse_case() {
+	local raw_line=$1
 	line=$(printf "%s" "$raw_line" | sed -e 's/^[[:space:]]*//' -e 's/[[:space:]]*$//')
-	[[ -z $line ]] && continue
-	[[ ${line:0:1} == "#" ]] && continue
+	[[ -z $line ]] && return 1
+	[[ ${line:0:1} == "#" ]] && return 1
 	if [[ ${line:0:1} == "-" ]]; then
 		line=${line#-}
 		line=$(printf "%s" "$line" | sed -e 's/^[[:space:]]*//')
@@ -136,12 +169,51 @@ while IFS= read -r raw_line || [[ -n $raw_line ]]; do
 	expression=$(printf "%s" "$expression" | sed -e 's/^[[:space:]]*//' -e 's/[[:space:]]*$//')
 	expected=${line##*,}
 	expected=$(printf "%s" "$expected" | sed -e 's/^[[:space:]]*//' -e 's/[[:space:]]*$//')
-	[[ -z $expression ]] && continue
+	[[ -z $expression ]] && return 1
+	return 0
+}
+
+# --server では全ケースを 1 つのコンパイラのプロセスに流し、".end" の行で分けておく
+if (( use_server )); then
+	while IFS= read -r raw_line || [[ -n $raw_line ]]; do
+		parse_case "$raw_line" || continue
+		printf "%s\n" "$expression"
+	done < "$testcases_path" > "$server_prefix.requests"
+	"$parser_bin" ${parser_flags[@]+"${parser_flags[@]}"} --server < "$server_prefix.requests" > "$server_prefix.responses"
+	awk -v prefix="$server_prefix" 'BEGIN { n = 1 } /^\.end$/ { close(prefix "." n ".s"); n++; next } { print > (prefix "." n ".s") }' "$server_prefix.responses"
+fi
+
+total=0
+failed=0
+
+while IFS= read -r raw_line || [[ -n $raw_line ]]; do
+	parse_case "$raw_line" || continue
 	(( ++total ))
 
-	"$parser_bin" "$expression" > "$asm_tmp"
+	if (( use_profile )); then
+		# 計測版を実行してプロファイルを取り、それを使ってコンパイルし直したものを確かめる
+		# (E で終わればプロファイルは書き出されないので、使わずにコンパイルする)
+		rm -f "$profile_tmp"
+		"$parser_bin" ${parser_flags[@]+"${parser_flags[@]}"} --profile-generate="$profile_tmp" "$expression" > "$asm_tmp"
+		make -s -f "$makefile" "$program_target" ASM="$asm_tmp" OUT="$program_tmp"
+		set +e
+		profile_output=$("$program_tmp" 2>&1)
+		set -e
+		profile_actual=${profile_output%%$'\n'*}
+		profile_actual=${profile_actual//$'\r'/}
+		profile_actual=$(printf "%s" "$profile_actual" | sed -e 's/[[:space:]]*$//')
+		profile_flags=()
+		[[ -f $profile_tmp ]] && profile_flags=("--profile-use=$profile_tmp")
+		"$parser_bin" ${parser_flags[@]+"${parser_flags[@]}"} ${profile_flags[@]+"${profile_flags[@]}"} "$expression" > "$asm_tmp"
+	elif (( use_server )); then
+		cp "$server_prefix.$total.s" "$asm_tmp"
+	elif (( use_input )); then
+		printf "%s\n" "$expression" | "$parser_bin" ${parser_flags[@]+"${parser_flags[@]}"} --input > "$asm_tmp"
+	else
+		"$parser_bin" ${parser_flags[@]+"${parser_flags[@]}"} "$expression" > "$asm_tmp"
+	fi
 
-	make -s -f "$makefile" program ASM="$asm_tmp" OUT="$program_tmp"
+	make -s -f "$makefile" "$program_target" ASM="$asm_tmp" OUT="$program_tmp"
 
 	set +e
 	program_output=$("$program_tmp" 2>&1)
@@ -152,7 +224,10 @@ while IFS= read -r raw_line || [[ -n $raw_line ]]; do
 	actual=${actual//$'\r'/}
 	actual=$(printf "%s" "$actual" | sed -e 's/[[:space:]]*$//')
 
-	if [[ "$actual" == "$expected" ]]; then
+	if (( use_profile )) && [[ "$profile_actual" != "$expected" ]]; then
+		echo "[$total] FAIL: $expression => expected '$expected' but the instrumented program got '$profile_actual'"
+		(( ++failed ))
+	elif [[ "$actual" == "$expected" ]]; then
 		echo "[$total] PASS: $expression => $actual"
 	else
 		echo "[$total] FAIL: $expression => expected '$expected' but got '$actual' (exit $cmd_status)"
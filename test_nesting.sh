@@ -0,0 +1,166 @@
+#!/usr/bin/env sh
+
+if [ -z "${TEST_SH_PREFERRED_SHELL:-}" ]; then
+    if command -v zsh >/dev/null 2>&1; then
+        export TEST_SH_PREFERRED_SHELL=zsh
+        exec zsh "$0" "$@"
+    elif command -v bash >/dev/null 2>&1; then
+        export TEST_SH_PREFERRED_SHELL=bash
+        exec bash "$0" "$@"
+    else
+        echo "Error: this script requires either zsh or bash" >&2
+        exit 1
+    fi
+fi
+
+if [ -n "${ZSH_VERSION:-}" ]; then
+    setopt KSH_ARRAYS
+    setopt SH_WORD_SPLIT
+fi
+
+set -euo pipefail
+
+if [[ $# -lt 1 ]]; then
+    echo "Usage: $0 <parser.c> [--makefile <path>]" >&2
+    exit 1
+fi
+
+cli_makefile=""
+args=()
+
+while [[ $# -gt 0 ]]; do
+	case "$1" in
+		--makefile|-m)
+			if [[ $# -lt 2 ]]; then
+				echo "Missing path after $1" >&2
+				exit 1
+			fi
+			cli_makefile=$2
+			shift 2
+			;;
+		*)
+			args+=("$1")
+			shift
+			;;
+	esac
+done
+
+if (( ${#args[@]} != 1 )); then
+    echo "Usage: $0 <parser.c> [--makefile <path>]" >&2
+    exit 1
+fi
+
+parser_src=${args[0]}
+
+if [[ ! -f $parser_src ]]; then
+	echo "Parser source not found: $parser_src" >&2
+	exit 1
+fi
+
+parser_path=$(cd -- "$(dirname "$parser_src")" && pwd)/$(basename "$parser_src")
+parser_base=$(basename "$parser_path" .c)
+
+cwd=$(pwd)
+output_dir="$cwd/output"
+mkdir -p "$output_dir"
+
+parser_bin="$output_dir/${parser_base}_compiler"
+input_tmp="$output_dir/${parser_base}_nesting_test_temp.txt"
+asm_tmp="$output_dir/${parser_base}_nesting_test_temp.s"
+program_tmp="$output_dir/${parser_base}_nesting_test_temp_program"
+
+select_makefile() {
+	if [[ -n $cli_makefile ]]; then
+		printf "%s\n" "$cli_makefile"
+		return 0
+	fi
+
+	override_tmp=${MAKEFILE_OVERRIDE:-}
+	if [[ -n $override_tmp ]]; then
+		printf "%s\n" "$override_tmp"
+		return 0
+	fi
+
+	case "$(uname -s)" in
+		Darwin) printf "%s/Makefile.macos\n" "$cwd" ;;
+		Linux) printf "%s/Makefile.linux\n" "$cwd" ;;
+		*) printf "%s/Makefile.macos\n" "$cwd" ;;
+	esac
+}
+
+makefile=$(select_makefile)
+
+if [[ ! -f $makefile ]]; then
+	echo "Makefile not found: $makefile" >&2
+	exit 1
+fi
+
+make -s -f "$makefile" parser SRC="$parser_path" BIN="$parser_bin"
+
+cleanup() {
+	rm -f "$input_tmp" "$asm_tmp" "$program_tmp"
+}
+
+trap cleanup EXIT
+
+now_ms() {
+	perl -MTime::HiRes=time -e 'printf "%d\n", time() * 1000'
+}
+
+# 入れ子の形ごとに、深さ 10000 と 100000 の電卓式を生成する perl の式 ($n が深さ)
+shapes=(
+	'print "1+(" x $n, "1", ")" x $n, "="'
+	'print "\$if(1){" x $n, "1", "}{0}" x $n, "="'
+	'print "\@max(0," x $n, "1", ")" x $n, "="'
+)
+# 深さ 100000 のプログラムの期待値 (実行時のスタックに収まる形だけ実行する)
+expected=(100001 1 "")
+
+total=0
+failed=0
+
+for i in "${!shapes[@]}"; do
+	shape=${shapes[$i]}
+	elapsed=()
+	for n in 10000 100000; do
+		(( ++total ))
+		perl -e "my \$n = $n; $shape" > "$input_tmp"
+		start=$(now_ms)
+		set +e
+		# 入れ子の深さに C の再帰を使っていないことを、小さいスタックで確かめる
+		(ulimit -s 1024 && "$parser_bin" --input="$input_tmp" > "$asm_tmp")
+		status=$?
+		set -e
+		elapsed+=($(( $(now_ms) - start )))
+		if (( status != 0 )); then
+			echo "[$total] FAIL: depth $n of '$shape' => compiler exited with $status"
+			(( ++failed ))
+			continue
+		fi
+		if [[ $n == 100000 && -n ${expected[$i]} ]]; then
+			make -s -f "$makefile" program ASM="$asm_tmp" OUT="$program_tmp"
+			actual=$("$program_tmp" 2>&1 || true)
+			if [[ $actual != "${expected[$i]}" ]]; then
+				echo "[$total] FAIL: depth $n of '$shape' => expected '${expected[$i]}' but got '$actual'"
+				(( ++failed ))
+				continue
+			fi
+		fi
+		echo "[$total] PASS: depth $n of '$shape' (${elapsed[${#elapsed[@]} - 1]} ms)"
+	done
+	# 深さが 10 倍なら時間もおおよそ 10 倍 (計測の揺れを見込んで 30 倍まで) に収まること
+	(( ++total ))
+	if (( elapsed[1] > 30 * elapsed[0] + 200 )); then
+		echo "[$total] FAIL: '$shape' does not scale linearly (${elapsed[0]} ms -> ${elapsed[1]} ms)"
+		(( ++failed ))
+	else
+		echo "[$total] PASS: '$shape' scales linearly (${elapsed[0]} ms -> ${elapsed[1]} ms)"
+	fi
+done
+
+if [[ $failed -ne 0 ]]; then
+	echo "Summary: $failed / $total test cases failed."
+	exit 1
+else
+	echo "Summary: All $total test cases passed."
+fi